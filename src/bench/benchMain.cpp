@@ -0,0 +1,288 @@
+// Host micro-benchmarks for the [env:bench] build
+//
+//   program [--benchmark_filter=TEXT] [--benchmark_out=FILE] [--benchmark_min_time=SECONDS]
+//
+// Times the CAN receive path per message type, the dimming curve lookup, the
+// status frame encode and a full WiFi provisioning exchange against the
+// native HAL, and writes the results as JSON in the Google Benchmark layout
+// (stdout unless --benchmark_out is given), so existing tooling can compare
+// runs.
+//
+// Built with DEBUG=0 so the timings match a release build. Times include the
+// fake HAL (std::map NVS, no-op CAN send), not the ESP32 drivers.
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../main.cpp"
+
+struct Result
+{
+    std::string name;
+    uint64_t iterations;
+    double nsPerIteration;
+};
+
+static std::vector<Result> results;
+static const char *filter = "";
+static double minSeconds = 0.2;
+
+/**
+ * Run body in growing batches until one batch takes at least minSeconds
+ */
+template <typename Body>
+static void bench(const char *name, Body body)
+{
+    if (!strstr(name, filter)) {
+        return;
+    }
+    uint64_t iterations = 1;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; i++) {
+            body();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds >= minSeconds || iterations >= (1ULL << 40)) {
+            results.push_back({name, iterations, seconds * 1e9 / iterations});
+            fprintf(stderr, "%-32s %12.1f ns %14llu iterations\n", name, results.back().nsPerIteration,
+                    (unsigned long long)iterations);
+            return;
+        }
+        // Aim 40% past the target so the next batch is usually the last
+        double scale = seconds > 0 ? minSeconds * 1.4 / seconds : 10;
+        iterations = (uint64_t)(iterations * (scale < 10 ? (scale > 1.5 ? scale : 1.5) : 10)) + 1;
+    }
+}
+
+static twai_message_t frame(uint32_t id, std::initializer_list<uint8_t> data)
+{
+    twai_message_t message = {};
+    message.identifier = id;
+    for (uint8_t byte : data) {
+        message.data[message.data_length_code++] = byte;
+    }
+    return message;
+}
+
+static void rx(const twai_message_t &message)
+{
+    canHelper::handle_rx_message(message);
+}
+
+static void writeJson(FILE *out)
+{
+    fprintf(out, "{\n  \"context\": {\n    \"executable\": \"trailcurrent-bench\",\n");
+    fprintf(out, "    \"library_build_type\": \"release\"\n  },\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"run_type\": \"iteration\", \"iterations\": %llu, "
+                     "\"real_time\": %.3f, \"cpu_time\": %.3f, \"time_unit\": \"ns\"}%s\n",
+                r.name.c_str(), (unsigned long long)r.iterations, r.nsPerIteration, r.nsPerIteration,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *outPath = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--benchmark_filter=", 19) == 0) {
+            filter = argv[i] + 19;
+        } else if (strncmp(argv[i], "--benchmark_out=", 16) == 0) {
+            outPath = argv[i] + 16;
+        } else if (strncmp(argv[i], "--benchmark_min_time=", 21) == 0) {
+            minSeconds = atof(argv[i] + 21);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    setup();
+
+    // ---------------------------------------------------- CAN RX, per message type
+
+    twai_message_t otaTrigger = frame(0x00, {0x12, 0x34, 0x56});  // Other device: hostname compare only
+    bench("rx/0x00_ota_trigger", [&] { rx(otaTrigger); });
+
+    twai_message_t wifiShort = frame(WIFI_CONFIG_ID, {0x01, wifiConfig::PROVISION_SET_CREDENTIALS});
+    bench("rx/0x01_wifi_single_frame", [&] { rx(wifiShort); });  // Rejected as malformed, with a reply
+
+    uint8_t level = 0;
+
+    // Group 2 holds channels 0, 3 and 6 on this node
+    twai_message_t groupConfig = frame(GROUP_CONFIG_ID, {2, nodeAddress::address, 0x49});
+    rx(groupConfig);
+    channelGroups::loop();
+
+    twai_message_t groupSet = frame(GROUP_COMMAND_ID, {2, channelGroups::GROUP_SET, 0});
+    bench("rx/0x02_group_set", [&] {
+        groupSet.data[2] = ++level;
+        rx(groupSet);
+    });
+
+    twai_message_t groupToggle = frame(GROUP_COMMAND_ID, {2, channelGroups::GROUP_TOGGLE});
+    bench("rx/0x02_group_toggle", [&] { rx(groupToggle); });
+
+    twai_message_t brightness = frame(21, {3, 0});
+    bench("rx/0x15_brightness", [&] {
+        brightness.data[1] = ++level;
+        rx(brightness);
+    });
+
+    twai_message_t brightnessFade = frame(21, {3, 0, 0xF4, 0x01});
+    bench("rx/0x15_brightness_fade", [&] {
+        brightnessFade.data[1] = ++level;
+        rx(brightnessFade);
+    });
+
+    twai_message_t toggle = frame(24, {5});
+    bench("rx/0x18_toggle", [&] { rx(toggle); });
+
+    twai_message_t allOnOff = frame(24, {8, 0});
+    bench("rx/0x18_all_on_off", [&] {
+        allOnOff.data[1] ^= 1;
+        rx(allOnOff);
+    });
+
+    twai_message_t bulk = frame(CAN_BULK_BRIGHTNESS_ID, {0, 32, 64, 96, 128, 160, 192, 224});
+    bench("rx/0x23_bulk_brightness", [&] {
+        bulk.data[0] = ++level;
+        rx(bulk);
+    });
+
+    twai_message_t masked = frame(CAN_MASKED_BRIGHTNESS_ID, {0x29, 0, 100, 200});
+    bench("rx/0x24_masked_brightness", [&] {
+        masked.data[1] = ++level;
+        rx(masked);
+    });
+
+    twai_message_t sceneSave = frame(SCENE_ID, {0x02, 3, 0xF4, 0x01});
+    rx(sceneSave);
+    twai_message_t sceneRecall = frame(SCENE_ID, {0x01, 3});
+    bench("rx/0x25_scene_recall", [&] { rx(sceneRecall); });
+
+    twai_message_t curveConfig = frame(CURVE_CONFIG_ID, {0x0F, dimmingCurves::CURVE_LINEAR});
+    bench("rx/0x26_curve_config", [&] {
+        curveConfig.data[1] ^= dimmingCurves::CURVE_LINEAR ^ dimmingCurves::CURVE_PERCEPTUAL;  // A real change every time
+        rx(curveConfig);
+    });
+
+    bench("rx/0x27_group_config", [&] {
+        groupConfig.data[2] ^= 0x80;  // Membership changes, the NVS write waits for loop()
+        rx(groupConfig);
+    });
+    channelGroups::loop();
+
+    twai_message_t sequence = frame(30, {0});
+    bench("rx/0x1E_sequence", [&] { rx(sequence); });
+    lightSequences::stop();
+
+    twai_message_t uploadAbort = frame(SEQUENCE_UPLOAD_ID, {0x04});
+    bench("rx/0x1F_upload_abort", [&] { rx(uploadAbort); });
+
+    twai_message_t latencyQuery = frame(LATENCY_QUERY_ID, {0xFF});
+    bench("rx/0x22_latency_query", [&] { rx(latencyQuery); });
+
+    // Begin: first frame plus five consecutive frames, then the update task's reply
+    uint8_t begin[37] = {canUpdate::UPDATE_BEGIN, 0x00, 0x10};  // 4 KiB image, zero SHA-256
+    std::vector<twai_message_t> updateBegin;
+    updateBegin.push_back(frame(CAN_UPDATE_ID, {0x10, sizeof(begin)}));
+    for (uint8_t i = 0; i < 6; i++) {
+        updateBegin.back().data[updateBegin.back().data_length_code++] = begin[i];
+    }
+    for (size_t offset = 6, sequence = 1; offset < sizeof(begin); offset += 7, sequence++) {
+        twai_message_t message = frame(CAN_UPDATE_ID, {(uint8_t)(0x20 | (sequence & 0x0F))});
+        for (size_t i = offset; i < offset + 7 && i < sizeof(begin); i++) {
+            message.data[message.data_length_code++] = begin[i];
+        }
+        updateBegin.push_back(message);
+    }
+    bench("rx/0x3E_update_begin", [&] {
+        updateBegin[0].data[3] = ++level;  // A new image size every time, so never a resume
+        for (const twai_message_t &message : updateBegin) {
+            rx(message);
+        }
+        hal::native::runTasks();  // Update task handles the Begin and replies
+        canUpdate::loop();
+    });
+    if (!canUpdate::active && strstr("rx/0x3E_update_begin", filter)) {
+        fprintf(stderr, "rx/0x3E_update_begin did not open a session\n");
+        return 1;
+    }
+    rx(frame(CAN_UPDATE_ID, {0x01, canUpdate::UPDATE_ABORT}));
+    hal::native::runTasks();
+    canUpdate::loop();
+
+    twai_message_t unhandled = frame(0x7F, {0});
+    bench("rx/unhandled_id", [&] { rx(unhandled); });
+
+    twai_message_t tooShort = frame(21, {3});
+    bench("rx/short_frame", [&] { rx(tooShort); });
+
+    // ------------------------------------------------------------ curve lookup
+
+    volatile uint32_t dutySink = 0;
+    uint16_t position = 0;
+    bench("pwm/curve_duty", [&] {
+        position += 97;  // Mix of whole and fractional levels
+        dutySink = dimmingCurves::duty(position & 7, position);
+    });
+    (void)dutySink;
+
+    // ------------------------------------------------------------- status frame
+
+    bench("status/changed", [&] {
+        outputState::setChannel(0, ++level);
+        hal::native::nowUs += STATUS_COALESCE_MS * 1000;
+        canHelper::send_status_message();
+    });
+
+    bench("status/idle", [&] {
+        hal::native::nowUs += 1000;
+        canHelper::send_status_message();
+    });
+
+    // ----------------------------------------------------- WiFi provisioning
+
+    // One ISO-TP message: first frame plus consecutive frames, all within the first block
+    const char *ssid = "TrailerAP";
+    const char *password = "secret-password";
+    std::vector<uint8_t> payload = {wifiConfig::PROVISION_SET_CREDENTIALS, (uint8_t)strlen(ssid)};
+    payload.insert(payload.end(), ssid, ssid + strlen(ssid));
+    payload.insert(payload.end(), password, password + strlen(password));
+
+    std::vector<twai_message_t> provisioning;
+    provisioning.push_back(frame(WIFI_CONFIG_ID, {0x10, (uint8_t)payload.size()}));
+    for (uint8_t i = 0; i < 6; i++) {
+        provisioning.back().data[provisioning.back().data_length_code++] = payload[i];
+    }
+    for (size_t offset = 6, sequence = 1; offset < payload.size(); offset += 7, sequence++) {
+        twai_message_t message = frame(WIFI_CONFIG_ID, {(uint8_t)(0x20 | (sequence & 0x0F))});
+        for (size_t i = offset; i < offset + 7 && i < payload.size(); i++) {
+            message.data[message.data_length_code++] = payload[i];
+        }
+        provisioning.push_back(message);
+    }
+
+    bench("wifi/provision_full", [&] {
+        for (const twai_message_t &message : provisioning) {
+            rx(message);
+        }
+        wifiConfig::loop();  // Stores the credentials and sends the reply
+    });
+    if (strcmp(runtimeSsid, ssid) != 0 && strstr("wifi/provision_full", filter)) {
+        fprintf(stderr, "wifi/provision_full did not store the credentials\n");
+        return 1;
+    }
+
+    FILE *out = outPath ? fopen(outPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot open %s\n", outPath);
+        return 1;
+    }
+    writeJson(out);
+    if (out != stdout) fclose(out);
+    return 0;
+}
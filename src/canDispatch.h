@@ -0,0 +1,207 @@
+#pragma once
+#include "hal/hal.h"
+#include "nodeAddress.h"
+
+#define CAN_DISPATCH_TABLE_SIZE CAN_NODE_ID_STRIDE // Handled function IDs must be below this
+#define CAN_STANDARD_ID_COUNT 2048
+
+/**
+ * Direct-indexed CAN receive dispatcher
+ *
+ * Modules register a handler and a minimum DLC per identifier during setup,
+ * before the RX callback is installed. Dispatching a frame is then a single
+ * table lookup plus a length check, and adding a message type never touches
+ * this file or the other handlers.
+ *
+ * The table is indexed by function ID. Handlers registered with on() are
+ * per-node and answer at nodeAddress::id(functionId); those registered with
+ * onShared() answer at the function ID itself on every node.
+ *
+ * acceptanceFilter() turns the registered identifiers into a TWAI hardware
+ * filter, so the controller drops most unrelated bus traffic before it costs
+ * an RX interrupt, a queue slot and a callback.
+ */
+namespace canDispatch
+{
+    typedef void (*Handler)(const twai_message_t &message);
+
+    struct Route
+    {
+        Handler handler;
+        uint8_t minLength;
+        bool shared;  // Same bus ID on every node
+    };
+
+    Route routes[CAN_DISPATCH_TABLE_SIZE] = {};
+
+    // Frames dropped before reaching a handler
+    volatile uint32_t unhandledFrames = 0;
+    volatile uint32_t shortFrames = 0;
+
+    bool addRoute(uint32_t functionId, uint8_t minLength, Handler handler, bool shared)
+    {
+        if (functionId >= CAN_DISPATCH_TABLE_SIZE || routes[functionId].handler) {
+            debugf("[CAN] ERROR: Cannot register handler for ID 0x%03X\n", functionId);
+            return false;
+        }
+        routes[functionId].handler = handler;
+        routes[functionId].minLength = minLength;
+        routes[functionId].shared = shared;
+        return true;
+    }
+
+    /**
+     * Register a per-node handler, received on nodeAddress::id(functionId)
+     * Call during setup only; the table is read without locking on the RX task
+     * @return false if the function ID is out of range or already taken
+     */
+    bool on(uint32_t functionId, uint8_t minLength, Handler handler)
+    {
+        return addRoute(functionId, minLength, handler, false);
+    }
+
+    /**
+     * Register a bus-wide handler, received on functionId by every node
+     */
+    bool onShared(uint32_t functionId, uint8_t minLength, Handler handler)
+    {
+        return addRoute(functionId, minLength, handler, true);
+    }
+
+    /**
+     * Function ID a bus identifier is routed to, or CAN_DISPATCH_TABLE_SIZE if none
+     */
+    uint32_t functionIdOf(uint32_t identifier)
+    {
+        uint32_t base = nodeAddress::base();
+        if (identifier >= base && identifier - base < CAN_DISPATCH_TABLE_SIZE) {
+            const Route &route = routes[identifier - base];
+            if (route.handler && !route.shared) {
+                return identifier - base;
+            }
+        }
+        if (identifier < CAN_DISPATCH_TABLE_SIZE && routes[identifier].handler && routes[identifier].shared) {
+            return identifier;
+        }
+        return CAN_DISPATCH_TABLE_SIZE;
+    }
+
+    bool isHandled(uint32_t identifier)
+    {
+        return functionIdOf(identifier) < CAN_DISPATCH_TABLE_SIZE;
+    }
+
+    // Identifiers matched by a code/mask pair: code bits where the mask is 0, anything where it is 1
+    struct IdCover
+    {
+        uint16_t code;
+        uint16_t mask;
+    };
+
+    /**
+     * Smallest code/mask pair covering the IDs whose bits under select equal value
+     */
+    IdCover cover(const uint16_t *ids, uint8_t count, uint16_t select, uint16_t value)
+    {
+        IdCover result = {0, 0};
+        bool first = true;
+        for (uint8_t i = 0; i < count; i++) {
+            if ((ids[i] & select) != value) {
+                continue;
+            }
+            if (first) {
+                result.code = ids[i];
+                first = false;
+            }
+            result.mask |= ids[i] ^ result.code;
+        }
+        result.code &= ~result.mask;
+        return result;
+    }
+
+    uint16_t coverSize(const IdCover &c)
+    {
+        return 1 << __builtin_popcount(c.mask);
+    }
+
+    uint16_t unionSize(const IdCover &a, const IdCover &b)
+    {
+        bool overlap = ((a.code ^ b.code) & ~a.mask & ~b.mask) == 0;
+        return coverSize(a) + coverSize(b) - (overlap ? 1 << __builtin_popcount(a.mask & b.mask) : 0);
+    }
+
+    /**
+     * Hardware acceptance filter admitting every registered bus identifier
+     *
+     * One code/mask pair covers all IDs by masking the bits they differ in.
+     * Dual filter mode gives two pairs, so the IDs are also tried split in two
+     * on each of the 11 ID bits; the layout passing the fewest IDs wins. RTR
+     * frames are rejected in hardware (the dispatcher ignores them anyway) and
+     * the data bytes are don't-care. The result is a superset of the handled
+     * IDs; the rest still end up in unhandledFrames.
+     * Call after every handler is registered.
+     * @param passedIds Set to the number of standard IDs the filter passes
+     */
+    twai_filter_config_t acceptanceFilter(uint16_t *passedIds = nullptr)
+    {
+        uint16_t ids[CAN_DISPATCH_TABLE_SIZE];
+        uint8_t count = 0;
+        for (uint16_t id = 0; id < CAN_DISPATCH_TABLE_SIZE; id++) {
+            if (routes[id].handler) {
+                ids[count++] = routes[id].shared ? id : nodeAddress::id(id);
+            }
+        }
+        if (count == 0) {
+            if (passedIds) *passedIds = CAN_STANDARD_ID_COUNT;
+            return TWAI_FILTER_CONFIG_ACCEPT_ALL();
+        }
+
+        // Single filter: ID in bits 31-21, RTR bit 20 must be 0, data bytes don't care
+        IdCover all = cover(ids, count, 0, 0);
+        uint16_t best = coverSize(all);
+        twai_filter_config_t filter = {(uint32_t)all.code << 21, ((uint32_t)all.mask << 21) | 0x000FFFFF, true};
+
+        // Dual filter: first ID in bits 31-21 (RTR bit 20), second in bits 15-5 (RTR bit 4)
+        for (uint16_t bit = 1; bit < CAN_STANDARD_ID_COUNT; bit <<= 1) {
+            uint8_t withBit = 0;
+            for (uint8_t i = 0; i < count; i++) {
+                withBit += (ids[i] & bit) != 0;
+            }
+            if (withBit == 0 || withBit == count) {
+                continue;
+            }
+            IdCover clear = cover(ids, count, bit, 0);
+            IdCover set = cover(ids, count, bit, bit);
+            uint16_t passed = unionSize(clear, set);
+            if (passed >= best) {
+                continue;
+            }
+            best = passed;
+            filter.acceptance_code = ((uint32_t)clear.code << 21) | ((uint32_t)set.code << 5);
+            filter.acceptance_mask = ((uint32_t)clear.mask << 21) | ((uint32_t)set.mask << 5) | 0x000F000F;
+            filter.single_filter = false;
+        }
+
+        if (passedIds) *passedIds = best;
+        return filter;
+    }
+
+    /**
+     * Route a received frame to its handler
+     */
+    void dispatch(const twai_message_t &message)
+    {
+        uint32_t functionId = functionIdOf(message.identifier);
+        if (message.rtr || functionId >= CAN_DISPATCH_TABLE_SIZE) {
+            unhandledFrames++;
+            return;
+        }
+
+        const Route &route = routes[functionId];
+        if (message.data_length_code < route.minLength) {
+            shortFrames++;
+        } else {
+            route.handler(message);
+        }
+    }
+}
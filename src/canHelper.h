@@ -1,349 +1,421 @@
 #pragma once
+#include "hal/hal.h"
 #include "globals.h"
-#include <TwaiTaskBased.h>
 #include "lightSequences.h"
-#include <OtaUpdate.h>
 #include "wifiConfig.h"
+#include "otaService.h"
+#include "sequenceStore.h"
+#include "outputState.h"
+#include "canDispatch.h"
+#include "latencyStats.h"
+#include "traceLog.h"
+#include "scenes.h"
+#include "channelGroups.h"
+#include "dimmingCurves.h"
+#include "pwmOutput.h"
+#include "outputJournal.h"
+#include "canTx.h"
+#include "nodeAddress.h"
+#include "canUpdate.h"
+#include "otaStream.h"
 
 // Forward declare otaUpdate (defined in main.cpp)
 extern OtaUpdate otaUpdate;
 
 #define CAN_RX 13
 #define CAN_TX 15
+// Function IDs; per-node messages go out on nodeAddress::id() of these
 #define CAN_SEND_MESSAGE_ID 0x1B
-#define STATUS_TX_INTERVAL_MS 33
-
-int aryLightValues[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+#define BOOT_REPORT_ID 0x19         // Sent once when CAN comes up (module to bus)
+#define CAN_BULK_BRIGHTNESS_ID 0x23   // All 8 levels in one frame
+#define CAN_MASKED_BRIGHTNESS_ID 0x24 // Levels for a subset of channels
+#define STATUS_TX_INTERVAL_MS 33   // Former fixed status rate, kept to count suppressed frames
+#define STATUS_COALESCE_MS 25      // Minimum spacing of change-driven status frames
+#define STATUS_HEARTBEAT_MS 1000   // Status interval while nothing changes
 
 namespace canHelper
 {
+    // Origin of the frame being handled (RX task only), attached to the output changes it makes
+    outputState::Stamp rxStamp = {0, LATENCY_NO_SOURCE};
+
     /**
      * Handle OTA trigger from CAN message ID 0x0
      * Format: 3 bytes [MAC byte 3, MAC byte 4, MAC byte 5]
      * Example: 0x8A, 0x3B, 0x4C triggers device esp32-8A3B4C
      */
-    void handleOtaTrigger(const uint8_t *data) {
+    void handleOtaTrigger(const twai_message_t &message) {
+        const uint8_t *data = message.data;
         char updateForHostName[14];
-        String currentHostName = otaUpdate.getHostName();
+        auto currentHostName = otaUpdate.getHostName();  // String on the ESP32, std::string on native
 
         // Format: esp32-XXXXXX where X is MAC address in hex
         sprintf(updateForHostName, "esp32-%02X%02X%02X",
                 data[0], data[1], data[2]);
 
-        debugf("[OTA] Target hostname: %s\n", updateForHostName);
-        debugf("[OTA] Current hostname: %s\n", currentHostName.c_str());
+        tracef("[OTA] Trigger for esp32-%02X%02X%02X", data[0], data[1], data[2]);
 
         // Check if this OTA trigger is for this device
-        if (currentHostName.equals(updateForHostName)) {
-            debugln("[OTA] Hostname matched - entering OTA mode");
-            otaUpdate.waitForOta();  // Blocking call, waits for OTA update or timeout
-            debugln("[OTA] OTA mode exited - resuming normal operation");
+        if (strcmp(currentHostName.c_str(), updateForHostName) != 0) {
+            tracef("[OTA] Hostname mismatch - ignoring OTA trigger");
+        } else if (canUpdate::active) {
+            tracef("[OTA] Update over CAN in progress - ignoring OTA trigger");
         } else {
-            debugln("[OTA] Hostname mismatch - ignoring OTA trigger");
+            tracef("[OTA] Hostname matched - starting OTA task");
+            otaService::request();  // Returns immediately; the window runs on the OTA task
         }
     }
 
-    static void handle_rx_message(const twai_message_t &message)
+    /**
+     * Set a channel from a manual command
+     * Takes the channel back from any running sequence first
+     */
+    void setChannel(uint8_t channel, uint8_t value, uint32_t fadeMs = 0)
     {
-        // Process received message
-        if (message.extd)
-        {
-            debugln("Message is in Extended Format");
-        }
-        else
-        {
-            debugln("Message is in Standard Format");
+        lightSequences::releaseChannels(1 << channel);
+        outputState::setChannel(channel, value, fadeMs, &rxStamp);
+    }
+
+    /**
+     * Set several channels from a manual command as one outputState update
+     * levels is indexed by channel; only masked entries are read
+     */
+    void setChannels(uint8_t mask, const uint8_t *levels)
+    {
+        lightSequences::releaseChannels(mask);
+        outputState::set(mask, levels, nullptr, &rxStamp);
+    }
+
+    /**
+     * Handle on/off message (ID 24)
+     * Byte 0: channel 0-7 toggles that channel, 8 = all on (byte 1 = 0 for all off), 9 = all on if byte 1 = 1
+     */
+    void handleToggle(const twai_message_t &message)
+    {
+        uint8_t command = message.data[0];
+        uint8_t argument = message.data_length_code >= 2 ? message.data[1] : 0;
+        if (command < 8) {
+            setChannel(command, outputState::level(command) > 0 ? 0 : 255);
+        } else if (command == 8 || (command == 9 && argument == 1)) {
+            // Published as one update so no status frame sees a partial "all on/off"
+            lightSequences::releaseChannels(0xFF);
+            outputState::setAll((command == 8 && argument == 0) ? 0 : 255, 0, &rxStamp);
         }
-        if (!(message.rtr))
-        {
-            debugln(message.identifier);
-            debugln(message.data[0]);
-
-            // OTA trigger message (ID 0x0)
-            if (message.identifier == 0x0 && message.data_length_code >= 3) {
-                debugln("[OTA] OTA trigger received");
-                handleOtaTrigger(message.data);
-            }
-            // WiFi configuration message (ID 0x01)
-            else if (message.identifier == 0x01 && message.data_length_code >= 1) {
-                debugln("[WiFi Config] Received WiFi config message");
-                wifiConfig::handleCanMessage(message.data, message.data_length_code);
-            }
-            else if (message.identifier == 24) // Message ID of 24 are on/off messages
-            {
-                // This message contains only one byte and the value indiciates which of the 8 toggle requests was made.
-                if (message.data[0] == 0)
-                {
-                    if (aryLightValues[0] > 0)
-                    {
-                        aryLightValues[0] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[0] = 255;
-                    }
-                    analogWrite(OUTPUT01_PIN, aryLightValues[0]);
-                }
-                else if (message.data[0] == 1)
-                {
-                    if (aryLightValues[1] > 0)
-                    {
-                        aryLightValues[1] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[1] = 255;
-                    }
-                    analogWrite(OUTPUT02_PIN, aryLightValues[1]);
-                }
-                else if (message.data[0] == 2)
-                {
-                    if (aryLightValues[2] > 0)
-                    {
-                        aryLightValues[2] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[2] = 255;
-                    }
-                    analogWrite(OUTPUT03_PIN, aryLightValues[2]);
-                }
-                else if (message.data[0] == 3)
-                {
-                    if (aryLightValues[3] > 0)
-                    {
-                        aryLightValues[3] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[3] = 255;
-                    }
-                    analogWrite(OUTPUT04_PIN, aryLightValues[3]);
-                }
-                else if (message.data[0] == 4)
-                {
-                    if (aryLightValues[4] > 0)
-                    {
-                        aryLightValues[4] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[4] = 255;
-                    }
-                    analogWrite(OUTPUT05_PIN, aryLightValues[4]);
-                }
-                else if (message.data[0] == 5)
-                {
-                    if (aryLightValues[5] > 0)
-                    {
-                        aryLightValues[5] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[5] = 255;
-                    }
-                    analogWrite(OUTPUT06_PIN, aryLightValues[5]);
-                }
-                else if (message.data[0] == 6)
-                {
-                    if (aryLightValues[6] > 0)
-                    {
-                        aryLightValues[6] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[6] = 255;
-                    }
-                    analogWrite(OUTPUT07_PIN, aryLightValues[6]);
-                }
-                else if (message.data[0] == 7)
-                {
-                    if (aryLightValues[7] > 0)
-                    {
-                        aryLightValues[7] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[7] = 255;
-                    }
-                    analogWrite(OUTPUT08_PIN, aryLightValues[7]);
-                }
-                else if (message.data[0] == 8)
-                {
-                    debugln("Got HERE");
-                    debugln(message.data[1]);
-                    if (message.data[1] == 0)
-                    {
-                        aryLightValues[0] = 0;
-                        aryLightValues[1] = 0;
-                        aryLightValues[2] = 0;
-                        aryLightValues[3] = 0;
-                        aryLightValues[4] = 0;
-                        aryLightValues[5] = 0;
-                        aryLightValues[6] = 0;
-                        aryLightValues[7] = 0;
-                    }
-                    else
-                    {
-                        aryLightValues[0] = 255;
-                        aryLightValues[1] = 255;
-                        aryLightValues[2] = 255;
-                        aryLightValues[3] = 255;
-                        aryLightValues[4] = 255;
-                        aryLightValues[5] = 255;
-                        aryLightValues[6] = 255;
-                        aryLightValues[7] = 255;
-                    }
-                    analogWrite(OUTPUT01_PIN, aryLightValues[0]);
-                    analogWrite(OUTPUT02_PIN, aryLightValues[1]);
-                    analogWrite(OUTPUT03_PIN, aryLightValues[2]);
-                    analogWrite(OUTPUT04_PIN, aryLightValues[3]);
-                    analogWrite(OUTPUT05_PIN, aryLightValues[4]);
-                    analogWrite(OUTPUT06_PIN, aryLightValues[5]);
-                    analogWrite(OUTPUT07_PIN, aryLightValues[6]);
-                    analogWrite(OUTPUT08_PIN, aryLightValues[7]);
-                }
-                else if (message.data[0] == 9)
-                {
-                    debugln("Got HERE");
-                    debugln(message.data[1]);
-                    if (message.data[1] == 1)
-                    {
-                        aryLightValues[0] = 255;
-                        aryLightValues[1] = 255;
-                        aryLightValues[2] = 255;
-                        aryLightValues[3] = 255;
-                        aryLightValues[4] = 255;
-                        aryLightValues[5] = 255;
-                        aryLightValues[6] = 255;
-                        aryLightValues[7] = 255;
-                    }
-                    analogWrite(OUTPUT01_PIN, aryLightValues[0]);
-                    analogWrite(OUTPUT02_PIN, aryLightValues[1]);
-                    analogWrite(OUTPUT03_PIN, aryLightValues[2]);
-                    analogWrite(OUTPUT04_PIN, aryLightValues[3]);
-                    analogWrite(OUTPUT05_PIN, aryLightValues[4]);
-                    analogWrite(OUTPUT06_PIN, aryLightValues[5]);
-                    analogWrite(OUTPUT07_PIN, aryLightValues[6]);
-                    analogWrite(OUTPUT08_PIN, aryLightValues[7]);
-                }
-            }
-            else if (message.identifier == 21)
-            {
-                /* These messages indicate a value of 0 - 255 for the brightness level requested */
-                if (message.data[0] == 0)
-                {
-                    aryLightValues[0] = message.data[1];
-                    analogWrite(OUTPUT01_PIN, aryLightValues[0]);
-                }
-                else if (message.data[0] == 1)
-                {
-                    aryLightValues[1] = message.data[1];
-                    analogWrite(OUTPUT02_PIN, aryLightValues[1]);
-                }
-                else if (message.data[0] == 2)
-                {
-                    aryLightValues[2] = message.data[1];
-                    analogWrite(OUTPUT03_PIN, aryLightValues[2]);
-                }
-                else if (message.data[0] == 3)
-                {
-                    aryLightValues[3] = message.data[1];
-                    analogWrite(OUTPUT04_PIN, aryLightValues[3]);
-                }
-                else if (message.data[0] == 4)
-                {
-                    aryLightValues[4] = message.data[1];
-                    analogWrite(OUTPUT05_PIN, aryLightValues[4]);
-                }
-                else if (message.data[0] == 5)
-                {
-                    aryLightValues[5] = message.data[1];
-                    analogWrite(OUTPUT06_PIN, aryLightValues[5]);
-                }
-                else if (message.data[0] == 6)
-                {
-                    aryLightValues[6] = message.data[1];
-                    analogWrite(OUTPUT07_PIN, aryLightValues[6]);
-                }
-                else if (message.data[0] == 7)
-                {
-                    aryLightValues[7] = message.data[1];
-                    analogWrite(OUTPUT08_PIN, aryLightValues[7]);
-                }
-            }
-            else if (message.identifier == 30)
-            {
-                if (message.data[0] == 0)
-                {
-                    lightSequences::startInteriorSequnce01();
-                } else if (message.data[0] == 1) {
-                    lightSequences::startExteriorSequnce01();
+    }
+
+    /**
+     * Handle brightness message (ID 21)
+     * Byte 0: channel 0-7, byte 1: brightness 0-255,
+     * optional bytes 2-3: fade time in ms (little-endian) run on the LEDC hardware
+     */
+    void handleBrightness(const twai_message_t &message)
+    {
+        uint8_t channel = message.data[0];
+        if (channel >= 8) return;
+        uint16_t fadeMs = message.data_length_code >= 4 ? (message.data[2] | (message.data[3] << 8)) : 0;
+        setChannel(channel, message.data[1], fadeMs);
+    }
+
+    /**
+     * Handle bulk brightness message (ID 0x23)
+     * Bytes 0-7: brightness of channels 0-7
+     */
+    void handleBulkBrightness(const twai_message_t &message)
+    {
+        setChannels(0xFF, message.data);
+    }
+
+    /**
+     * Handle masked brightness message (ID 0x24)
+     * Byte 0: channel mask, then one brightness byte per set bit, lowest channel first
+     * (up to 7 channels; use ID 0x23 for all 8). Frames too short for the mask are ignored.
+     */
+    void handleMaskedBrightness(const twai_message_t &message)
+    {
+        uint8_t mask = message.data[0];
+        uint8_t levels[8] = {0};
+        uint8_t next = 1;
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            if (mask & (1 << ch)) {
+                if (next >= message.data_length_code) {
+                    return;
                 }
+                levels[ch] = message.data[next++];
             }
         }
+        if (mask) {
+            setChannels(mask, levels);
+        }
+    }
+
+    /**
+     * Handle sequence trigger message (ID 30)
+     * Byte 0: 0 = interior, 1 = exterior, 0x10 + slot = uploaded sequence
+     */
+    void handleSequence(const twai_message_t &message)
+    {
+        uint8_t sequence = message.data[0];
+        if (sequence >= 0x10 && sequence < 0x10 + SEQUENCE_SLOT_COUNT) {
+            sequenceStore::requestPlay(sequence - 0x10);  // Read from flash in loop()
+            return;
+        }
+        // A later trigger wins over a slot still waiting for loop()
+        if (sequence == 0) {
+            sequenceStore::requestPlay(SEQUENCE_NO_PLAY_REQUEST);
+            lightSequences::startInteriorSequnce01();
+        } else if (sequence == 1) {
+            sequenceStore::requestPlay(SEQUENCE_NO_PLAY_REQUEST);
+            lightSequences::startExteriorSequnce01();
+        }
+    }
+
+    void handleScene(const twai_message_t &message)
+    {
+        scenes::handleCanMessage(message.data, message.data_length_code, &rxStamp);
+    }
+
+    void handleGroupCommand(const twai_message_t &message)
+    {
+        channelGroups::handleCommand(message.data, message.data_length_code, &rxStamp);
+    }
+
+    void handleGroupConfig(const twai_message_t &message)
+    {
+        channelGroups::handleConfig(message.data);
+    }
+
+    void handleCurveConfig(const twai_message_t &message)
+    {
+        pwmOutput::refresh(dimmingCurves::handleCanMessage(message.data));
+    }
+
+    void handleWifiConfig(const twai_message_t &message)
+    {
+        wifiConfig::handleCanMessage(message);
+    }
+
+    void handleCanUpdate(const twai_message_t &message)
+    {
+        canUpdate::handleCanMessage(message);
+    }
+
+    void handleSequenceUpload(const twai_message_t &message)
+    {
+        sequenceStore::handleCanMessage(message.data, message.data_length_code);
+    }
+
+    static void handle_rx_message(const twai_message_t &message)
+    {
+        rxStamp.rxUs = hal::micros();
+        rxStamp.sourceId = canDispatch::functionIdOf(message.identifier);
+        canDispatch::dispatch(message);
     }
 
     static void handle_tx_result(bool success) {
-        debugf("[CAN] TX %s\n", success ? "OK" : "FAILED");
+        canTx::onTransmit(success);
+        if (success) {
+            tracef("[CAN] TX OK");
+        } else {
+            tracef("[CAN] TX FAILED");
+        }
+    }
+
+    /**
+     * Register the built-in message handlers with the dispatcher
+     */
+    void registerHandlers()
+    {
+        canDispatch::onShared(0x00, 3, handleOtaTrigger);                     // OTA trigger (matched by hostname)
+        canDispatch::onShared(GROUP_COMMAND_ID, 2, handleGroupCommand);       // Multicast group command
+        canDispatch::onShared(GROUP_CONFIG_ID, 3, handleGroupConfig);         // Group membership
+        canDispatch::on(WIFI_CONFIG_ID, 1, handleWifiConfig);                 // WiFi credential provisioning (ISO-TP)
+        canDispatch::on(21, 2, handleBrightness);                             // Brightness
+        canDispatch::on(24, 1, handleToggle);                                 // On/off
+        canDispatch::on(CAN_BULK_BRIGHTNESS_ID, 8, handleBulkBrightness);     // Brightness, all channels
+        canDispatch::on(CAN_MASKED_BRIGHTNESS_ID, 2, handleMaskedBrightness); // Brightness, masked channels
+        canDispatch::on(SCENE_ID, 2, handleScene);                            // Scene save/recall
+        canDispatch::on(CURVE_CONFIG_ID, 2, handleCurveConfig);               // Output curve selection
+        canDispatch::on(30, 1, handleSequence);                               // Light sequence trigger
+        canDispatch::on(SEQUENCE_UPLOAD_ID, 1, handleSequenceUpload);         // Custom sequence upload
+        canDispatch::on(LATENCY_QUERY_ID, 0, latencyStats::handleQuery);      // RX-to-output latency query
+        canDispatch::on(CAN_UPDATE_ID, 1, handleCanUpdate);                   // Firmware update over CAN (ISO-TP)
+    }
+
+    uint32_t canReadyUs = 0;  // hal::micros() when the driver was up
+
+    uint32_t clampToBytes3(uint32_t value)
+    {
+        return value > 0xFFFFFF ? 0xFFFFFF : value;
+    }
+
+    /**
+     * Announce the boot: [flags (bit 0 = outputs restored), restored us (3 bytes), CAN ready us (3 bytes), node address]
+     * Times are little-endian microseconds since the app started, capped at 0xFFFFFF
+     */
+    void sendBootReport()
+    {
+        uint32_t restoredUs = clampToBytes3(outputJournal::restoredUs);
+        uint32_t readyUs = clampToBytes3(canReadyUs);
+
+        twai_message_t message;
+        message.identifier = nodeAddress::id(BOOT_REPORT_ID);
+        message.extd = false;
+        message.rtr = false;
+        message.data_length_code = 8;
+        message.data[0] = outputJournal::restored ? 0x01 : 0x00;
+        message.data[1] = restoredUs & 0xFF;
+        message.data[2] = (restoredUs >> 8) & 0xFF;
+        message.data[3] = restoredUs >> 16;
+        message.data[4] = readyUs & 0xFF;
+        message.data[5] = (readyUs >> 8) & 0xFF;
+        message.data[6] = readyUs >> 16;
+        message.data[7] = nodeAddress::address;
+        canTx::send(message, canTx::TX_ACK);
+    }
+
+    void printBootTimes()
+    {
+        if (outputJournal::restored) {
+            debugf("[Boot] Outputs restored at %u us, CAN ready at %u us\n", outputJournal::restoredUs, canReadyUs);
+        } else {
+            debugf("[Boot] Nothing to restore, CAN ready at %u us\n", canReadyUs);
+        }
     }
 
     void setupCan()
     {
-        if (TwaiTaskBased::begin((gpio_num_t)CAN_TX, (gpio_num_t)CAN_RX, 500000, TWAI_MODE_NO_ACK)) {
-            debugln("[CAN] Driver initialized");
+        registerHandlers();
+        wifiConfig::beginTransport();
+        canUpdate::begin();
+        canTx::begin();
+
+        uint16_t passedIds;
+        twai_filter_config_t filter = canDispatch::acceptanceFilter(&passedIds);
+        (void)passedIds;  // Only printed in debug builds
+        debugf("[CAN] Acceptance filter - %s, code 0x%08X, mask 0x%08X, passes %u of %u standard IDs\n",
+               filter.single_filter ? "single" : "dual", filter.acceptance_code, filter.acceptance_mask,
+               passedIds, CAN_STANDARD_ID_COUNT);
+
+        if (hal::canBegin(CAN_TX, CAN_RX, 500000, filter, handle_rx_message, handle_tx_result)) {
+            canReadyUs = hal::micros();
+            debugln("[CAN] Driver initialized, RX/TX callbacks registered");
+            sendBootReport();
+            otaService::sendLastResult();
         } else {
             debugln("[CAN] Failed to initialize driver");
-            return;
         }
+    }
 
-        TwaiTaskBased::onReceive(handle_rx_message);
-        TwaiTaskBased::onTransmit(handle_tx_result);
-        debugln("[CAN] RX/TX callbacks registered");
+    // Status broadcast bookkeeping (loop task only)
+    struct {
+        uint32_t heartbeatMs = STATUS_HEARTBEAT_MS;
+        uint32_t sentFrames = 0;
+        uint32_t heartbeatFrames = 0;
+        uint32_t coalescedChanges = 0;  // Changes folded into a later frame
+        uint32_t suppressedFrames = 0;  // STATUS_TX_INTERVAL_MS slots with nothing to send
+        uint32_t seenGeneration = 0;
+        uint8_t sentLevels[8] = {0};
+        bool changePending = false;
+        unsigned long lastSend = 0;
+        unsigned long lastSlot = 0;
+    } status;
+
+    /**
+     * Set the status interval used while outputs are idle
+     */
+    void setStatusHeartbeat(uint32_t heartbeatMs)
+    {
+        status.heartbeatMs = heartbeatMs;
     }
 
+    /**
+     * Broadcast output levels on this node's CAN_SEND_MESSAGE_ID when they change
+     * The first change goes out immediately, further changes within
+     * STATUS_COALESCE_MS are folded into one frame, and an idle module only
+     * sends a heartbeat every status.heartbeatMs
+     */
     void send_status_message()
     {
-        // Rate-limit status transmissions
-        static unsigned long lastSend = 0;
-        unsigned long now = millis();
-        if (now - lastSend < STATUS_TX_INTERVAL_MS) return;
-        lastSend = now;
+        unsigned long now = hal::millis();
+
+        uint32_t generation = outputState::generation();
+        if (generation != status.seenGeneration) {
+            status.seenGeneration = generation;
+            bool differs = memcmp(outputState::read().levels, status.sentLevels, 8) != 0;
+            if (differs && status.changePending) {
+                status.coalescedChanges++;
+            }
+            status.changePending = differs;
+        }
+
+        bool changeDue = status.changePending && now - status.lastSend >= STATUS_COALESCE_MS;
+        bool heartbeatDue = now - status.lastSend >= status.heartbeatMs;
+        if (!changeDue && !heartbeatDue) {
+            if (now - status.lastSlot >= STATUS_TX_INTERVAL_MS) {
+                status.lastSlot = now;
+                status.suppressedFrames++;
+            }
+            return;
+        }
 
         // Configure message to transmit
         twai_message_t message;
-        message.identifier = CAN_SEND_MESSAGE_ID;
+        message.identifier = nodeAddress::id(CAN_SEND_MESSAGE_ID);
         message.extd = false;
         message.rtr = false;
         message.data_length_code = 8;
-        message.data[0] = aryLightValues[0];
-        message.data[1] = aryLightValues[1];
-        message.data[2] = aryLightValues[2];
-        message.data[3] = aryLightValues[3];
-        message.data[4] = aryLightValues[4];
-        message.data[5] = aryLightValues[5];
-        message.data[6] = aryLightValues[6];
-        message.data[7] = aryLightValues[7];
-
-        // Queue message for transmission via background TX task
-        TwaiTaskBased::send(message, pdMS_TO_TICKS(10));
+        memcpy(message.data, outputState::read().levels, 8);
+        memcpy(status.sentLevels, message.data, 8);
+
+        // Latest snapshot replaces one still waiting for the bus
+        canTx::send(message, canTx::TX_STATUS);
+
+        status.sentFrames++;
+        if (!changeDue) {
+            status.heartbeatFrames++;
+        }
+        status.changePending = false;
+        status.lastSend = now;
+        status.lastSlot = now;
     }
 
     void canLoop()
     {
-        // RX is handled asynchronously by TwaiTaskBased FreeRTOS task
+        // RX is handled asynchronously by the CAN driver task (hal::canBegin)
         // Only periodic housekeeping needed here
-        wifiConfig::checkTimeout();
+        wifiConfig::loop();
+        canUpdate::loop();
+        sequenceStore::loop();
+        scenes::loop();
+        channelGroups::loop();
+        dimmingCurves::loop();
+        outputJournal::loop();
+        canTx::loop();
+        otaService::loop();
 
         // Periodic heartbeat so serial monitor shows the system is alive
         static unsigned long lastHeartbeat = 0;
-        unsigned long now = millis();
+        unsigned long now = hal::millis();
         if (now - lastHeartbeat >= 5000) {
             lastHeartbeat = now;
+            outputState::Snapshot lights = outputState::read();
+            (void)lights;  // Only printed in debug builds
             debugf("[CAN] Heartbeat - uptime: %lus, lights: [%d,%d,%d,%d,%d,%d,%d,%d]\n",
                    now / 1000,
-                   aryLightValues[0], aryLightValues[1], aryLightValues[2], aryLightValues[3],
-                   aryLightValues[4], aryLightValues[5], aryLightValues[6], aryLightValues[7]);
+                   lights.levels[0], lights.levels[1], lights.levels[2], lights.levels[3],
+                   lights.levels[4], lights.levels[5], lights.levels[6], lights.levels[7]);
+            debugf("[CAN] Status frames - sent: %u (heartbeat: %u), coalesced: %u, suppressed: %u\n",
+                   status.sentFrames, status.heartbeatFrames, status.coalescedChanges, status.suppressedFrames);
+            hal::CanRxLosses losses = hal::canRxLosses();
+            (void)losses;  // Only printed in debug builds
+            debugf("[CAN] RX rejected - past the acceptance filter but unhandled: %u, too short: %u; "
+                   "lost - RX queue full: %u, controller overrun: %u\n",
+                   canDispatch::unhandledFrames, canDispatch::shortFrames, losses.missed, losses.overrun);
+            canTx::print();
+            latencyStats::print();
+            outputJournal::print();
+            canUpdate::print();
+            otaStream::print();
+            printBootTimes();
         }
     }
 }
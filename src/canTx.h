@@ -0,0 +1,315 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+
+#define CAN_TX_ACK_DEPTH 16
+#define CAN_TX_STATUS_SLOTS 4       // Distinct status IDs kept at once
+#define CAN_TX_BULK_DEPTH 32
+#define CAN_TX_IN_FLIGHT 2          // Frames handed to the driver at once
+#define CAN_TX_STALL_MS 100         // In-flight frames with no TX callback are written off after this
+#define CAN_TX_BUS_POLL_MS 100
+#define CAN_TX_TASK_STACK 2048
+#define CAN_TX_TASK_PRIORITY 3
+
+/**
+ * Prioritized, non-blocking CAN transmit
+ *
+ * send() only copies the frame into its class and returns; a transmit task
+ * hands frames to the driver, at most CAN_TX_IN_FLIGHT at a time so the
+ * order on the bus follows the classes rather than the driver's FIFO:
+ *
+ *   TX_ACK     acknowledgements and diagnostics, FIFO
+ *   TX_STATUS  periodic state, one slot per CAN ID: a newer frame replaces
+ *              the queued one, so only the latest snapshot goes out
+ *   TX_BULK    transfers that can wait, FIFO
+ *
+ * Full queues drop the new frame and count it. loop() watches for bus-off,
+ * starts recovery and writes off frames the driver never confirmed.
+ */
+namespace canTx
+{
+    enum TxClass : uint8_t
+    {
+        TX_ACK,
+        TX_STATUS,
+        TX_BULK,
+        TX_CLASS_COUNT
+    };
+
+    template <uint8_t Depth>
+    struct Queue
+    {
+        twai_message_t frames[Depth];
+        uint8_t head = 0;
+        uint8_t count = 0;
+
+        bool push(const twai_message_t &message)
+        {
+            if (count == Depth) {
+                return false;
+            }
+            frames[(head + count) % Depth] = message;
+            count++;
+            return true;
+        }
+
+        void pop()
+        {
+            head = (head + 1) % Depth;
+            count--;
+        }
+    };
+
+    struct StatusSlot
+    {
+        twai_message_t message;
+        uint32_t version;  // Bumped on every replace
+        bool pending;
+    };
+
+    struct ClassStats
+    {
+        uint32_t sent;
+        uint32_t dropped;
+        uint32_t replaced;  // TX_STATUS frames overwritten before they went out
+        uint8_t maxDepth;
+    };
+
+    Queue<CAN_TX_ACK_DEPTH> ackQueue;
+    Queue<CAN_TX_BULK_DEPTH> bulkQueue;
+    StatusSlot statusSlots[CAN_TX_STATUS_SLOTS] = {};
+    uint8_t nextStatusSlot = 0;  // Round-robin start, so one busy ID cannot starve the others
+    ClassStats stats[TX_CLASS_COUNT] = {};
+    uint8_t inFlight = 0;
+    uint32_t lastActivityMs = 0;
+    hal::Lock txMux = HAL_LOCK_INIT;
+    hal::Task *txTask = nullptr;
+
+    volatile bool busOff = false;  // Written by the loop task, read by pump() on the TX task
+
+    // Loop task only
+    uint32_t busOffEvents = 0;
+    uint32_t stalls = 0;
+    uint32_t lastBusPollMs = 0;
+    volatile uint32_t txErrors = 0;
+
+    uint8_t statusDepth()
+    {
+        uint8_t depth = 0;
+        for (uint8_t i = 0; i < CAN_TX_STATUS_SLOTS; i++) {
+            depth += statusSlots[i].pending;
+        }
+        return depth;
+    }
+
+    void noteDepth(TxClass cls, uint8_t depth)
+    {
+        if (depth > stats[cls].maxDepth) {
+            stats[cls].maxDepth = depth;
+        }
+    }
+
+    /**
+     * Queue a frame; never blocks
+     * Safe from any task
+     * @return false if the class was full (the frame is dropped and counted)
+     */
+    bool send(const twai_message_t &message, TxClass cls)
+    {
+        bool queued = false;
+        hal::lock(txMux);
+        if (cls == TX_ACK) {
+            queued = ackQueue.push(message);
+            noteDepth(cls, ackQueue.count);
+        } else if (cls == TX_BULK) {
+            queued = bulkQueue.push(message);
+            noteDepth(cls, bulkQueue.count);
+        } else {
+            StatusSlot *slot = nullptr;
+            for (uint8_t i = 0; i < CAN_TX_STATUS_SLOTS && !slot; i++) {
+                if (statusSlots[i].pending && statusSlots[i].message.identifier == message.identifier) {
+                    slot = &statusSlots[i];
+                    stats[cls].replaced++;
+                }
+            }
+            for (uint8_t i = 0; i < CAN_TX_STATUS_SLOTS && !slot; i++) {
+                if (!statusSlots[i].pending) {
+                    slot = &statusSlots[i];
+                }
+            }
+            if (slot) {
+                slot->message = message;
+                slot->version++;
+                slot->pending = true;
+                queued = true;
+            }
+            noteDepth(cls, statusDepth());
+        }
+        if (!queued) {
+            stats[cls].dropped++;
+        }
+        hal::unlock(txMux);
+
+        hal::notify(txTask);
+        return queued;
+    }
+
+    /**
+     * Frames still waiting in a class
+     */
+    uint8_t depth(TxClass cls)
+    {
+        hal::lock(txMux);
+        uint8_t count = cls == TX_ACK ? ackQueue.count : cls == TX_BULK ? bulkQueue.count : statusDepth();
+        hal::unlock(txMux);
+        return count;
+    }
+
+    /**
+     * Driver TX callback: one handed-off frame is done
+     */
+    void onTransmit(bool success)
+    {
+        hal::lock(txMux);
+        if (inFlight > 0) {
+            inFlight--;
+        }
+        lastActivityMs = hal::millis();
+        hal::unlock(txMux);
+        if (!success) {
+            txErrors++;
+        }
+        hal::notify(txTask);
+    }
+
+    /**
+     * Transmit task body: hand the highest-priority frames to the driver
+     * Runs once per notification (send, TX callback, loop housekeeping)
+     */
+    void pump()
+    {
+        while (!busOff) {
+            twai_message_t message;
+            TxClass cls;
+            int slot = -1;
+            uint32_t version = 0;
+
+            hal::lock(txMux);
+            if (inFlight >= CAN_TX_IN_FLIGHT) {
+                hal::unlock(txMux);
+                return;
+            }
+            if (ackQueue.count) {
+                cls = TX_ACK;
+                message = ackQueue.frames[ackQueue.head];
+            } else {
+                for (uint8_t i = 0; i < CAN_TX_STATUS_SLOTS && slot < 0; i++) {
+                    uint8_t index = (nextStatusSlot + i) % CAN_TX_STATUS_SLOTS;
+                    if (statusSlots[index].pending) {
+                        slot = index;
+                    }
+                }
+                if (slot >= 0) {
+                    cls = TX_STATUS;
+                    message = statusSlots[slot].message;
+                    version = statusSlots[slot].version;
+                } else if (bulkQueue.count) {
+                    cls = TX_BULK;
+                    message = bulkQueue.frames[bulkQueue.head];
+                } else {
+                    hal::unlock(txMux);
+                    return;
+                }
+            }
+            inFlight++;  // Before the send: the driver may report completion from inside it
+            hal::unlock(txMux);
+
+            bool handedOff = hal::canSend(message, 0);
+
+            hal::lock(txMux);
+            if (handedOff) {
+                // Only this task removes frames, so the head is still the frame just sent
+                if (cls == TX_ACK) {
+                    ackQueue.pop();
+                } else if (cls == TX_BULK) {
+                    bulkQueue.pop();
+                } else {
+                    // A newer snapshot that arrived meanwhile stays queued
+                    if (statusSlots[slot].version == version) {
+                        statusSlots[slot].pending = false;
+                    }
+                    nextStatusSlot = (slot + 1) % CAN_TX_STATUS_SLOTS;
+                }
+                stats[cls].sent++;
+                lastActivityMs = hal::millis();
+            } else {
+                inFlight--;
+            }
+            hal::unlock(txMux);
+
+            if (!handedOff) {
+                // Driver queue full; retried on the next TX callback or loop() pass
+                return;
+            }
+        }
+    }
+
+    /**
+     * Start the transmit task
+     * Frames sent before this stay queued until it runs
+     */
+    void begin()
+    {
+        txTask = hal::startTask("canTx", pump, 0, CAN_TX_TASK_STACK, CAN_TX_TASK_PRIORITY, 1);
+        hal::notify(txTask);
+    }
+
+    /**
+     * Bus-off recovery and stalled hand-offs
+     * Call from loop()
+     */
+    void loop()
+    {
+        uint32_t now = hal::millis();
+        if (now - lastBusPollMs < CAN_TX_BUS_POLL_MS) {
+            return;
+        }
+        lastBusPollMs = now;
+
+        hal::CanBusState state = hal::canPollBus();
+        if (state == hal::CAN_BUS_OFF && !busOff) {
+            busOff = true;
+            busOffEvents++;
+            tracef("[CAN TX] Bus-off - starting recovery");
+            hal::canRecover();
+        } else if (state == hal::CAN_BUS_RUNNING && busOff) {
+            busOff = false;
+            tracef("[CAN TX] Bus recovered");
+            // Frames in the driver when the bus went off are gone
+            hal::lock(txMux);
+            inFlight = 0;
+            hal::unlock(txMux);
+        }
+
+        hal::lock(txMux);
+        bool stalled = inFlight > 0 && now - lastActivityMs >= CAN_TX_STALL_MS;
+        if (stalled) {
+            inFlight = 0;
+            stalls++;
+        }
+        hal::unlock(txMux);
+        hal::notify(txTask);
+    }
+
+    void print()
+    {
+        debugf("[CAN TX] ack - sent: %u, dropped: %u, max depth: %u/%u\n",
+               stats[TX_ACK].sent, stats[TX_ACK].dropped, stats[TX_ACK].maxDepth, CAN_TX_ACK_DEPTH);
+        debugf("[CAN TX] status - sent: %u, replaced: %u, dropped: %u, max depth: %u/%u\n",
+               stats[TX_STATUS].sent, stats[TX_STATUS].replaced, stats[TX_STATUS].dropped,
+               stats[TX_STATUS].maxDepth, CAN_TX_STATUS_SLOTS);
+        debugf("[CAN TX] bulk - sent: %u, dropped: %u, max depth: %u/%u\n",
+               stats[TX_BULK].sent, stats[TX_BULK].dropped, stats[TX_BULK].maxDepth, CAN_TX_BULK_DEPTH);
+        debugf("[CAN TX] TX errors: %u, bus-off events: %u, stalled hand-offs: %u\n", txErrors, busOffEvents, stalls);
+    }
+}
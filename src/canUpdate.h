@@ -0,0 +1,383 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "isoTp.h"
+#include "nodeAddress.h"
+#include "sha256.h"
+#include "wifiConfig.h"
+#include "otaService.h"
+
+#define CAN_UPDATE_ID 0x3E              // ISO-TP update messages (bus to module)
+#define CAN_UPDATE_RESPONSE_ID 0x3F     // ISO-TP flow control and acks (module to bus)
+#define CAN_UPDATE_SECTOR_SIZE 0x1000   // Flash sector; the unit of compression and of resume
+#define CAN_UPDATE_FRAGMENT_SIZE 256    // Messages for part of a sector start on this boundary
+#define CAN_UPDATE_WINDOW 2             // Data messages the sender may have unacknowledged
+#define CAN_UPDATE_RESTART_MS 500       // Restart delay after a good image, so the last ack goes out
+#define CAN_UPDATE_KEY "canupdate"      // NVS key, in the wifiConfig namespace
+#define CAN_UPDATE_TASK_STACK 4096
+#define CAN_UPDATE_TASK_PRIORITY 1
+
+/**
+ * Firmware update over CAN into the inactive app slot, no WiFi needed
+ *
+ * The image is cut into 4 KB flash sectors and each sector is compressed on
+ * its own (raw deflate), so any sector boundary is a point the transfer can
+ * resume from. Messages travel on an ISO-TP link (node's 0x3E, answered on
+ * 0x3F); all replies are [type, status, sector lo, hi, fragment, window],
+ * where sector/fragment is the image position the module expects next:
+ *
+ *   0x01 Begin:  [0x01, image size (4, LE), SHA-256 of the image (32)]
+ *                Starts a transfer, or resumes one for the same image
+ *   0x02 Data:   [0x02, sector lo, hi, fragment, raw deflate data]
+ *                Inflates to the image bytes at sector * 4096 + fragment * 256.
+ *                A message covers the rest of a sector or part of it (a sector
+ *                that does not compress into one message is split)
+ *   0x03 Finish: [0x03] - read the slot back, check the SHA-256, switch the
+ *                boot slot and restart
+ *   0x04 Abort:  [0x04]
+ *
+ * Data messages are windowed: up to CAN_UPDATE_WINDOW may be unacknowledged.
+ * The RX task only copies them into the window; the update task inflates and
+ * writes them, so CAN handling never waits for flash. A message out of order
+ * or with the window full is answered with the position to go back to.
+ *
+ * Progress (image size, hash, slot, sectors written) is saved to NVS after
+ * every sector written, so a Begin for the same image after an interruption
+ * or a restart continues from the last sector in flash. Only a Begin that
+ * continues after at least one written sector counts as a resume.
+ */
+namespace canUpdate
+{
+    enum MessageType : uint8_t
+    {
+        UPDATE_BEGIN = 0x01,
+        UPDATE_DATA = 0x02,
+        UPDATE_FINISH = 0x03,
+        UPDATE_ABORT = 0x04,
+    };
+
+    enum Status : uint8_t
+    {
+        UPDATE_OK = 0x00,
+        UPDATE_BAD_MESSAGE = 0x01,
+        UPDATE_NOT_STARTED = 0x02,
+        UPDATE_OUT_OF_ORDER = 0x03,  // Continue from the position in the reply
+        UPDATE_BAD_DATA = 0x04,      // Did not inflate, or ran past its sector
+        UPDATE_FLASH_ERROR = 0x05,
+        UPDATE_HASH_MISMATCH = 0x06, // Transfer discarded; start again
+        UPDATE_BAD_IMAGE = 0x07,     // Hash matched but the boot loader refused the image
+        UPDATE_BUSY = 0x08,          // Window full, or a WiFi OTA window is open
+        UPDATE_TOO_LARGE = 0x09,
+    };
+
+    // Persisted in NVS
+    struct Session
+    {
+        uint32_t size;
+        uint8_t sha[32];
+        char slot[8];          // Label of the app slot being written
+        uint32_t sectorsDone;
+    };
+
+    struct Pending
+    {
+        uint16_t length;
+        uint8_t data[ISOTP_MAX_PAYLOAD];
+    };
+
+    isoTp::Link link;
+    hal::Task *updateTask = nullptr;
+
+    // Window of received messages (RX task adds, update task removes)
+    Pending window[CAN_UPDATE_WINDOW];
+    uint8_t windowHead = 0;
+    uint8_t windowCount = 0;
+    hal::Lock windowMux = HAL_LOCK_INIT;
+
+    // Update task only
+    Session session;
+    bool active = false;
+    hal::FlashRegion *slot = nullptr;
+    uint8_t sectorBuffer[CAN_UPDATE_SECTOR_SIZE];
+    uint32_t startMs = 0;
+    uint32_t compressedBytes = 0;
+    uint8_t resumes = 0;
+
+    volatile uint32_t position = 0;  // Image bytes inflated so far; read by the RX task for replies
+    volatile bool restartPending = false;
+    uint32_t restartAtMs = 0;
+
+    void reply(uint8_t type, Status status)
+    {
+        uint32_t at = position;
+        uint16_t sector = at / CAN_UPDATE_SECTOR_SIZE;
+        uint8_t message[6] = {type, status, (uint8_t)(sector & 0xFF), (uint8_t)(sector >> 8),
+                              (uint8_t)((at % CAN_UPDATE_SECTOR_SIZE) / CAN_UPDATE_FRAGMENT_SIZE),
+                              CAN_UPDATE_WINDOW};
+        isoTp::send(link, message, sizeof(message));
+    }
+
+    bool sameImage(const Session &a, const Session &b)
+    {
+        return a.size == b.size && memcmp(a.sha, b.sha, sizeof(a.sha)) == 0 && strcmp(a.slot, b.slot) == 0;
+    }
+
+    void saveSession()
+    {
+        wifiConfig::preferences.putBytes(CAN_UPDATE_KEY, &session, sizeof(session));
+    }
+
+    void endSession()
+    {
+        active = false;
+        wifiConfig::preferences.remove(CAN_UPDATE_KEY);
+    }
+
+    void handleBegin(const uint8_t *data, uint16_t length)
+    {
+        if (length < 37) {
+            reply(UPDATE_BEGIN, UPDATE_BAD_MESSAGE);
+            return;
+        }
+        if (otaService::isActive()) {
+            reply(UPDATE_BEGIN, UPDATE_BUSY);
+            return;
+        }
+        slot = hal::flashUpdateSlot();
+        Session request = {};
+        request.size = (uint32_t)data[1] | ((uint32_t)data[2] << 8) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 24);
+        memcpy(request.sha, data + 5, sizeof(request.sha));
+        strncpy(request.slot, slot ? slot->label : "", sizeof(request.slot) - 1);
+        if (!slot || request.size == 0 || request.size > hal::flashSize(slot)) {
+            reply(UPDATE_BEGIN, UPDATE_TOO_LARGE);
+            return;
+        }
+
+        if (active && sameImage(session, request)) {
+            if (session.sectorsDone > 0) {
+                resumes += resumes < 0xFF;
+            }
+            debugf("[CAN Update] Resuming at byte %u of %u\n", position, session.size);
+        } else {
+            Session stored;
+            bool resume = wifiConfig::preferences.isKey(CAN_UPDATE_KEY) &&
+                          wifiConfig::preferences.getBytes(CAN_UPDATE_KEY, &stored, sizeof(stored)) == sizeof(stored) &&
+                          sameImage(stored, request) && stored.sectorsDone > 0;
+            session = resume ? stored : request;
+            position = session.sectorsDone * CAN_UPDATE_SECTOR_SIZE;
+            active = true;
+            startMs = hal::millis();
+            compressedBytes = 0;
+            resumes = resume;
+            saveSession();
+            debugf("[CAN Update] %s %u-byte image into %s at byte %u\n", resume ? "Resuming" : "Receiving",
+                   session.size, session.slot, position);
+        }
+        reply(UPDATE_BEGIN, UPDATE_OK);
+    }
+
+    /**
+     * Erase and write the sector that ends at position
+     */
+    bool writeSector()
+    {
+        uint32_t fill = position % CAN_UPDATE_SECTOR_SIZE;
+        fill = fill ? fill : CAN_UPDATE_SECTOR_SIZE;
+        uint32_t offset = position - fill;
+        return hal::flashErase(slot, offset, CAN_UPDATE_SECTOR_SIZE) &&
+               hal::flashWrite(slot, offset, sectorBuffer, fill);
+    }
+
+    void handleData(const uint8_t *data, uint16_t length)
+    {
+        if (!active) {
+            reply(UPDATE_DATA, UPDATE_NOT_STARTED);
+            return;
+        }
+        if (length < 5) {
+            reply(UPDATE_DATA, UPDATE_BAD_MESSAGE);
+            return;
+        }
+        uint32_t at = (data[1] | (data[2] << 8)) * CAN_UPDATE_SECTOR_SIZE + data[3] * CAN_UPDATE_FRAGMENT_SIZE;
+        if (at != position) {
+            reply(UPDATE_DATA, UPDATE_OUT_OF_ORDER);
+            return;
+        }
+
+        uint32_t fill = position % CAN_UPDATE_SECTOR_SIZE;
+        size_t room = CAN_UPDATE_SECTOR_SIZE - fill;
+        room = room < session.size - position ? room : session.size - position;
+        size_t inflated;
+        if (!hal::inflateBlock(data + 4, length - 4, sectorBuffer + fill, room, inflated) || inflated == 0) {
+            reply(UPDATE_DATA, UPDATE_BAD_DATA);
+            return;
+        }
+        position = position + inflated;
+        compressedBytes += length - 4;
+
+        if (position % CAN_UPDATE_SECTOR_SIZE == 0 || position == session.size) {
+            if (!writeSector()) {
+                position = position - (fill + inflated);
+                reply(UPDATE_DATA, UPDATE_FLASH_ERROR);
+                return;
+            }
+            session.sectorsDone = (position + CAN_UPDATE_SECTOR_SIZE - 1) / CAN_UPDATE_SECTOR_SIZE;
+            saveSession();
+        }
+        reply(UPDATE_DATA, UPDATE_OK);
+    }
+
+    void handleFinish()
+    {
+        if (!active) {
+            reply(UPDATE_FINISH, UPDATE_NOT_STARTED);
+            return;
+        }
+        if (position != session.size) {
+            reply(UPDATE_FINISH, UPDATE_OUT_OF_ORDER);
+            return;
+        }
+
+        // Hash what is actually in flash, not what was received
+        sha256::Context ctx;
+        sha256::init(ctx);
+        for (uint32_t offset = 0; offset < session.size; offset += CAN_UPDATE_SECTOR_SIZE) {
+            uint32_t chunk = session.size - offset < CAN_UPDATE_SECTOR_SIZE ? session.size - offset : CAN_UPDATE_SECTOR_SIZE;
+            if (!hal::flashRead(slot, offset, sectorBuffer, chunk)) {
+                reply(UPDATE_FINISH, UPDATE_FLASH_ERROR);
+                return;
+            }
+            sha256::update(ctx, sectorBuffer, chunk);
+        }
+        uint8_t digest[32];
+        sha256::final(ctx, digest);
+
+        uint32_t seconds = (hal::millis() - startMs) / 1000;
+        if (memcmp(digest, session.sha, sizeof(digest)) != 0) {
+            debugln("[CAN Update] SHA-256 mismatch - image discarded");
+            endSession();
+            position = 0;
+            reply(UPDATE_FINISH, UPDATE_HASH_MISMATCH);
+            return;
+        }
+        if (!hal::flashSetBootSlot(slot)) {
+            debugln("[CAN Update] Image rejected by the boot loader");
+            endSession();
+            position = 0;
+            reply(UPDATE_FINISH, UPDATE_BAD_IMAGE);
+            return;
+        }
+
+        debugf("[CAN Update] Image verified after %us - restarting into %s\n", seconds, session.slot);
+        otaService::saveResult(otaService::PATH_CAN, seconds, compressedBytes, resumes);
+        endSession();
+        reply(UPDATE_FINISH, UPDATE_OK);
+        restartAtMs = hal::millis() + CAN_UPDATE_RESTART_MS;
+        restartPending = true;
+    }
+
+    /**
+     * Update task body: work through the window, oldest message first
+     */
+    void service()
+    {
+        for (;;) {
+            hal::lock(windowMux);
+            if (windowCount == 0) {
+                hal::unlock(windowMux);
+                return;
+            }
+            // Only this task removes entries, so the head stays put while it is handled
+            Pending &pending = window[windowHead];
+            hal::unlock(windowMux);
+
+            switch (pending.data[0]) {
+                case UPDATE_BEGIN:
+                    handleBegin(pending.data, pending.length);
+                    break;
+                case UPDATE_DATA:
+                    handleData(pending.data, pending.length);
+                    break;
+                case UPDATE_FINISH:
+                    handleFinish();
+                    break;
+                case UPDATE_ABORT:
+                    endSession();
+                    position = 0;
+                    reply(UPDATE_ABORT, UPDATE_OK);
+                    break;
+                default:
+                    reply(pending.data[0], UPDATE_BAD_MESSAGE);
+            }
+
+            hal::lock(windowMux);
+            windowHead = (windowHead + 1) % CAN_UPDATE_WINDOW;
+            windowCount--;
+            hal::unlock(windowMux);
+        }
+    }
+
+    /**
+     * ISO-TP delivery, on the RX task: queue the message for the update task
+     */
+    void onMessage(const uint8_t *data, uint16_t length)
+    {
+        hal::lock(windowMux);
+        if (windowCount == CAN_UPDATE_WINDOW) {
+            hal::unlock(windowMux);
+            reply(data[0], UPDATE_BUSY);
+            return;
+        }
+        Pending &pending = window[(windowHead + windowCount) % CAN_UPDATE_WINDOW];
+        hal::unlock(windowMux);
+
+        // The slot is ours until windowCount covers it
+        memcpy(pending.data, data, length);
+        pending.length = length;
+
+        hal::lock(windowMux);
+        windowCount++;
+        hal::unlock(windowMux);
+        hal::notify(updateTask);
+    }
+
+    /**
+     * Set the link's IDs from the node address and start the update task
+     * Call after nodeAddress::init(), before the CAN driver starts
+     */
+    void begin()
+    {
+        link.txId = nodeAddress::id(CAN_UPDATE_RESPONSE_ID);
+        link.onReceive = onMessage;
+        updateTask = hal::startTask("canUpdate", service, 0, CAN_UPDATE_TASK_STACK, CAN_UPDATE_TASK_PRIORITY, 0);
+    }
+
+    /**
+     * Handle an ISO-TP frame on this node's CAN_UPDATE_ID
+     */
+    void handleCanMessage(const twai_message_t &message)
+    {
+        isoTp::receive(link, message);
+    }
+
+    /**
+     * Pace outgoing frames and restart into a verified image
+     * Call from loop()
+     */
+    void loop()
+    {
+        isoTp::loop(link);
+        if (restartPending && (int32_t)(hal::millis() - restartAtMs) >= 0) {
+            restartPending = false;
+            hal::restart();
+        }
+    }
+
+    void print()
+    {
+        if (active) {
+            debugf("[CAN Update] %u/%u bytes, %u compressed bytes received, %us\n",
+                   position, session.size, compressedBytes, (hal::millis() - startMs) / 1000);
+        }
+    }
+}
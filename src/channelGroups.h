@@ -0,0 +1,159 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "outputState.h"
+#include "lightSequences.h"
+#include "wifiConfig.h"
+#include "nodeAddress.h"
+
+#define GROUP_COMMAND_ID 0x02       // CAN ID for group commands, bus-wide (bus to every module)
+#define GROUP_CONFIG_ID 0x27        // CAN ID for group membership, bus-wide (bus to every module)
+#define GROUP_COUNT 16
+#define GROUP_KEY "groups"          // NVS key, in the wifiConfig namespace
+
+/**
+ * Channel groups spanning several modules, driven by one multicast frame
+ *
+ * A group is a set of (node, channel) pairs. Each module only stores its own
+ * part: a channel mask per group, kept in NVS and cached in RAM. Both group
+ * IDs are bus-wide, so every module sees every group frame; a command is
+ * applied to the local members as one outputState update, and modules on the
+ * same bus act on the same frame, so all members switch together.
+ *
+ * CAN ID 0x27: [group, node, channel mask] sets the node's members of the
+ * group (mask 0 removes the node). Only the addressed node stores it.
+ *
+ * CAN ID 0x02: [group, command, ...]
+ *   [group, 0x01, level, fadeLo, fadeHi]  Set the members to level, optional fade in ms
+ *   [group, 0x02, fadeLo, fadeHi]         Toggle the group: on (255) if it was off, else off
+ *
+ * Toggling follows the group's last commanded state, not the local levels,
+ * so every module takes the same direction even where only some members
+ * were changed by other commands. That state is kept in RAM only: at boot it
+ * is taken from the levels the output journal restored (on if any local
+ * member is lit), so a module that resets between toggles goes the same way
+ * as the others unless its members were changed by other commands meanwhile.
+ */
+namespace channelGroups
+{
+    enum Command : uint8_t
+    {
+        GROUP_SET = 0x01,
+        GROUP_TOGGLE = 0x02,
+    };
+
+    uint8_t members[GROUP_COUNT] = {0};  // Local channel mask per group (RX task writes, single bytes)
+    uint16_t onGroups = 0;               // Last commanded state per group (RX task only after init())
+    volatile bool dirty = false;         // Membership changed, not yet written to NVS
+
+    /**
+     * Load the stored membership and seed each group's toggle state from the outputs
+     * Call after wifiConfig::init() and outputJournal::restore()
+     */
+    void init()
+    {
+        if (wifiConfig::preferences.isKey(GROUP_KEY)) {
+            wifiConfig::preferences.getBytes(GROUP_KEY, members, sizeof(members));
+        }
+        outputState::Snapshot outputs = outputState::read();
+        uint8_t lit = 0;
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            lit |= (outputs.levels[ch] != 0) << ch;
+        }
+        uint8_t used = 0;
+        for (uint8_t group = 0; group < GROUP_COUNT; group++) {
+            used += members[group] != 0;
+            if (members[group] & lit) {
+                onGroups |= 1 << group;
+            }
+        }
+        debugf("[Groups] Member of %u groups\n", used);
+    }
+
+    /**
+     * Set every local member of a group to one level
+     */
+    void apply(uint8_t group, uint8_t level, uint32_t fadeMs, const outputState::Stamp *stamp)
+    {
+        uint8_t mask = members[group];
+        if (!mask) {
+            return;
+        }
+        uint8_t levels[8];
+        uint32_t fades[8];
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            levels[ch] = level;
+            fades[ch] = fadeMs;
+        }
+        lightSequences::releaseChannels(mask);
+        outputState::set(mask, levels, fades, stamp);
+    }
+
+    /**
+     * Handle group command (ID 0x02)
+     */
+    void handleCommand(const uint8_t *data, uint8_t length, const outputState::Stamp *stamp)
+    {
+        uint8_t group = data[0];
+        if (group >= GROUP_COUNT) {
+            return;
+        }
+        switch (data[1]) {
+            case GROUP_SET: {
+                if (length < 3) {
+                    return;
+                }
+                uint16_t fadeMs = length >= 5 ? (data[3] | (data[4] << 8)) : 0;
+                if (data[2]) {
+                    onGroups |= 1 << group;
+                } else {
+                    onGroups &= ~(1 << group);
+                }
+                apply(group, data[2], fadeMs, stamp);
+                break;
+            }
+            case GROUP_TOGGLE: {
+                uint16_t fadeMs = length >= 4 ? (data[2] | (data[3] << 8)) : 0;
+                onGroups ^= 1 << group;
+                apply(group, (onGroups & (1 << group)) ? 255 : 0, fadeMs, stamp);
+                break;
+            }
+            default:
+                tracef("[Groups] Unknown command: 0x%02X", data[1]);
+        }
+    }
+
+    /**
+     * Handle group membership message (ID 0x27)
+     */
+    void handleConfig(const uint8_t *data)
+    {
+        uint8_t group = data[0];
+        if (group >= GROUP_COUNT || data[1] != nodeAddress::address) {
+            return;
+        }
+        if (members[group] != data[2]) {
+            members[group] = data[2];
+            dirty = true;
+        }
+    }
+
+    /**
+     * Write changed membership to NVS
+     * Call from loop()
+     */
+    void loop()
+    {
+        if (!dirty) {
+            return;
+        }
+        dirty = false;
+        uint8_t stored[GROUP_COUNT];
+        memcpy(stored, members, sizeof(stored));
+        if (wifiConfig::preferences.putBytes(GROUP_KEY, stored, sizeof(stored)) == sizeof(stored)) {
+            debugln("[Groups] Membership saved");
+        } else {
+            debugln("[Groups] Membership write FAILED");
+        }
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "hal/hal.h"
+
+namespace crc32
+{
+    /**
+     * CRC-32 (IEEE 802.3, same as zlib) over a buffer
+     * Pass the previous result as crc to continue a running checksum
+     */
+    uint32_t update(uint32_t crc, const uint8_t *data, size_t length)
+    {
+        return hal::crc32Update(crc, data, length);
+    }
+
+    uint32_t compute(const uint8_t *data, size_t length)
+    {
+        return update(0, data, length);
+    }
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "wifiConfig.h"
+
+#define PWM_RESOLUTION_BITS 13       // LEDC duty resolution the curves are generated for
+#define PWM_MAX_DUTY ((1 << PWM_RESOLUTION_BITS) - 1)
+#define CURVE_CONFIG_ID 0x26         // CAN ID for output curve selection (bus to module)
+#define CURVE_KEY "curves"           // NVS key, in the wifiConfig namespace
+#define MOTOR_MIN_DUTY_PERCENT 25    // Lowest non-zero duty of the motor curve
+
+/**
+ * Brightness-to-duty curves
+ *
+ * CAN levels stay 0-255; each channel maps them onto the 13-bit LEDC duty
+ * range through a 256-entry table. The tables are generated by the compiler
+ * (constexpr) and live in flash, so a lookup is two reads and an
+ * interpolation for fractional levels during fades.
+ *
+ *   CURVE_PERCEPTUAL  CIE 1931 lightness, for LEDs (default)
+ *   CURVE_LINEAR      duty proportional to level, for resistive loads
+ *   CURVE_MOTOR       linear from MOTOR_MIN_DUTY_PERCENT, so fans and pumps
+ *                     do not stall at low levels
+ *
+ * CAN ID 0x26: [channel mask, curve] selects the curve for the masked
+ * channels. The selection is kept in NVS and written from loop().
+ */
+namespace dimmingCurves
+{
+    enum Curve : uint8_t
+    {
+        CURVE_PERCEPTUAL = 0,
+        CURVE_LINEAR = 1,
+        CURVE_MOTOR = 2,
+        CURVE_COUNT
+    };
+
+    struct Table
+    {
+        uint16_t duty[256];
+    };
+
+    // Relative luminance for a CIE L* lightness of 0-1
+    constexpr double perceptual(double lightness)
+    {
+        double l = lightness * 100;
+        return l > 8 ? ((l + 16) / 116) * ((l + 16) / 116) * ((l + 16) / 116) : l / 903.3;
+    }
+
+    constexpr double linear(double level)
+    {
+        return level;
+    }
+
+    constexpr double motor(double level)
+    {
+        return level > 0 ? MOTOR_MIN_DUTY_PERCENT / 100.0 + level * (1 - MOTOR_MIN_DUTY_PERCENT / 100.0) : 0;
+    }
+
+    constexpr Table makeTable(double (*curve)(double))
+    {
+        Table table = {};
+        for (int level = 0; level < 256; level++) {
+            table.duty[level] = (uint16_t)(curve(level / 255.0) * PWM_MAX_DUTY + 0.5);
+        }
+        return table;
+    }
+
+    // Every level above 0 must produce a distinct, larger duty, or fades would stall on flat steps
+    constexpr bool strictlyIncreasing(const Table &table)
+    {
+        for (int level = 1; level < 256; level++) {
+            if (table.duty[level] <= table.duty[level - 1]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    constexpr Table tables[CURVE_COUNT] = {
+        makeTable(perceptual),
+        makeTable(linear),
+        makeTable(motor),
+    };
+
+    static_assert(strictlyIncreasing(tables[CURVE_PERCEPTUAL]), "Perceptual curve needs more PWM resolution");
+    static_assert(strictlyIncreasing(tables[CURVE_LINEAR]), "Linear curve needs more PWM resolution");
+    static_assert(strictlyIncreasing(tables[CURVE_MOTOR]), "Motor curve needs more PWM resolution");
+    static_assert(tables[CURVE_PERCEPTUAL].duty[255] == PWM_MAX_DUTY, "Curves must reach full duty");
+
+    uint8_t channelCurve[8] = {0};  // Read by the PWM task, written by the RX task (single bytes)
+    volatile bool dirty = false;    // Selection changed, not yet written to NVS
+
+    /**
+     * Load the stored curve selection
+     * Call after wifiConfig::init() and before pwmOutput::begin()
+     */
+    void init()
+    {
+        uint8_t stored[8];
+        if (wifiConfig::preferences.isKey(CURVE_KEY) &&
+            wifiConfig::preferences.getBytes(CURVE_KEY, stored, sizeof(stored)) == sizeof(stored)) {
+            for (uint8_t ch = 0; ch < 8; ch++) {
+                channelCurve[ch] = stored[ch] < CURVE_COUNT ? stored[ch] : (uint8_t)CURVE_PERCEPTUAL;
+            }
+        }
+        debugf("[Curves] Channel curves: [%d,%d,%d,%d,%d,%d,%d,%d]\n",
+               channelCurve[0], channelCurve[1], channelCurve[2], channelCurve[3],
+               channelCurve[4], channelCurve[5], channelCurve[6], channelCurve[7]);
+    }
+
+    /**
+     * Duty for a level in 8.8 fixed point on the channel's curve
+     */
+    uint32_t duty(uint8_t ch, uint16_t position)
+    {
+        const uint16_t *table = tables[channelCurve[ch]].duty;
+        uint8_t level = position >> 8;
+        uint8_t fraction = position & 0xFF;
+        if (fraction == 0) {
+            return table[level];
+        }
+        return table[level] + (((uint32_t)(table[level + 1] - table[level]) * fraction) >> 8);
+    }
+
+    /**
+     * Handle curve selection message (ID 0x26)
+     * @return Mask of channels whose curve changed
+     */
+    uint8_t handleCanMessage(const uint8_t *data)
+    {
+        uint8_t mask = data[0];
+        uint8_t curve = data[1];
+        if (curve >= CURVE_COUNT) {
+            tracef("[Curves] Unknown curve %d", curve);
+            return 0;
+        }
+        uint8_t changed = 0;
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            if ((mask & (1 << ch)) && channelCurve[ch] != curve) {
+                channelCurve[ch] = curve;
+                changed |= 1 << ch;
+            }
+        }
+        if (changed) {
+            dirty = true;
+        }
+        return changed;
+    }
+
+    /**
+     * Write a changed selection to NVS
+     * Call from loop()
+     */
+    void loop()
+    {
+        if (!dirty) {
+            return;
+        }
+        dirty = false;
+        uint8_t stored[8];
+        memcpy(stored, channelCurve, sizeof(stored));
+        if (wifiConfig::preferences.putBytes(CURVE_KEY, stored, sizeof(stored)) == sizeof(stored)) {
+            debugln("[Curves] Selection saved");
+        } else {
+            debugln("[Curves] Selection write FAILED");
+        }
+    }
+}
@@ -1,6 +1,5 @@
 #pragma once
-#include <Arduino.h>
-#include <debug.h>
+#include "hal/hal.h"
 
 // ============================================================================
 // Output Pin Definitions
@@ -14,6 +13,20 @@
 #define OUTPUT07_PIN 19
 #define OUTPUT08_PIN 23
 
+// Output pins indexed by channel number (0-7)
+static const uint8_t OUTPUT_PINS[8] = {OUTPUT01_PIN, OUTPUT02_PIN, OUTPUT03_PIN, OUTPUT04_PIN,
+                                       OUTPUT05_PIN, OUTPUT06_PIN, OUTPUT07_PIN, OUTPUT08_PIN};
+
+// ============================================================================
+// Node Address DIP Switch (SW1 positions 1-3; position 4 is the CAN terminator)
+// ============================================================================
+#define DEVICE_SELECTION01_PIN 34  // Address bit 0; input-only, needs the external pull-down
+#define DEVICE_SELECTION02_PIN 35  // Address bit 1; input-only, needs the external pull-down
+#define DEVICE_SELECTION03_PIN 27  // Address bit 2
+
+static const uint8_t DEVICE_SELECTION_PINS[3] = {DEVICE_SELECTION01_PIN, DEVICE_SELECTION02_PIN,
+                                                 DEVICE_SELECTION03_PIN};
+
 namespace globals {
   // Global constants and utilities can go here
 }
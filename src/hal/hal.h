@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#define HAL_IMAGE_MAGIC 0xE9  // First byte of an ESP32 app image
+#define HAL_CAN_RX_QUEUE_LEN 32  // Received frames the driver buffers for the RX task (TWAI default is 5)
+
+/**
+ * Hardware abstraction layer
+ *
+ * Everything the firmware logic needs from the ESP32 - time, locks, tasks,
+ * PWM, CAN, NVS, raw flash, app slots and the image upload server - goes
+ * through the hal namespace. The ESP32 build maps it onto FreeRTOS, LEDC,
+ * the TWAI driver, Preferences, esp_partition, esp_ota and WebServer
+ * (halEsp32.h). The [env:native] build maps it onto in-memory fakes driven
+ * by a virtual clock (halNative.h), so the CAN dispatch, provisioning and
+ * sequence logic build and run on a Linux host.
+ *
+ * Both implementations provide:
+ *
+ *   Types: twai_message_t, twai_filter_config_t, hal::Lock (init with HAL_LOCK_INIT), hal::Task,
+ *          hal::FlashRegion, hal::Nvs (begin/isKey/getString/putString/
+ *          getBytes/putBytes/remove), hal::Inflater, hal::InflateCheckpoint, hal::Sha256
+ *
+ *   uint32_t millis();  uint32_t micros();
+ *   void lock(Lock &);  void unlock(Lock &);
+ *   Task *startTask(name, body, periodMs, stackBytes, priority, core);
+ *       periodMs > 0: body runs every periodMs; 0: body runs once per notify()
+ *   void notify(Task *);  void notifyFromIsr(Task *);  void notifyAfter(Task *, ms);
+ *       notifyAfter notifies once ms from now; a later call replaces a pending one
+ *   void pwmBegin(pins, count, frequencyHz, resolutionBits, hpoints, onFadeEnd);
+ *       hpoints[N] is the counter value where channel N's on-time starts (phase offset)
+ *   uint32_t pwmGetDuty(ch);  void pwmSetDuty(ch, duty);  void pwmFade(ch, duty, ms);
+ *       onFadeEnd(ch) runs when a pwmFade finishes (interrupt context on the ESP32)
+ *   bool canBegin(txPin, rxPin, baud, const twai_filter_config_t &, onReceive, onTransmit);
+ *   bool canSend(const twai_message_t &, timeoutMs);
+ *   CanBusState canPollBus();  void canRecover();
+ *       canPollBus restarts the controller once a bus-off recovery has finished
+ *   CanRxLosses canRxLosses();
+ *       frames lost since boot because the RX queue or the controller's FIFO was full
+ *   FlashRegion *flashFind(label);  uint32_t flashSize(region);
+ *   bool flashRead/flashWrite(region, offset, data, length);  bool flashErase(region, offset, length);
+ *   FlashRegion *flashUpdateSlot();  bool flashSetBootSlot(slot);  void restart();
+ *       the app slot that is not running, and switching the boot to it (validates the image)
+ *   uint32_t crc32Update(crc, data, length);
+ *   void sha256Begin(Sha256 &);  void sha256Update(ctx, data, length);  void sha256Finish(ctx, digest);
+ *       CRC-32 as zlib computes it, and SHA-256 (ROM crc32_le and mbedtls on the ESP32, portable code on the host)
+ *   bool inflateBlock(in, inLength, out, outCapacity, outLength);
+ *       one raw deflate stream into a flat buffer (ROM miniz on the ESP32, zlib on the host)
+ *   void inflaterBegin(Inflater &);  InflateStatus inflaterRun(inflater, in, inLength, out, outLength);
+ *   void inflaterSave(inflater, checkpoint);  bool inflaterRestore(inflater, checkpoint, output, flashLength, tail, tailLength);
+ *       a raw deflate stream fed piece by piece, with checkpoints to go back to
+ *   void uploadServerBegin(port, const UploadHandlers &);  void uploadServerPoll();  void uploadServerEnd();
+ *       HTTP image upload (WebServer); on the host the handlers are called directly
+ *   bool readInput(pin, pullDown);
+ *   void serialBegin(baud);  void waitForSerial(timeoutMs);
+ *
+ * Debug macros (debug, debugln, debugf) and the OtaUpdate/ArduinoOTA types are
+ * available through this header on both builds.
+ */
+namespace hal
+{
+    typedef void (*TaskBody)();
+    typedef void (*FadeEndCallback)(uint8_t channel);
+
+    enum CanBusState
+    {
+        CAN_BUS_RUNNING,
+        CAN_BUS_OFF,         // Too many errors; the controller sends nothing until recovered
+        CAN_BUS_RECOVERING,
+    };
+
+    struct CanRxLosses
+    {
+        uint32_t missed;   // Arrived while the RX queue was full
+        uint32_t overrun;  // Arrived while the controller's RX FIFO was full
+    };
+
+    enum InflateStatus
+    {
+        INFLATE_MORE,   // Needs more input, or has more output for the next call
+        INFLATE_DONE,   // End of the deflate stream
+        INFLATE_ERROR,
+    };
+
+    /**
+     * Image upload callbacks, called in order for each upload
+     */
+    struct UploadHandlers
+    {
+        uint32_t (*resumeOffset)();                          // Upload offset a client should continue from
+        bool (*start)(uint32_t offset);                      // Upload starting at offset; false refuses it
+        bool (*data)(const uint8_t *data, size_t length);    // false stops taking the rest
+        bool (*end)(bool complete);                          // complete = false: connection lost; true if installed
+    };
+}
+
+#if defined(HAL_NATIVE)
+#include "halNative.h"
+#else
+#include "halEsp32.h"
+#endif
@@ -0,0 +1,566 @@
+#pragma once
+#include <Arduino.h>
+#include <debug.h>
+#include <Preferences.h>
+#include <ArduinoOTA.h>
+#include <OtaUpdate.h>
+#include <freertos/timers.h>
+#include <driver/twai.h>
+#include <driver/ledc.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <rom/miniz.h>
+#include <rom/crc.h>
+#include <mbedtls/sha256.h>
+#include <WiFi.h>
+#include <WebServer.h>
+
+#define HAL_LOCK_INIT portMUX_INITIALIZER_UNLOCKED
+#define HAL_MAX_TASKS 8
+#define HAL_PWM_SPEED_MODE LEDC_HIGH_SPEED_MODE
+#define HAL_PWM_TIMER LEDC_TIMER_0
+#define HAL_CAN_TASK_STACK 4096
+#define HAL_CAN_TASK_PRIORITY 5
+#define HAL_CAN_ALERTS (TWAI_ALERT_RX_DATA | TWAI_ALERT_TX_SUCCESS | TWAI_ALERT_TX_FAILED)
+
+namespace hal
+{
+    typedef void (*CanReceiveCallback)(const twai_message_t &message);
+    typedef void (*CanTransmitCallback)(bool success);
+    typedef portMUX_TYPE Lock;
+    typedef esp_partition_t FlashRegion;
+    typedef Preferences Nvs;
+
+    struct Task
+    {
+        TaskHandle_t handle;
+        TaskBody body;
+        uint32_t periodMs;
+        TimerHandle_t timer;  // For notifyAfter(), created on first use
+    };
+
+    Task tasks[HAL_MAX_TASKS];
+    uint8_t taskCount = 0;
+    FadeEndCallback fadeEndCallback = nullptr;
+    bool isrYield = false;
+
+    // ------------------------------------------------------------------ time
+
+    uint32_t millis()
+    {
+        return ::millis();
+    }
+
+    uint32_t micros()
+    {
+        return ::micros();
+    }
+
+    // ------------------------------------------------------------ locks/tasks
+
+    void lock(Lock &l)
+    {
+        portENTER_CRITICAL(&l);
+    }
+
+    void unlock(Lock &l)
+    {
+        portEXIT_CRITICAL(&l);
+    }
+
+    void taskEntry(void *arg)
+    {
+        Task *task = (Task *)arg;
+        TickType_t lastWake = xTaskGetTickCount();
+        for (;;) {
+            if (task->periodMs) {
+                vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(task->periodMs));
+            } else {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            }
+            task->body();
+        }
+    }
+
+    Task *startTask(const char *name, TaskBody body, uint32_t periodMs, uint32_t stackBytes, uint8_t priority, int core)
+    {
+        if (taskCount >= HAL_MAX_TASKS) {
+            return nullptr;
+        }
+        Task *task = &tasks[taskCount++];
+        task->body = body;
+        task->periodMs = periodMs;
+        xTaskCreatePinnedToCore(taskEntry, name, stackBytes, task, priority, &task->handle, core);
+        return task;
+    }
+
+    void notify(Task *task)
+    {
+        if (task) {
+            xTaskNotifyGive(task->handle);
+        }
+    }
+
+    void IRAM_ATTR notifyFromIsr(Task *task)
+    {
+        if (!task) {
+            return;
+        }
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(task->handle, &woken);
+        isrYield |= woken == pdTRUE;
+    }
+
+    static void onNotifyTimer(TimerHandle_t timer)
+    {
+        notify((Task *)pvTimerGetTimerID(timer));
+    }
+
+    /**
+     * Notify a task once, ms from now (FreeRTOS one-shot timer)
+     * A later call restarts the timer with the new delay
+     */
+    void notifyAfter(Task *task, uint32_t ms)
+    {
+        if (!task) {
+            return;
+        }
+        TickType_t ticks = pdMS_TO_TICKS(ms) > 0 ? pdMS_TO_TICKS(ms) : 1;
+        if (!task->timer) {
+            task->timer = xTimerCreate("notifyAfter", ticks, pdFALSE, task, onNotifyTimer);
+        }
+        if (task->timer) {
+            xTimerChangePeriod(task->timer, ticks, 0);
+        }
+    }
+
+    // ------------------------------------------------------------------- PWM
+
+    static bool IRAM_ATTR onLedcFadeEnd(const ledc_cb_param_t *param, void *arg)
+    {
+        isrYield = false;
+        if (param->event == LEDC_FADE_END_EVT && fadeEndCallback) {
+            fadeEndCallback((uint8_t)(uintptr_t)arg);
+        }
+        return isrYield;
+    }
+
+    /**
+     * Attach pins[N] to LEDC channel N on one timer, with fade-end interrupts
+     * Each channel's on-time starts at hpoints[N]; later duty and fade writes keep it
+     */
+    void pwmBegin(const uint8_t *pins, uint8_t count, uint32_t frequencyHz, uint8_t resolutionBits,
+                  const uint32_t *hpoints, FadeEndCallback onFadeEnd)
+    {
+        fadeEndCallback = onFadeEnd;
+
+        ledc_timer_config_t timer = {};
+        timer.speed_mode = HAL_PWM_SPEED_MODE;
+        timer.duty_resolution = (ledc_timer_bit_t)resolutionBits;
+        timer.timer_num = HAL_PWM_TIMER;
+        timer.freq_hz = frequencyHz;
+        timer.clk_cfg = LEDC_AUTO_CLK;
+        ledc_timer_config(&timer);
+
+        for (uint32_t ch = 0; ch < count; ch++) {
+            ledc_channel_config_t channel = {};
+            channel.gpio_num = pins[ch];
+            channel.speed_mode = HAL_PWM_SPEED_MODE;
+            channel.channel = (ledc_channel_t)ch;
+            channel.timer_sel = HAL_PWM_TIMER;
+            channel.duty = 0;
+            channel.hpoint = hpoints[ch];
+            ledc_channel_config(&channel);
+        }
+
+        ledc_fade_func_install(0);
+
+        ledc_cbs_t callbacks = {};
+        callbacks.fade_cb = onLedcFadeEnd;
+        for (uint32_t ch = 0; ch < count; ch++) {
+            ledc_cb_register(HAL_PWM_SPEED_MODE, (ledc_channel_t)ch, &callbacks, (void *)(uintptr_t)ch);
+        }
+    }
+
+    uint32_t pwmGetDuty(uint8_t ch)
+    {
+        return ledc_get_duty(HAL_PWM_SPEED_MODE, (ledc_channel_t)ch);
+    }
+
+    void pwmSetDuty(uint8_t ch, uint32_t duty)
+    {
+        ledc_set_duty(HAL_PWM_SPEED_MODE, (ledc_channel_t)ch, duty);
+        ledc_update_duty(HAL_PWM_SPEED_MODE, (ledc_channel_t)ch);
+    }
+
+    void pwmFade(uint8_t ch, uint32_t duty, uint32_t ms)
+    {
+        ledc_set_fade_with_time(HAL_PWM_SPEED_MODE, (ledc_channel_t)ch, duty, ms);
+        ledc_fade_start(HAL_PWM_SPEED_MODE, (ledc_channel_t)ch, LEDC_FADE_NO_WAIT);
+    }
+
+    // ------------------------------------------------------------------- CAN
+
+    CanReceiveCallback canReceiveCallback = nullptr;
+    CanTransmitCallback canTransmitCallback = nullptr;
+    uint32_t canQueued = 0;  // Frames given to twai_transmit() and not yet reported done
+
+    /**
+     * CAN driver task: deliver received frames and TX results as the driver raises alerts
+     */
+    void canTaskEntry(void *)
+    {
+        for (;;) {
+            uint32_t alerts = 0;
+            if (twai_read_alerts(&alerts, portMAX_DELAY) != ESP_OK) {
+                continue;
+            }
+            if (alerts & TWAI_ALERT_RX_DATA) {
+                twai_message_t message;
+                while (twai_receive(&message, 0) == ESP_OK) {
+                    canReceiveCallback(message);
+                }
+            }
+            if (alerts & (TWAI_ALERT_TX_SUCCESS | TWAI_ALERT_TX_FAILED)) {
+                // TX alerts coalesce: whatever left the driver's TX queue since the last one is done
+                twai_status_info_t status;
+                if (twai_get_status_info(&status) != ESP_OK) {
+                    continue;
+                }
+                uint32_t queued = __atomic_load_n(&canQueued, __ATOMIC_ACQUIRE);
+                uint32_t done = queued > status.msgs_to_tx ? queued - status.msgs_to_tx : 0;
+                __atomic_sub_fetch(&canQueued, done, __ATOMIC_RELEASE);
+                for (uint32_t i = 0; i < done; i++) {
+                    canTransmitCallback(!(alerts & TWAI_ALERT_TX_FAILED));
+                }
+            }
+        }
+    }
+
+    /**
+     * Install the TWAI driver with the given acceptance filter and start the driver task
+     */
+    bool canBegin(int txPin, int rxPin, uint32_t baud, const twai_filter_config_t &filter,
+                  CanReceiveCallback onReceive, CanTransmitCallback onTransmit)
+    {
+        twai_timing_config_t timing;
+        switch (baud) {
+            case 125000: timing = TWAI_TIMING_CONFIG_125KBITS(); break;
+            case 250000: timing = TWAI_TIMING_CONFIG_250KBITS(); break;
+            case 500000: timing = TWAI_TIMING_CONFIG_500KBITS(); break;
+            case 1000000: timing = TWAI_TIMING_CONFIG_1MBITS(); break;
+            default: return false;
+        }
+        twai_general_config_t general = TWAI_GENERAL_CONFIG_DEFAULT((gpio_num_t)txPin, (gpio_num_t)rxPin, TWAI_MODE_NO_ACK);
+        general.alerts_enabled = HAL_CAN_ALERTS;
+        general.rx_queue_len = HAL_CAN_RX_QUEUE_LEN;
+        if (twai_driver_install(&general, &timing, &filter) != ESP_OK) {
+            return false;
+        }
+        if (twai_start() != ESP_OK) {
+            return false;
+        }
+        canReceiveCallback = onReceive;
+        canTransmitCallback = onTransmit;
+        return xTaskCreatePinnedToCore(canTaskEntry, "canDriver", HAL_CAN_TASK_STACK, nullptr, HAL_CAN_TASK_PRIORITY,
+                                       nullptr, 1) == pdPASS;
+    }
+
+    bool canSend(const twai_message_t &message, uint32_t timeoutMs)
+    {
+        __atomic_add_fetch(&canQueued, 1, __ATOMIC_ACQUIRE);
+        if (twai_transmit(&message, pdMS_TO_TICKS(timeoutMs)) != ESP_OK) {
+            __atomic_sub_fetch(&canQueued, 1, __ATOMIC_RELEASE);
+            return false;
+        }
+        return true;
+    }
+
+    CanBusState canPollBus()
+    {
+        twai_status_info_t status;
+        if (twai_get_status_info(&status) != ESP_OK) {
+            return CAN_BUS_RUNNING;
+        }
+        switch (status.state) {
+            case TWAI_STATE_BUS_OFF:
+                return CAN_BUS_OFF;
+            case TWAI_STATE_RECOVERING:
+                return CAN_BUS_RECOVERING;
+            case TWAI_STATE_STOPPED:
+                // Recovery leaves the driver stopped, with its TX queue cleared
+                __atomic_store_n(&canQueued, 0, __ATOMIC_RELEASE);
+                twai_start();
+                return CAN_BUS_RECOVERING;
+            default:
+                return CAN_BUS_RUNNING;
+        }
+    }
+
+    void canRecover()
+    {
+        twai_initiate_recovery();
+    }
+
+    CanRxLosses canRxLosses()
+    {
+        twai_status_info_t status;
+        if (twai_get_status_info(&status) != ESP_OK) {
+            return {0, 0};
+        }
+        return {status.rx_missed_count, status.rx_overrun_count};
+    }
+
+    // ----------------------------------------------------------------- flash
+
+    FlashRegion *flashFind(const char *label)
+    {
+        return (FlashRegion *)esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    }
+
+    uint32_t flashSize(const FlashRegion *region)
+    {
+        return region->size;
+    }
+
+    bool flashRead(const FlashRegion *region, uint32_t offset, void *data, size_t length)
+    {
+        return esp_partition_read(region, offset, data, length) == ESP_OK;
+    }
+
+    bool flashWrite(const FlashRegion *region, uint32_t offset, const void *data, size_t length)
+    {
+        return esp_partition_write(region, offset, data, length) == ESP_OK;
+    }
+
+    bool flashErase(const FlashRegion *region, uint32_t offset, size_t length)
+    {
+        return esp_partition_erase_range(region, offset, length) == ESP_OK;
+    }
+
+    /**
+     * The app slot (app0/app1) that is not running
+     */
+    FlashRegion *flashUpdateSlot()
+    {
+        return (FlashRegion *)esp_ota_get_next_update_partition(nullptr);
+    }
+
+    /**
+     * Boot from slot after the next restart; the image is validated first
+     */
+    bool flashSetBootSlot(FlashRegion *slot)
+    {
+        return esp_ota_set_boot_partition(slot) == ESP_OK;
+    }
+
+    void restart()
+    {
+        ESP.restart();
+    }
+
+    // --------------------------------------------------------------- hashing
+
+    typedef mbedtls_sha256_context Sha256;
+
+    /**
+     * CRC-32 with the table-driven routine in ROM (inverts in and out like zlib)
+     */
+    uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+    {
+        return crc32_le(crc, data, length);
+    }
+
+    /**
+     * SHA-256 through mbedtls, which runs it on the SHA accelerator
+     */
+    void sha256Begin(Sha256 &ctx)
+    {
+        mbedtls_sha256_init(&ctx);
+        mbedtls_sha256_starts_ret(&ctx, 0);
+    }
+
+    void sha256Update(Sha256 &ctx, const uint8_t *data, size_t length)
+    {
+        mbedtls_sha256_update_ret(&ctx, data, length);
+    }
+
+    void sha256Finish(Sha256 &ctx, uint8_t *digest)
+    {
+        mbedtls_sha256_finish_ret(&ctx, digest);
+        mbedtls_sha256_free(&ctx);
+    }
+
+    // ------------------------------------------------------------ compression
+
+    tinfl_decompressor inflator;  // ~11 KB, kept off the task stacks; one caller at a time
+
+    /**
+     * Inflate one raw deflate stream into out, with the miniz inflater in ROM
+     */
+    bool inflateBlock(const uint8_t *in, size_t inLength, uint8_t *out, size_t outCapacity, size_t &outLength)
+    {
+        tinfl_init(&inflator);
+        size_t inSize = inLength;
+        outLength = outCapacity;
+        tinfl_status status = tinfl_decompress(&inflator, in, &inSize, out, out, &outLength,
+                                               TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+        return status == TINFL_STATUS_DONE;
+    }
+
+    struct Inflater
+    {
+        tinfl_decompressor state;
+        uint8_t window[TINFL_LZ_DICT_SIZE];  // Output ring; also the dictionary for back-references
+        uint32_t produced;
+    };
+
+    struct InflateCheckpoint
+    {
+        tinfl_decompressor state;
+        uint32_t produced;
+    };
+
+    void inflaterBegin(Inflater &inflater)
+    {
+        tinfl_init(&inflater.state);
+        inflater.produced = 0;
+    }
+
+    /**
+     * Inflate part of a raw deflate stream
+     * inLength: bytes available in, bytes consumed out
+     * out/outLength: bytes produced, inside the window and valid until the next call
+     */
+    InflateStatus inflaterRun(Inflater &inflater, const uint8_t *in, size_t &inLength, const uint8_t *&out,
+                              size_t &outLength)
+    {
+        size_t at = inflater.produced & (TINFL_LZ_DICT_SIZE - 1);
+        outLength = TINFL_LZ_DICT_SIZE - at;
+        tinfl_status status = tinfl_decompress(&inflater.state, in, &inLength, inflater.window, inflater.window + at,
+                                               &outLength, TINFL_FLAG_HAS_MORE_INPUT);
+        out = inflater.window + at;
+        inflater.produced += outLength;
+        return status == TINFL_STATUS_DONE ? INFLATE_DONE : status < 0 ? INFLATE_ERROR : INFLATE_MORE;
+    }
+
+    void inflaterSave(const Inflater &inflater, InflateCheckpoint &checkpoint)
+    {
+        memcpy(&checkpoint.state, &inflater.state, sizeof(checkpoint.state));
+        checkpoint.produced = inflater.produced;
+    }
+
+    /**
+     * Go back to a checkpoint; the window is rebuilt from the output already
+     * written: flashLength bytes at the start of output, then tail
+     */
+    bool inflaterRestore(Inflater &inflater, const InflateCheckpoint &checkpoint, const FlashRegion *output,
+                         uint32_t flashLength, const uint8_t *tail, size_t tailLength)
+    {
+        memcpy(&inflater.state, &checkpoint.state, sizeof(inflater.state));
+        inflater.produced = checkpoint.produced;
+        uint32_t from = flashLength > TINFL_LZ_DICT_SIZE ? flashLength - TINFL_LZ_DICT_SIZE : 0;
+        for (uint32_t position = from; position < flashLength;) {
+            uint32_t at = position & (TINFL_LZ_DICT_SIZE - 1);
+            uint32_t length = std::min<uint32_t>(flashLength - position, TINFL_LZ_DICT_SIZE - at);
+            if (!flashRead(output, position, inflater.window + at, length)) {
+                return false;
+            }
+            position += length;
+        }
+        for (size_t i = 0; i < tailLength; i++) {
+            inflater.window[(flashLength + i) & (TINFL_LZ_DICT_SIZE - 1)] = tail[i];
+        }
+        return true;
+    }
+
+    // ---------------------------------------------------------- upload server
+
+    WebServer uploadServer;
+    UploadHandlers uploadHandlers;
+    uint16_t uploadPort = 0;
+    bool uploadListening = false;
+    bool uploadAccepted = false;
+
+    /**
+     * HTTP image upload: GET /update returns the offset to continue from,
+     * POST /update?offset=N (multipart file) streams the body to the handlers
+     */
+    void uploadServerBegin(uint16_t port, const UploadHandlers &handlers)
+    {
+        uploadPort = port;
+        uploadHandlers = handlers;
+        uploadServer.on("/update", HTTP_GET, []() {
+            uploadServer.send(200, "text/plain", String(uploadHandlers.resumeOffset()) + "\n");
+        });
+        uploadServer.on("/update", HTTP_POST, []() {
+            uploadServer.send(uploadAccepted ? 200 : 409, "text/plain", String(uploadHandlers.resumeOffset()) + "\n");
+        }, []() {
+            HTTPUpload &upload = uploadServer.upload();
+            switch (upload.status) {
+                case UPLOAD_FILE_START:
+                    uploadAccepted = uploadHandlers.start(strtoul(uploadServer.arg("offset").c_str(), nullptr, 10));
+                    break;
+                case UPLOAD_FILE_WRITE:
+                    uploadAccepted = uploadAccepted && uploadHandlers.data(upload.buf, upload.currentSize);
+                    break;
+                case UPLOAD_FILE_END:
+                    uploadAccepted = uploadAccepted && uploadHandlers.end(true);
+                    break;
+                case UPLOAD_FILE_ABORTED:
+                    uploadHandlers.end(false);
+                    uploadAccepted = false;
+                    break;
+            }
+        });
+    }
+
+    /**
+     * Serve requests; starts listening once WiFi is connected
+     */
+    void uploadServerPoll()
+    {
+        if (!uploadListening) {
+            if (WiFi.status() != WL_CONNECTED) {
+                return;
+            }
+            uploadServer.begin(uploadPort);
+            uploadListening = true;
+        }
+        uploadServer.handleClient();
+    }
+
+    void uploadServerEnd()
+    {
+        if (uploadListening) {
+            uploadServer.stop();
+            uploadListening = false;
+        }
+    }
+
+    // ------------------------------------------------------------------ GPIO
+
+    /**
+     * Configure a pin as input and read it (GPIO 34-39 have no internal pulls)
+     */
+    bool readInput(uint8_t pin, bool pullDown)
+    {
+        pinMode(pin, pullDown ? INPUT_PULLDOWN : INPUT);
+        return digitalRead(pin) == HIGH;
+    }
+
+    // ---------------------------------------------------------------- serial
+
+    void serialBegin(uint32_t baud)
+    {
+        Serial.begin(baud);
+    }
+
+    void waitForSerial(uint32_t timeoutMs)
+    {
+        unsigned long start = ::millis();
+        while (!Serial.available() && (::millis() - start < timeoutMs)) {
+            delay(10);
+        }
+    }
+}
@@ -0,0 +1,608 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+// zlib's crc32() would take the name of the firmware's crc32 namespace
+#define crc32 zlibCrc32
+#include <zlib.h>
+#undef crc32
+#include "softHash.h"
+
+#define HAL_LOCK_INIT {}
+#define HAL_MAX_TASKS 8
+#define HAL_PWM_CHANNELS 8
+#define HAL_FLASH_SIZE 0x30000
+#define HAL_APP_SLOT_SIZE 0x1E0000
+#define HAL_INFLATE_WINDOW 32768    // Deflate dictionary size (TINFL_LZ_DICT_SIZE on the ESP32)
+#define IRAM_ATTR
+
+// ---------------------------------------------------------------- debug
+
+#if DEBUG == 1
+// Debug output goes to stderr so host tools can keep stdout for their results
+inline void halDebugPrint(const char *s) { fputs(s, stderr); }
+inline void halDebugPrint(const std::string &s) { fputs(s.c_str(), stderr); }
+inline void halDebugPrint(char c) { fputc(c, stderr); }
+inline void halDebugPrint(long v) { fprintf(stderr, "%ld", v); }
+inline void halDebugPrint(unsigned long v) { fprintf(stderr, "%lu", v); }
+inline void halDebugPrint(int v) { fprintf(stderr, "%d", v); }
+inline void halDebugPrint(unsigned int v) { fprintf(stderr, "%u", v); }
+inline void halDebugPrint(double v) { fprintf(stderr, "%.2f", v); }
+#define debug(x) halDebugPrint(x)
+#define debugln(x) (halDebugPrint(x), fputc('\n', stderr))
+#define debugf(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define debug(x)
+#define debugln(x)
+#define debugf(...)
+#endif
+
+// --------------------------------------------------------- CAN frame type
+
+// Same field names as the ESP-IDF TWAI driver's message type
+typedef struct
+{
+    uint32_t extd : 1;
+    uint32_t rtr : 1;
+    uint32_t ss : 1;
+    uint32_t self : 1;
+    uint32_t dlc_non_comp : 1;
+    uint32_t identifier;
+    uint8_t data_length_code;
+    uint8_t data[8];
+} twai_message_t;
+
+typedef struct
+{
+    uint32_t acceptance_code;
+    uint32_t acceptance_mask;  // 1 = don't care
+    bool single_filter;
+} twai_filter_config_t;
+
+#define TWAI_FILTER_CONFIG_ACCEPT_ALL() {0, 0xFFFFFFFF, true}
+
+// ------------------------------------------------------------- OTA fakes
+
+class OtaUpdate
+{
+public:
+    OtaUpdate(unsigned long timeoutMs, const char * /*ssid*/, const char * /*password*/) : timeoutMs(timeoutMs) {}
+    std::string getHostName() { return "esp32-000000"; }
+    void waitForOta() {}
+    unsigned long timeoutMs;
+};
+
+typedef enum { OTA_AUTH_ERROR, OTA_BEGIN_ERROR, OTA_CONNECT_ERROR, OTA_RECEIVE_ERROR, OTA_END_ERROR } ota_error_t;
+
+struct ArduinoOTAClass
+{
+    void onStart(std::function<void()>) {}
+    void onEnd(std::function<void()>) {}
+    void onProgress(std::function<void(unsigned int, unsigned int)>) {}
+    void onError(std::function<void(ota_error_t)>) {}
+};
+
+inline ArduinoOTAClass ArduinoOTA;
+
+namespace hal
+{
+    typedef void (*CanReceiveCallback)(const twai_message_t &message);
+    typedef void (*CanTransmitCallback)(bool success);
+
+    struct Lock
+    {
+    };
+
+    struct Task
+    {
+        const char *name;
+        TaskBody body;
+        uint32_t periodMs;
+        uint32_t nextRun;
+        bool notified;
+        bool timerArmed;  // notifyAfter() pending until timerAt
+        uint32_t timerAt;
+    };
+
+    struct FlashRegion
+    {
+        const char *label;
+        std::vector<uint8_t> data;
+    };
+
+    /**
+     * Fake NVS: namespaced key/value blobs in memory (same calls as Preferences)
+     */
+    class Nvs
+    {
+    public:
+        bool begin(const char *name, bool /*readOnly*/ = false)
+        {
+            space = &store()[name];
+            return true;
+        }
+        bool isKey(const char *key) { return space && space->count(key); }
+        size_t getString(const char *key, char *value, size_t maxLen)
+        {
+            if (!isKey(key) || (*space)[key].size() + 1 > maxLen) return 0;
+            std::vector<uint8_t> &v = (*space)[key];
+            memcpy(value, v.data(), v.size());
+            value[v.size()] = '\0';
+            return v.size() + 1;
+        }
+        size_t putString(const char *key, const char *value) { return putBytes(key, value, strlen(value)); }
+        size_t getBytesLength(const char *key) { return isKey(key) ? (*space)[key].size() : 0; }
+        size_t getBytes(const char *key, void *buf, size_t maxLen)
+        {
+            if (!isKey(key) || (*space)[key].size() > maxLen) return 0;
+            std::vector<uint8_t> &v = (*space)[key];
+            memcpy(buf, v.data(), v.size());
+            return v.size();
+        }
+        size_t putBytes(const char *key, const void *value, size_t len)
+        {
+            if (writesFail) return 0;
+            (*space)[key].assign((const uint8_t *)value, (const uint8_t *)value + len);
+            return len;
+        }
+        bool remove(const char *key) { return space && space->erase(key); }
+
+        static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> &store()
+        {
+            static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvs;
+            return nvs;
+        }
+
+        static inline bool writesFail = false;  // Host hook: puts store nothing and return 0, like a full partition
+
+    private:
+        std::map<std::string, std::vector<uint8_t>> *space = nullptr;
+    };
+
+    /**
+     * Fake hardware state, driven by the host program
+     */
+    namespace native
+    {
+        struct PwmChannel
+        {
+            uint32_t duty;
+            uint32_t fadeFrom;
+            uint32_t fadeTo;
+            uint32_t fadeStart;
+            uint32_t fadeEnd;
+            uint32_t hpoint;
+            bool fading;
+        };
+
+        inline uint64_t nowUs = 0;
+        inline Task tasks[HAL_MAX_TASKS];
+        inline uint8_t taskCount = 0;
+        inline PwmChannel pwm[HAL_PWM_CHANNELS];
+        inline uint8_t pwmResolutionBits = 8;
+        inline FadeEndCallback fadeEndCallback = nullptr;
+        inline CanReceiveCallback canReceive = nullptr;
+        inline CanTransmitCallback canTransmit = nullptr;
+        inline twai_filter_config_t canFilter = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+        inline uint32_t filteredFrames = 0;  // Frames the acceptance filter kept from the RX callback
+        inline CanBusState canBusState = CAN_BUS_RUNNING;  // Set to CAN_BUS_OFF to fake a bus-off
+        inline uint32_t canRxMissed = 0;  // Frames the host dropped at a full RX queue (canReplay)
+        inline std::function<void(const twai_message_t &)> onCanSend;  // Host hook for outgoing frames
+        inline std::function<void(uint8_t ch, uint32_t duty, uint32_t fadeMs)> onPwmWrite;  // Host hook for duty/fade writes
+        inline FlashRegion flash = {"spiffs", std::vector<uint8_t>(HAL_FLASH_SIZE)};
+        inline FlashRegion appSlots[2] = {{"app0", std::vector<uint8_t>(HAL_APP_SLOT_SIZE, 0xFF)},
+                                          {"app1", std::vector<uint8_t>(HAL_APP_SLOT_SIZE, 0xFF)}};
+        inline uint8_t runningSlot = 0;
+        inline uint8_t bootSlot = 0;          // Slot the next boot would start
+        inline bool restartRequested = false; // Set by hal::restart()
+        inline bool inputLevels[40] = {false};  // Set by host code before setup()
+        inline UploadHandlers uploadHandlers = {};
+        inline uint16_t uploadPort = 0;
+        inline bool uploadListening = false;  // Between uploadServerPoll() and uploadServerEnd()
+
+        inline uint32_t millis() { return nowUs / 1000; }
+
+        /**
+         * Run every notified task until none is left, then periodic tasks that are due
+         */
+        inline void runTasks()
+        {
+            for (int i = 0; i < taskCount; i++) {
+                Task &t = tasks[i];
+                if (t.timerArmed && (int32_t)(millis() - t.timerAt) >= 0) {
+                    t.timerArmed = false;
+                    t.notified = true;
+                }
+            }
+            for (int pass = 0; pass < 16; pass++) {
+                bool ran = false;
+                for (int i = 0; i < taskCount; i++) {
+                    if (tasks[i].notified) {
+                        tasks[i].notified = false;
+                        tasks[i].body();
+                        ran = true;
+                    }
+                }
+                if (!ran) break;
+            }
+            for (int i = 0; i < taskCount; i++) {
+                Task &t = tasks[i];
+                if (t.periodMs && (int32_t)(millis() - t.nextRun) >= 0) {
+                    t.nextRun += t.periodMs;
+                    t.body();
+                }
+            }
+        }
+
+        /**
+         * Finish hardware fades that have reached their end time
+         */
+        inline void completeFades()
+        {
+            for (uint8_t ch = 0; ch < HAL_PWM_CHANNELS; ch++) {
+                PwmChannel &c = pwm[ch];
+                if (c.fading && (int32_t)(millis() - c.fadeEnd) >= 0) {
+                    c.fading = false;
+                    c.duty = c.fadeTo;
+                    if (fadeEndCallback) fadeEndCallback(ch);
+                }
+            }
+        }
+
+        /**
+         * Advance the virtual clock to ms, firing fades and tasks along the way
+         */
+        inline void advanceTo(uint32_t ms)
+        {
+            while (millis() < ms) {
+                nowUs += 1000;
+                completeFades();
+                runTasks();
+            }
+            runTasks();
+        }
+
+        inline bool filterMatches(uint32_t value, uint32_t bits)
+        {
+            return ((value ^ canFilter.acceptance_code) & ~canFilter.acceptance_mask & bits) == 0;
+        }
+
+        /**
+         * Whether the TWAI acceptance filter passes a frame
+         * Same register layout as the ESP32 controller (single and dual filter mode)
+         */
+        inline bool filterAccepts(const twai_message_t &message)
+        {
+            uint32_t id = message.identifier;
+            uint8_t data0 = message.data_length_code > 0 ? message.data[0] : 0;
+            uint8_t data1 = message.data_length_code > 1 ? message.data[1] : 0;
+            if (canFilter.single_filter) {
+                if (message.extd) {
+                    return filterMatches((id << 3) | (message.rtr << 2), 0xFFFFFFFC);
+                }
+                return filterMatches((id << 21) | (message.rtr << 20) | (data0 << 8) | data1, 0xFFF0FFFF);
+            }
+            if (message.extd) {
+                return filterMatches((id >> 13) << 16, 0xFFFF0000) || filterMatches(id >> 13, 0x0000FFFF);
+            }
+            uint32_t first = (id << 21) | (message.rtr << 20) | ((data0 >> 4) << 16) | (data0 & 0x0F);
+            uint32_t second = (id << 5) | (message.rtr << 4);
+            return filterMatches(first, 0xFFFF000F) || filterMatches(second, 0x0000FFF0);
+        }
+
+        /**
+         * Deliver a frame as if the TWAI RX task had received it
+         * Frames the acceptance filter rejects are counted and dropped
+         */
+        inline void injectFrame(const twai_message_t &message)
+        {
+            if (!filterAccepts(message)) {
+                filteredFrames++;
+                return;
+            }
+            if (canReceive) canReceive(message);
+            runTasks();
+        }
+
+        /**
+         * Duty a channel is currently outputting, interpolating running fades
+         */
+        inline uint32_t dutyNow(uint8_t ch)
+        {
+            PwmChannel &c = pwm[ch];
+            if (!c.fading || c.fadeEnd == c.fadeStart) return c.duty;
+            uint32_t elapsed = millis() - c.fadeStart;
+            return c.fadeFrom + ((int64_t)c.fadeTo - c.fadeFrom) * elapsed / (c.fadeEnd - c.fadeStart);
+        }
+    }
+
+    // ------------------------------------------------------------------ time
+
+    inline uint32_t millis() { return native::millis(); }
+    inline uint32_t micros() { return (uint32_t)native::nowUs; }
+
+    // ------------------------------------------------------------ locks/tasks
+
+    inline void lock(Lock &) {}
+    inline void unlock(Lock &) {}
+
+    inline Task *startTask(const char *name, TaskBody body, uint32_t periodMs, uint32_t, uint8_t, int)
+    {
+        if (native::taskCount >= HAL_MAX_TASKS) return nullptr;
+        Task *task = &native::tasks[native::taskCount++];
+        *task = {name, body, periodMs, millis() + periodMs, false, false, 0};
+        return task;
+    }
+
+    inline void notify(Task *task)
+    {
+        if (task) task->notified = true;
+    }
+
+    inline void notifyFromIsr(Task *task)
+    {
+        notify(task);
+    }
+
+    inline void notifyAfter(Task *task, uint32_t ms)
+    {
+        if (task) {
+            task->timerArmed = true;
+            task->timerAt = millis() + (ms > 0 ? ms : 1);
+        }
+    }
+
+    // ------------------------------------------------------------------- PWM
+
+    inline void pwmBegin(const uint8_t *, uint8_t count, uint32_t, uint8_t resolutionBits, const uint32_t *hpoints,
+                         FadeEndCallback onFadeEnd)
+    {
+        for (uint8_t ch = 0; ch < count; ch++) {
+            native::pwm[ch].hpoint = hpoints[ch];
+        }
+        native::pwmResolutionBits = resolutionBits;
+        native::fadeEndCallback = onFadeEnd;
+    }
+
+    inline uint32_t pwmGetDuty(uint8_t ch) { return native::dutyNow(ch); }
+
+    inline void pwmSetDuty(uint8_t ch, uint32_t duty)
+    {
+        native::pwm[ch].duty = duty;
+        native::pwm[ch].fading = false;
+        if (native::onPwmWrite) native::onPwmWrite(ch, duty, 0);
+    }
+
+    inline void pwmFade(uint8_t ch, uint32_t duty, uint32_t ms)
+    {
+        native::PwmChannel &c = native::pwm[ch];
+        c.fadeFrom = native::dutyNow(ch);
+        c.duty = c.fadeFrom;
+        c.fadeTo = duty;
+        c.fadeStart = millis();
+        c.fadeEnd = millis() + ms;
+        c.fading = true;
+        if (native::onPwmWrite) native::onPwmWrite(ch, duty, ms);
+    }
+
+    // ------------------------------------------------------------------- CAN
+
+    inline bool canBegin(int, int, uint32_t, const twai_filter_config_t &filter, CanReceiveCallback onReceive,
+                         CanTransmitCallback onTransmit)
+    {
+        native::canFilter = filter;
+        native::canReceive = onReceive;
+        native::canTransmit = onTransmit;
+        return true;
+    }
+
+    /**
+     * Frames go straight to the host hook and complete at once (onTransmit is called)
+     */
+    inline bool canSend(const twai_message_t &message, uint32_t)
+    {
+        if (native::canBusState != CAN_BUS_RUNNING) {
+            return false;
+        }
+        if (native::onCanSend) native::onCanSend(message);
+        if (native::canTransmit) native::canTransmit(true);
+        return true;
+    }
+
+    inline CanBusState canPollBus()
+    {
+        return native::canBusState;
+    }
+
+    inline void canRecover()
+    {
+        if (native::canBusState == CAN_BUS_OFF) native::canBusState = CAN_BUS_RUNNING;
+    }
+
+    inline CanRxLosses canRxLosses()
+    {
+        return {native::canRxMissed, 0};
+    }
+
+    // ----------------------------------------------------------------- flash
+
+    inline FlashRegion *flashFind(const char *label)
+    {
+        return strcmp(label, native::flash.label) == 0 ? &native::flash : nullptr;
+    }
+
+    inline uint32_t flashSize(const FlashRegion *region) { return region->data.size(); }
+
+    inline bool flashRead(const FlashRegion *region, uint32_t offset, void *data, size_t length)
+    {
+        if (offset + length > region->data.size()) return false;
+        memcpy(data, region->data.data() + offset, length);
+        return true;
+    }
+
+    inline bool flashWrite(FlashRegion *region, uint32_t offset, const void *data, size_t length)
+    {
+        if (offset + length > region->data.size()) return false;
+        // NOR flash semantics: writes can only clear bits
+        for (size_t i = 0; i < length; i++) region->data[offset + i] &= ((const uint8_t *)data)[i];
+        return true;
+    }
+
+    inline bool flashErase(FlashRegion *region, uint32_t offset, size_t length)
+    {
+        if (offset + length > region->data.size()) return false;
+        memset(region->data.data() + offset, 0xFF, length);
+        return true;
+    }
+
+    inline FlashRegion *flashUpdateSlot()
+    {
+        return &native::appSlots[1 - native::runningSlot];
+    }
+
+    /**
+     * Like esp_ota_set_boot_partition, refuses a slot without an app image header
+     */
+    inline bool flashSetBootSlot(FlashRegion *slot)
+    {
+        if (slot->data[0] != HAL_IMAGE_MAGIC) return false;
+        native::bootSlot = slot - native::appSlots;
+        return true;
+    }
+
+    inline void restart()
+    {
+        native::restartRequested = true;
+    }
+
+    // --------------------------------------------------------------- hashing
+
+    typedef softHash::Sha256 Sha256;
+
+    inline uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+    {
+        return softHash::crc32Update(crc, data, length);
+    }
+
+    inline void sha256Begin(Sha256 &ctx)
+    {
+        softHash::sha256Begin(ctx);
+    }
+
+    inline void sha256Update(Sha256 &ctx, const uint8_t *data, size_t length)
+    {
+        softHash::sha256Update(ctx, data, length);
+    }
+
+    inline void sha256Finish(Sha256 &ctx, uint8_t *digest)
+    {
+        softHash::sha256Finish(ctx, digest);
+    }
+
+    // ------------------------------------------------------------ compression
+
+    /**
+     * Inflate one raw deflate stream into out (zlib on the host)
+     */
+    inline bool inflateBlock(const uint8_t *in, size_t inLength, uint8_t *out, size_t outCapacity, size_t &outLength)
+    {
+        z_stream stream = {};
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) return false;
+        stream.next_in = (Bytef *)in;
+        stream.avail_in = inLength;
+        stream.next_out = out;
+        stream.avail_out = outCapacity;
+        int result = ::inflate(&stream, Z_FINISH);
+        outLength = stream.total_out;
+        inflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+
+    struct Inflater
+    {
+        z_stream stream;
+        bool open;
+        uint8_t window[HAL_INFLATE_WINDOW];  // Output ring, as on the ESP32
+        uint32_t produced;
+    };
+
+    struct InflateCheckpoint
+    {
+        z_stream stream;
+        bool open;
+        uint32_t produced;
+    };
+
+    inline void inflaterBegin(Inflater &inflater)
+    {
+        if (inflater.open) inflateEnd(&inflater.stream);
+        inflater.stream = {};
+        inflater.open = inflateInit2(&inflater.stream, -MAX_WBITS) == Z_OK;
+        inflater.produced = 0;
+    }
+
+    inline InflateStatus inflaterRun(Inflater &inflater, const uint8_t *in, size_t &inLength, const uint8_t *&out,
+                                     size_t &outLength)
+    {
+        size_t at = inflater.produced & (HAL_INFLATE_WINDOW - 1);
+        inflater.stream.next_in = (Bytef *)in;
+        inflater.stream.avail_in = inLength;
+        inflater.stream.next_out = inflater.window + at;
+        inflater.stream.avail_out = HAL_INFLATE_WINDOW - at;
+        int result = ::inflate(&inflater.stream, Z_NO_FLUSH);
+        inLength -= inflater.stream.avail_in;
+        outLength = HAL_INFLATE_WINDOW - at - inflater.stream.avail_out;
+        out = inflater.window + at;
+        inflater.produced += outLength;
+        if (result == Z_STREAM_END) return INFLATE_DONE;
+        return result == Z_OK || result == Z_BUF_ERROR ? INFLATE_MORE : INFLATE_ERROR;
+    }
+
+    inline void inflaterSave(const Inflater &inflater, InflateCheckpoint &checkpoint)
+    {
+        if (checkpoint.open) inflateEnd(&checkpoint.stream);
+        checkpoint.open = inflateCopy(&checkpoint.stream, (z_streamp)&inflater.stream) == Z_OK;
+        checkpoint.produced = inflater.produced;
+    }
+
+    /**
+     * zlib keeps its own window, so the written output is not needed to go back
+     */
+    inline bool inflaterRestore(Inflater &inflater, const InflateCheckpoint &checkpoint, const FlashRegion *,
+                                uint32_t, const uint8_t *, size_t)
+    {
+        if (inflater.open) inflateEnd(&inflater.stream);
+        inflater.open = checkpoint.open && inflateCopy(&inflater.stream, (z_streamp)&checkpoint.stream) == Z_OK;
+        inflater.produced = checkpoint.produced;
+        return inflater.open;
+    }
+
+    // ---------------------------------------------------------- upload server
+
+    // No network on the host: the handlers are stored for host code to call as the server would
+    inline void uploadServerBegin(uint16_t port, const UploadHandlers &handlers)
+    {
+        native::uploadPort = port;
+        native::uploadHandlers = handlers;
+    }
+
+    inline void uploadServerPoll() { native::uploadListening = true; }
+    inline void uploadServerEnd() { native::uploadListening = false; }
+
+    // ------------------------------------------------------------------ GPIO
+
+    inline bool readInput(uint8_t pin, bool)
+    {
+        return pin < 40 && native::inputLevels[pin];
+    }
+
+    // ---------------------------------------------------------------- serial
+
+    inline void serialBegin(uint32_t) {}
+    inline void waitForSerial(uint32_t) {}
+}
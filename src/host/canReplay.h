@@ -0,0 +1,387 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "../hal/hal.h"
+#include "../outputState.h"
+#include "../canDispatch.h"
+#include "../canHelper.h"
+
+#define REPLAY_RX_QUEUE_LEN HAL_CAN_RX_QUEUE_LEN  // rx_queue_len the firmware installs the driver with
+#define REPLAY_RX_COST_US 50       // Time the RX task spends per frame
+#define REPLAY_START_MS 1000       // Virtual time of the first logged frame (after boot)
+#define REPLAY_TAIL_MS 2000        // Time simulated after the last frame
+
+/**
+ * Deterministic replay of a candump log against the firmware (native build only)
+ *
+ * Frames are delivered through the normal CAN receive callback at their logged
+ * time offsets, on the virtual clock that drives hal::millis(). loop() runs
+ * every virtual millisecond and the fake tasks run as soon as they are due,
+ * so a replay gives the same result every time.
+ *
+ * The RX task is modeled as a queue of REPLAY_RX_QUEUE_LEN frames served in
+ * order at a fixed cost per frame; frames arriving at a full queue are dropped,
+ * as the TWAI driver does during a bus storm. A frame takes effect when the RX
+ * task is done with it, so latency includes the queueing and the RX cost.
+ *
+ * For every frame that changes an output level, latency runs from the frame's
+ * arrival to the first PWM write for each changed channel. A command whose
+ * channel is overwritten by a later command before reaching the hardware
+ * counts as superseded.
+ *
+ * The replay fails if a command never reaches the hardware, or if a channel
+ * at rest at the end does not carry the duty its published level maps to.
+ *
+ * Accepted log lines (candump -l and candump -ta):
+ *   (1700000000.123456) can0 015#0240F401
+ *   (1700000000.123456)  can0  015   [4]  02 40 F4 01
+ */
+namespace canReplay
+{
+    struct Options
+    {
+        const char *pwmPath = nullptr;  // CSV of PWM writes: time_us,channel,duty,fade_ms
+        const char *txPath = nullptr;   // Outgoing frames in candump -l format
+        uint32_t rxQueueLength = REPLAY_RX_QUEUE_LEN;
+        uint32_t rxCostUs = REPLAY_RX_COST_US;
+        uint32_t startMs = REPLAY_START_MS;
+    };
+
+    struct LoggedFrame
+    {
+        uint64_t arrivalUs;   // Virtual time the frame reaches the controller
+        uint64_t dispatchUs;  // Virtual time its handler has run: RX task start + rxCostUs
+        twai_message_t message;
+    };
+
+    struct Command
+    {
+        uint64_t arrivalUs;
+        uint8_t channelsLeft;  // Changed channels not yet written to the hardware
+        bool superseded;
+    };
+
+    struct Stats
+    {
+        uint32_t frames = 0;
+        uint32_t rxDropped = 0;
+        uint32_t filtered = 0;     // Rejected by the TWAI acceptance filter
+        uint32_t commands = 0;     // Frames that changed at least one output level
+        uint32_t applied = 0;
+        uint32_t superseded = 0;
+        uint32_t statusFrames = 0; // CAN_SEND_MESSAGE_ID frames sent
+        uint32_t txFrames = 0;
+        uint32_t pwmWrites = 0;
+        std::vector<uint32_t> latencyUs;
+    };
+
+    std::vector<Command> commands;
+    int pendingCommand[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    Stats stats;
+    FILE *pwmFile = nullptr;
+    FILE *txFile = nullptr;
+
+    uint64_t nowUs()
+    {
+        return hal::native::nowUs;
+    }
+
+    /**
+     * Parse one candump line
+     * @return false for blank, comment or malformed lines
+     */
+    bool parseLine(const char *line, uint64_t &timeUs, twai_message_t &message)
+    {
+        unsigned long long seconds;
+        char fraction[16];
+        char interface[32];
+        char rest[128];
+        if (sscanf(line, " (%llu.%15[0-9]) %31s %127[^\n]", &seconds, fraction, interface, rest) != 4) {
+            return false;
+        }
+        uint32_t micros = 0;
+        for (int i = 0; i < 6; i++) {
+            micros = micros * 10 + (fraction[i] >= '0' && fraction[i] <= '9' ? fraction[i] - '0' : 0);
+            if (!fraction[i]) {
+                for (; i < 5; i++) micros *= 10;
+                break;
+            }
+        }
+        timeUs = seconds * 1000000ULL + micros;
+
+        message = {};
+        char *hash = strchr(rest, '#');
+        char *cursor;
+        if (hash) {
+            // candump -l: ID#DATA or ID#R
+            *hash = '\0';
+            message.identifier = strtoul(rest, nullptr, 16);
+            message.extd = strlen(rest) > 3;
+            cursor = hash + 1;
+            if (*cursor == 'R') {
+                message.rtr = true;
+                return true;
+            }
+            while (cursor[0] && cursor[1] && message.data_length_code < 8) {
+                char byte[3] = {cursor[0], cursor[1], '\0'};
+                message.data[message.data_length_code++] = strtoul(byte, nullptr, 16);
+                cursor += 2;
+            }
+            return true;
+        }
+
+        // candump -ta: ID [DLC] B0 B1 ...
+        unsigned int dlc;
+        char id[16];
+        int consumed = 0;
+        if (sscanf(rest, "%15s [%u]%n", id, &dlc, &consumed) != 2 || dlc > 8) {
+            return false;
+        }
+        message.identifier = strtoul(id, nullptr, 16);
+        message.extd = strlen(id) > 3;
+        cursor = rest + consumed;
+        if (strstr(cursor, "remote request")) {
+            message.rtr = true;
+            message.data_length_code = dlc;
+            return true;
+        }
+        for (unsigned int i = 0; i < dlc; i++) {
+            unsigned int byte;
+            int n = 0;
+            if (sscanf(cursor, " %2x%n", &byte, &n) != 1) {
+                return false;
+            }
+            message.data[i] = byte;
+            cursor += n;
+        }
+        message.data_length_code = dlc;
+        return true;
+    }
+
+    /**
+     * Read a log and turn logged timestamps into virtual RX dispatch times
+     * Frames the acceptance filter rejects or that find the RX queue full are
+     * counted and left out. Call after setup() has installed the filter.
+     */
+    std::vector<LoggedFrame> load(FILE *log, const Options &options)
+    {
+        std::vector<LoggedFrame> frames;
+        std::deque<uint64_t> queued;  // Dispatch times of frames waiting in the RX queue
+        uint64_t firstUs = 0;
+        uint64_t rxFreeUs = 0;
+        char line[256];
+
+        while (fgets(line, sizeof(line), log)) {
+            uint64_t timeUs;
+            twai_message_t message;
+            if (!parseLine(line, timeUs, message)) {
+                continue;
+            }
+            if (stats.frames++ == 0) {
+                firstUs = timeUs;
+            }
+            uint64_t arrivalUs = options.startMs * 1000ULL + (timeUs - firstUs);
+            if (!hal::native::filterAccepts(message)) {
+                stats.filtered++;
+                continue;
+            }
+
+            while (!queued.empty() && queued.front() <= arrivalUs) {
+                queued.pop_front();
+            }
+            if (queued.size() >= options.rxQueueLength) {
+                stats.rxDropped++;
+                hal::native::canRxMissed++;
+                continue;
+            }
+
+            uint64_t startUs = std::max(arrivalUs, rxFreeUs);  // Leaves the queue
+            rxFreeUs = startUs + options.rxCostUs;
+            queued.push_back(startUs);
+            frames.push_back({arrivalUs, rxFreeUs, message});
+        }
+        return frames;
+    }
+
+    void onPwmWrite(uint8_t ch, uint32_t duty, uint32_t fadeMs)
+    {
+        stats.pwmWrites++;
+        if (pwmFile) {
+            fprintf(pwmFile, "%llu,%u,%u,%u\n", (unsigned long long)nowUs(), ch, duty, fadeMs);
+        }
+
+        int index = pendingCommand[ch];
+        if (index < 0) {
+            return;
+        }
+        pendingCommand[ch] = -1;
+        Command &command = commands[index];
+        command.channelsLeft &= ~(1 << ch);
+        if (command.channelsLeft == 0 && !command.superseded) {
+            stats.applied++;
+            stats.latencyUs.push_back(nowUs() - command.arrivalUs);
+        }
+    }
+
+    void onCanSend(const twai_message_t &message)
+    {
+        stats.txFrames++;
+        if (message.identifier == nodeAddress::id(CAN_SEND_MESSAGE_ID)) {
+            stats.statusFrames++;
+        }
+        if (txFile) {
+            fprintf(txFile, "(%llu.%06llu) sim0 %03X#", (unsigned long long)(nowUs() / 1000000),
+                    (unsigned long long)(nowUs() % 1000000), message.identifier);
+            for (uint8_t i = 0; i < message.data_length_code; i++) {
+                fprintf(txFile, "%02X", message.data[i]);
+            }
+            fprintf(txFile, "\n");
+        }
+    }
+
+    /**
+     * Run the firmware up to a virtual time, calling loop() every millisecond
+     */
+    void stepTo(uint64_t us)
+    {
+        while (nowUs() / 1000 < us / 1000) {
+            hal::native::nowUs = (nowUs() / 1000 + 1) * 1000;
+            hal::native::completeFades();
+            hal::native::runTasks();
+            loop();
+        }
+        if (us > nowUs()) {
+            hal::native::nowUs = us;
+        }
+    }
+
+    /**
+     * Hand one frame to the dispatcher and track the output changes it causes
+     */
+    void dispatch(const LoggedFrame &frame)
+    {
+        uint8_t before[8];
+        memcpy(before, outputState::read().levels, sizeof(before));
+
+        if (hal::native::canReceive) {
+            hal::native::canReceive(frame.message);
+        }
+
+        outputState::Snapshot after = outputState::read();
+        uint8_t changed = 0;
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            if (after.levels[ch] != before[ch]) {
+                changed |= 1 << ch;
+            }
+        }
+
+        if (changed) {
+            int index = commands.size();
+            commands.push_back({frame.arrivalUs, changed, false});
+            stats.commands++;
+            for (uint8_t ch = 0; ch < 8; ch++) {
+                if (!(changed & (1 << ch))) {
+                    continue;
+                }
+                int previous = pendingCommand[ch];
+                if (previous >= 0 && !commands[previous].superseded) {
+                    commands[previous].superseded = true;
+                    stats.superseded++;
+                }
+                pendingCommand[ch] = index;
+            }
+        }
+
+        // Let the PWM task pick the change up, as the RX task's notify would
+        hal::native::runTasks();
+    }
+
+    uint32_t percentile(const std::vector<uint32_t> &sorted, uint32_t percent)
+    {
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t rank = (sorted.size() * percent + 99) / 100;
+        return sorted[rank ? rank - 1 : 0];
+    }
+
+    /**
+     * Channels at rest whose duty does not match their published level
+     * Skipped while a sequence is still moving the levels
+     */
+    uint8_t settledMismatches()
+    {
+        if (lightSequences::isPlaying()) {
+            return 0;
+        }
+        outputState::Snapshot levels = outputState::read();
+        uint8_t mismatched = 0;
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            if (!hal::native::pwm[ch].fading && hal::pwmGetDuty(ch) != dimmingCurves::duty(ch, levels.levels[ch] << 8)) {
+                mismatched |= 1 << ch;
+            }
+        }
+        return mismatched;
+    }
+
+    void printReport(FILE *out)
+    {
+        std::vector<uint32_t> sorted = stats.latencyUs;
+        std::sort(sorted.begin(), sorted.end());
+        uint32_t unapplied = stats.commands - stats.applied - stats.superseded;
+
+        fprintf(out, "frames:   %u replayed, %u rejected by acceptance filter, %u dropped at RX queue, "
+                     "%u unhandled ID, %u too short\n",
+                stats.frames, stats.filtered, stats.rxDropped, canDispatch::unhandledFrames,
+                canDispatch::shortFrames);
+        fprintf(out, "commands: %u changed outputs, %u applied, %u superseded, %u never applied\n",
+                stats.commands, stats.applied, stats.superseded, unapplied);
+        fprintf(out, "latency:  min %u us, p50 %u us, p99 %u us, max %u us (arrival to PWM write)\n",
+                sorted.empty() ? 0 : sorted.front(), percentile(sorted, 50), percentile(sorted, 99),
+                sorted.empty() ? 0 : sorted.back());
+        fprintf(out, "tx:       %u frames, %u status (0x%02X)\n", stats.txFrames, stats.statusFrames, CAN_SEND_MESSAGE_ID);
+        fprintf(out, "pwm:      %u writes\n", stats.pwmWrites);
+    }
+
+    /**
+     * Boot the firmware, replay the log and print the report to stdout
+     * @return false if an output file cannot be opened or the outputs did not follow the commands
+     */
+    bool run(FILE *log, const Options &options)
+    {
+        if (options.pwmPath && !(pwmFile = fopen(options.pwmPath, "w"))) {
+            return false;
+        }
+        if (options.txPath && !(txFile = fopen(options.txPath, "w"))) {
+            return false;
+        }
+        if (pwmFile) {
+            fprintf(pwmFile, "time_us,channel,duty,fade_ms\n");
+        }
+        hal::native::onPwmWrite = onPwmWrite;
+        hal::native::onCanSend = onCanSend;
+
+        setup();
+        std::vector<LoggedFrame> frames = load(log, options);
+
+        for (const LoggedFrame &frame : frames) {
+            stepTo(frame.dispatchUs);
+            dispatch(frame);
+        }
+        stepTo(nowUs() + REPLAY_TAIL_MS * 1000ULL);
+
+        printReport(stdout);
+        if (pwmFile) fclose(pwmFile);
+        if (txFile) fclose(txFile);
+
+        uint32_t unapplied = stats.commands - stats.applied - stats.superseded;
+        uint8_t mismatched = settledMismatches();
+        if (mismatched) {
+            printf("result:   MISMATCH, duty of channels 0x%02X does not match their level\n", mismatched);
+        } else if (unapplied) {
+            printf("result:   MISMATCH, %u commands never reached the outputs\n", unapplied);
+        }
+        return !mismatched && !unapplied;
+    }
+}
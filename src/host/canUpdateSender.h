@@ -0,0 +1,321 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include "isoTpLoopback.h"
+
+#define SENDER_REPLY_TIMEOUT_MS 2000  // No reply this long: send Begin again, which resumes
+#define SENDER_OUTAGE_MS 3000         // Bus outage simulated by --interrupt-at
+#define SENDER_TIMEOUT_MS 1800000
+
+/**
+ * Firmware update over CAN on the native build (the head unit side of canUpdate.h)
+ *
+ * Compresses an image sector by sector with zlib (raw deflate, as the ROM
+ * inflater on the ESP32 expects), splitting sectors that do not fit one
+ * message, and sends it to the firmware through the CAN RX path. The bus
+ * carries one frame per LOOPBACK_FRAME_US in both directions, so the reported
+ * time is the time at 500 kbit/s (flash erase and write times not included).
+ *
+ * interruptAt cuts the bus for SENDER_OUTAGE_MS once the module has that many
+ * sectors, and restartModule also drops the module's RAM session as a reset
+ * would, so the transfer has to resume from the progress saved in NVS.
+ * Any file works as an image; its first byte is set to the image magic the
+ * boot switch checks. Call after setup().
+ */
+namespace canUpdateSender
+{
+    struct Options
+    {
+        const char *imagePath = nullptr;
+        uint32_t interruptAt = 0;
+        bool restartModule = false;
+    };
+
+    struct Block
+    {
+        uint32_t offset;                // Image offset of the first byte
+        std::vector<uint8_t> message;   // Complete Data message
+    };
+
+    struct BusFrame
+    {
+        twai_message_t message;
+        bool toModule;
+    };
+
+    enum Phase
+    {
+        SEND_BEGIN,
+        WAIT_BEGIN,
+        SENDING,
+        SEND_FINISH,
+        WAIT_FINISH,
+        DONE,
+    };
+
+    std::vector<uint8_t> image;
+    std::vector<Block> blocks;
+    uint32_t compressedBytes = 0;
+
+    isoTp::Link headUnit;
+    std::deque<BusFrame> bus;
+    uint32_t busFrames = 0;
+    uint32_t droppedFrames = 0;
+    uint32_t outageEndMs = 0;
+    bool interrupted = false;
+
+    Phase phase = SEND_BEGIN;
+    size_t next = 0;             // Block to send next
+    uint8_t window = 1;
+    uint8_t inFlight = 0;        // Data messages without a reply
+    uint8_t stale = 0;           // Replies still due for messages sent before a go-back
+    uint32_t lastReplyMs = 0;
+    uint32_t dataMessages = 0;
+    uint32_t goBacks = 0;
+    uint32_t resumedAt = 0;
+    uint8_t finishStatus = 0xFF;
+
+    std::vector<uint8_t> deflateRaw(const uint8_t *data, size_t length)
+    {
+        z_stream stream = {};
+        deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY);
+        std::vector<uint8_t> out(deflateBound(&stream, length));
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = length;
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return out;
+    }
+
+    void addBlock(uint32_t offset, uint32_t length)
+    {
+        std::vector<uint8_t> packed = deflateRaw(image.data() + offset, length);
+        if (packed.size() > ISOTP_MAX_PAYLOAD - 4) {
+            // Does not compress into one message: send the sector in two halves
+            uint32_t half = length / 2 / CAN_UPDATE_FRAGMENT_SIZE * CAN_UPDATE_FRAGMENT_SIZE;
+            addBlock(offset, half);
+            addBlock(offset + half, length - half);
+            return;
+        }
+        uint16_t sector = offset / CAN_UPDATE_SECTOR_SIZE;
+        Block block = {offset, {canUpdate::UPDATE_DATA, (uint8_t)(sector & 0xFF), (uint8_t)(sector >> 8),
+                                (uint8_t)(offset % CAN_UPDATE_SECTOR_SIZE / CAN_UPDATE_FRAGMENT_SIZE)}};
+        block.message.insert(block.message.end(), packed.begin(), packed.end());
+        compressedBytes += packed.size();
+        blocks.push_back(block);
+    }
+
+    /**
+     * Index of the block that starts at a reply's position (blocks.size() at the end)
+     */
+    size_t blockAt(const uint8_t *reply)
+    {
+        uint32_t offset = (reply[2] | (reply[3] << 8)) * CAN_UPDATE_SECTOR_SIZE + reply[4] * CAN_UPDATE_FRAGMENT_SIZE;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (blocks[i].offset >= offset) {
+                return i;
+            }
+        }
+        return blocks.size();
+    }
+
+    bool toBus(const twai_message_t &message, bool)
+    {
+        bus.push_back({message, true});
+        return true;
+    }
+
+    void onReply(const uint8_t *data, uint16_t length)
+    {
+        if (length < 6) {
+            return;
+        }
+        lastReplyMs = hal::millis();
+        switch (data[0]) {
+            case canUpdate::UPDATE_BEGIN:
+                if (phase != WAIT_BEGIN) {
+                    break;
+                }
+                if (data[1] != canUpdate::UPDATE_OK) {
+                    printf("begin:        refused, status 0x%02X\n", data[1]);
+                    finishStatus = data[1];
+                    phase = DONE;
+                    break;
+                }
+                next = blockAt(data);
+                if (next > 0) {
+                    resumedAt = blocks[next].offset;
+                    printf("resume:       module continues at byte %u (block %zu of %zu)\n", resumedAt, next,
+                           blocks.size());
+                }
+                window = data[5];
+                inFlight = 0;
+                stale = 0;
+                phase = SENDING;
+                break;
+
+            case canUpdate::UPDATE_DATA:
+                if (phase != SENDING) {
+                    break;
+                }
+                inFlight -= inFlight > 0;
+                if (stale > 0) {
+                    stale--;
+                    if (data[1] != canUpdate::UPDATE_OK) {
+                        break;
+                    }
+                }
+                if (data[1] != canUpdate::UPDATE_OK) {
+                    // Go back to where the module is
+                    next = blockAt(data);
+                    stale = inFlight;
+                    goBacks++;
+                } else if (next == blocks.size() && inFlight == 0) {
+                    phase = SEND_FINISH;
+                }
+                break;
+
+            case canUpdate::UPDATE_FINISH:
+                finishStatus = data[1];
+                phase = DONE;
+                break;
+        }
+    }
+
+    /**
+     * Start the next message if the link and the window allow it
+     */
+    void pump()
+    {
+        if (isoTp::isSending(headUnit)) {
+            return;
+        }
+        if (phase == SEND_BEGIN) {
+            uint8_t begin[37] = {canUpdate::UPDATE_BEGIN};
+            uint32_t size = image.size();
+            for (int i = 0; i < 4; i++) {
+                begin[1 + i] = size >> (i * 8);
+            }
+            sha256::compute(image.data(), size, begin + 5);
+            isoTp::send(headUnit, begin, sizeof(begin));
+            lastReplyMs = hal::millis();
+            phase = WAIT_BEGIN;
+        } else if (phase == SENDING && next < blocks.size() && inFlight < window) {
+            const std::vector<uint8_t> &message = blocks[next].message;
+            if (isoTp::send(headUnit, message.data(), message.size())) {
+                next++;
+                inFlight++;
+                dataMessages++;
+            }
+        } else if (phase == SEND_FINISH) {
+            const uint8_t finish[1] = {canUpdate::UPDATE_FINISH};
+            isoTp::send(headUnit, finish, sizeof(finish));
+            lastReplyMs = hal::millis();
+            phase = WAIT_FINISH;
+        }
+    }
+
+    void interruptIfDue(const Options &options)
+    {
+        if (interrupted || !options.interruptAt || canUpdate::position < options.interruptAt * CAN_UPDATE_SECTOR_SIZE) {
+            return;
+        }
+        interrupted = true;
+        outageEndMs = hal::millis() + SENDER_OUTAGE_MS;
+        printf("interrupt:    bus cut at byte %u for %u ms%s\n", canUpdate::position, SENDER_OUTAGE_MS,
+               options.restartModule ? ", module session reset" : "");
+        if (options.restartModule) {
+            canUpdate::active = false;  // RAM is lost on a reset; flash and NVS are not
+        }
+    }
+
+    bool run(const Options &options)
+    {
+        FILE *file = fopen(options.imagePath, "rb");
+        if (!file) {
+            fprintf(stderr, "Cannot open %s\n", options.imagePath);
+            return false;
+        }
+        uint8_t chunk[4096];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            image.insert(image.end(), chunk, chunk + read);
+        }
+        fclose(file);
+        if (image.empty() || image.size() > HAL_APP_SLOT_SIZE) {
+            fprintf(stderr, "Image must be 1 to %u bytes\n", HAL_APP_SLOT_SIZE);
+            return false;
+        }
+        image[0] = HAL_IMAGE_MAGIC;
+        for (uint32_t offset = 0; offset < image.size(); offset += CAN_UPDATE_SECTOR_SIZE) {
+            addBlock(offset, std::min<uint32_t>(CAN_UPDATE_SECTOR_SIZE, image.size() - offset));
+        }
+
+        headUnit.txId = nodeAddress::id(CAN_UPDATE_ID);
+        headUnit.transmit = toBus;
+        headUnit.onReceive = onReply;
+        hal::native::onCanSend = [](const twai_message_t &message) {
+            bus.push_back({message, false});
+        };
+
+        uint64_t startUs = hal::native::nowUs;
+        uint32_t endMs = hal::millis() + SENDER_TIMEOUT_MS;
+        while (phase != DONE && hal::millis() < endMs) {
+            pump();
+            isoTp::loop(headUnit);
+            if ((phase == WAIT_BEGIN || phase == SENDING || phase == WAIT_FINISH) &&
+                hal::millis() - lastReplyMs > SENDER_REPLY_TIMEOUT_MS) {
+                phase = SEND_BEGIN;  // Lost the module: ask where to continue
+            }
+
+            uint32_t stepUs = 100;
+            if (!bus.empty()) {
+                BusFrame frame = bus.front();
+                bus.pop_front();
+                stepUs = LOOPBACK_FRAME_US;
+                busFrames++;
+                if (hal::millis() < outageEndMs) {
+                    droppedFrames++;
+                } else if (frame.toModule) {
+                    hal::native::injectFrame(frame.message);
+                } else if (frame.message.identifier == nodeAddress::id(CAN_UPDATE_RESPONSE_ID)) {
+                    isoTp::receive(headUnit, frame.message);
+                }
+            }
+            // Once per virtual millisecond, as advanceTo() would
+            uint32_t beforeMs = hal::millis();
+            hal::native::nowUs += stepUs;
+            if (hal::millis() != beforeMs) {
+                hal::native::completeFades();
+                hal::native::runTasks();
+                loop();
+            }
+            interruptIfDue(options);
+        }
+        double seconds = (hal::native::nowUs - startUs) / 1e6;
+
+        // Let the module restart into the new image
+        hal::native::advanceTo(hal::millis() + CAN_UPDATE_RESTART_MS + 10);
+        loop();
+
+        hal::FlashRegion &slot = hal::native::appSlots[1 - hal::native::runningSlot];
+        bool written = memcmp(slot.data.data(), image.data(), image.size()) == 0;
+        bool switched = hal::native::bootSlot != hal::native::runningSlot && hal::native::restartRequested;
+
+        printf("image:        %zu bytes, %zu sectors\n", image.size(),
+               (image.size() + CAN_UPDATE_SECTOR_SIZE - 1) / CAN_UPDATE_SECTOR_SIZE);
+        printf("compressed:   %u bytes (%.1f%%) in %zu messages\n", compressedBytes,
+               100.0 * compressedBytes / image.size(), blocks.size());
+        printf("sent:         %u data messages, %u go-backs, %u frames on the bus (%u dropped)\n", dataMessages,
+               goBacks, busFrames, droppedFrames);
+        printf("time:         %.1f s at 500 kbit/s (%.1f kB/s of image)\n", seconds,
+               seconds > 0 ? image.size() / seconds / 1000 : 0.0);
+        printf("result:       finish status 0x%02X, slot %s, boot %s\n", finishStatus,
+               written ? "matches the image" : "DIFFERS", switched ? "switched and restarting" : "NOT switched");
+        return finishStatus == canUpdate::UPDATE_OK && written && switched &&
+               (!options.interruptAt || resumedAt > 0);
+    }
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <deque>
+#include <vector>
+
+#define LOOPBACK_FRAME_US 230        // One 8-byte standard frame at 500 kbit/s, with typical bit stuffing
+#define LOOPBACK_SENDER_ID 0x700
+#define LOOPBACK_RECEIVER_ID 0x708
+#define LOOPBACK_TIMEOUT_MS 30000
+
+/**
+ * ISO-TP loopback on the native build
+ *
+ * Two parts, both on the virtual clock:
+ *
+ * Transfer: two isoTp::Link instances joined by a fake bus that delivers
+ * one frame per LOOPBACK_FRAME_US. The sender sends a message of the given
+ * size with a byte pattern; the receiver grants the given block size and
+ * STmin. The received bytes are compared and the frame counts and transfer
+ * time reported. dropFrame loses the Nth frame on the bus (counting from 1)
+ * to show that the receiver aborts instead of delivering a corrupt message.
+ *
+ * Provisioning: a host link plays the head unit and sends WiFi credentials
+ * to the firmware through the CAN RX path (acceptance filter, dispatcher),
+ * reading flow control and the reply from the frames the module sends.
+ * Call after setup().
+ */
+namespace isoTpLoopback
+{
+    struct Options
+    {
+        uint32_t size = 4096;
+        uint8_t blockSize = ISOTP_BLOCK_SIZE;
+        uint8_t stMin = ISOTP_ST_MIN;
+        uint32_t dropFrame = 0;
+    };
+
+    struct BusFrame
+    {
+        twai_message_t message;
+        bool toReceiver;
+    };
+
+    std::deque<BusFrame> bus;
+    uint32_t busFrames = 0;
+    uint32_t flowControlFrames = 0;
+    std::vector<uint8_t> delivered;
+    uint32_t deliveries = 0;
+
+    isoTp::Link sender;
+    isoTp::Link receiver;
+
+    bool toReceiver(const twai_message_t &message, bool)
+    {
+        bus.push_back({message, true});
+        return true;
+    }
+
+    bool toSender(const twai_message_t &message, bool flowControl)
+    {
+        flowControlFrames += flowControl;
+        bus.push_back({message, false});
+        return true;
+    }
+
+    void onDelivered(const uint8_t *data, uint16_t length)
+    {
+        delivered.assign(data, data + length);
+        deliveries++;
+    }
+
+    /**
+     * Move frames across the fake bus until both links are idle
+     * @return false if the transfer did not settle in LOOPBACK_TIMEOUT_MS
+     */
+    bool runBus(const Options &options)
+    {
+        uint32_t endMs = hal::millis() + LOOPBACK_TIMEOUT_MS;
+        while (hal::millis() < endMs) {
+            isoTp::loop(sender);
+            isoTp::loop(receiver);
+            if (bus.empty()) {
+                if (!isoTp::isSending(sender) && !receiver.rx.active) {
+                    return true;
+                }
+                hal::native::nowUs += 100;
+                continue;
+            }
+            BusFrame frame = bus.front();
+            bus.pop_front();
+            hal::native::nowUs += LOOPBACK_FRAME_US;
+            if (++busFrames == options.dropFrame) {
+                continue;
+            }
+            isoTp::receive(frame.toReceiver ? receiver : sender, frame.message);
+        }
+        return false;
+    }
+
+    bool transfer(const Options &options)
+    {
+        sender.txId = LOOPBACK_SENDER_ID;
+        sender.transmit = toReceiver;
+        receiver.txId = LOOPBACK_RECEIVER_ID;
+        receiver.transmit = toSender;
+        receiver.onReceive = onDelivered;
+        receiver.blockSize = options.blockSize;
+        receiver.stMin = options.stMin;
+
+        std::vector<uint8_t> payload(options.size);
+        for (uint32_t i = 0; i < options.size; i++) {
+            payload[i] = (uint8_t)(i * 7 + (i >> 8));
+        }
+
+        uint64_t startUs = hal::native::nowUs;
+        if (!isoTp::send(sender, payload.data(), options.size)) {
+            printf("transfer:     send() refused %u bytes (maximum %u)\n", options.size, ISOTP_MAX_PAYLOAD);
+            return false;
+        }
+        bool settled = runBus(options);
+        double ms = (hal::native::nowUs - startUs) / 1000.0;
+        bool intact = deliveries == 1 && delivered == payload;
+
+        printf("transfer:     %u bytes, block size %u, STmin 0x%02X%s\n", options.size, options.blockSize,
+               options.stMin, options.dropFrame ? ", one frame dropped" : "");
+        printf("frames:       %u on the bus, %u flow control\n", busFrames, flowControlFrames);
+        printf("time:         %.1f ms (%.1f kB/s)\n", ms, ms > 0 ? options.size / ms : 0.0);
+        printf("sender:       %u sent, %u aborted\n", sender.stats.sent, sender.stats.txAborted);
+        printf("receiver:     %u delivered, %u aborted, %u overflows\n", receiver.stats.received,
+               receiver.stats.rxAborted, receiver.stats.rxOverflows);
+        printf("result:       %s\n", !settled ? "TIMEOUT" : intact ? "payload intact" : deliveries ? "CORRUPT" : "not delivered");
+
+        // A dropped frame must never produce a delivery
+        return settled && (options.dropFrame ? deliveries == 0 : intact);
+    }
+
+    // -------------------------------------------------------------- provisioning
+
+    isoTp::Link headUnit;
+    std::deque<twai_message_t> toModule;
+    uint8_t reply[2] = {0xFF, 0xFF};
+
+    bool toFirmware(const twai_message_t &message, bool)
+    {
+        toModule.push_back(message);
+        return true;
+    }
+
+    void onReply(const uint8_t *data, uint16_t length)
+    {
+        if (length >= 2) {
+            memcpy(reply, data, 2);
+        }
+    }
+
+    bool provision(const char *ssid, const char *password)
+    {
+        headUnit.txId = nodeAddress::id(WIFI_CONFIG_ID);
+        headUnit.transmit = toFirmware;
+        headUnit.onReceive = onReply;
+        hal::native::onCanSend = [](const twai_message_t &message) {
+            if (message.identifier == nodeAddress::id(WIFI_CONFIG_RESPONSE_ID)) {
+                isoTp::receive(headUnit, message);
+            }
+        };
+
+        uint8_t message[2 + 32 + 63];
+        uint8_t ssidLength = strlen(ssid);
+        uint8_t passwordLength = strlen(password);
+        message[0] = wifiConfig::PROVISION_SET_CREDENTIALS;
+        message[1] = ssidLength;
+        memcpy(message + 2, ssid, ssidLength);
+        memcpy(message + 2 + ssidLength, password, passwordLength);
+        isoTp::send(headUnit, message, 2 + ssidLength + passwordLength);
+
+        uint32_t endMs = hal::millis() + LOOPBACK_TIMEOUT_MS;
+        while (reply[0] == 0xFF && hal::millis() < endMs) {
+            isoTp::loop(headUnit);
+            while (!toModule.empty()) {
+                twai_message_t frame = toModule.front();
+                toModule.pop_front();
+                hal::native::injectFrame(frame);
+            }
+            hal::native::advanceTo(hal::millis() + 1);
+            loop();
+        }
+
+        bool stored = reply[1] == wifiConfig::PROVISION_SAVED && strcmp(runtimeSsid, ssid) == 0 &&
+                      strcmp(runtimePassword, password) == 0;
+        printf("provisioning: %u-byte message, reply status 0x%02X, credentials %s\n",
+               2 + ssidLength + passwordLength, reply[1], stored ? "stored" : "NOT stored");
+        return stored;
+    }
+
+    bool run(const Options &options)
+    {
+        bool ok = transfer(options);
+        printf("\n");
+        return provision("TrailerAP", "secret-password-for-the-trailer") && ok;
+    }
+}
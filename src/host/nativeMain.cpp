@@ -0,0 +1,308 @@
+// Entry point for the [env:native] build
+//
+//   program                 Run setup() and loop() on the fake HAL, feed a few frames
+//                           through the CAN receive path, print what comes back and
+//                           check the resulting duties
+//   program LOG [options]   Replay a candump log (see canReplay.h)
+//       --pwm FILE          Write the PWM timeline as CSV
+//       --tx FILE           Write outgoing frames in candump -l format
+//       --rx-queue N        RX queue length (default REPLAY_RX_QUEUE_LEN)
+//       --rx-cost-us N      RX task time per frame (default REPLAY_RX_COST_US)
+//       --start-ms N        Virtual time of the first frame (default REPLAY_START_MS)
+//       --node N            DIP switch address 0-7 (default 0); the log must use that node's IDs
+//   program --current LEVELS [options]
+//                           Model the supply current for 8 levels (comma separated,
+//                           one value for all), with and without phase offsets
+//                           (see supplyCurrent.h)
+//       --amps A            Load current per channel, one value or 8 (default 2.0)
+//       --waveform FILE     Write one period of both current waveforms as CSV
+//   program --isotp SIZE [options]
+//                           Send SIZE bytes between two ISO-TP links on a fake bus, then
+//                           provision WiFi credentials to the firmware over ISO-TP
+//                           (see isoTpLoopback.h)
+//       --bs N              Block size the receiver grants (default ISOTP_BLOCK_SIZE)
+//       --stmin N           STmin byte the receiver asks for (default ISOTP_ST_MIN)
+//       --drop N            Lose the Nth frame on the bus
+//   program --can-update IMAGE [options]
+//                           Compress IMAGE and send it to the firmware's inactive app slot
+//                           over CAN, then check the slot, the hash and the boot switch
+//                           (see canUpdateSender.h)
+//       --interrupt-at N    Cut the bus for a while once N sectors are written
+//       --restart           With --interrupt-at, also lose the module's RAM session
+//   program --wifi-update IMAGE [options]
+//                           gzip IMAGE and upload it to the firmware's resumable WiFi
+//                           endpoint at a modelled link rate (see otaStreamSender.h)
+//       --rate KBPS         Link rate in kB/s (default 20)
+//       --drop-every N      Lose the connection after N bytes of each connection
+//       --raw               Upload the image uncompressed
+//
+// The firmware is header-only, so the whole program is this one translation unit.
+#include "../main.cpp"
+#include "canReplay.h"
+#include "supplyCurrent.h"
+#include "isoTpLoopback.h"
+#include "canUpdateSender.h"
+#include "otaStreamSender.h"
+
+static twai_message_t frame(uint32_t id, uint8_t length, const uint8_t *data)
+{
+    twai_message_t message = {};
+    message.identifier = id;
+    message.data_length_code = length;
+    memcpy(message.data, data, length);
+    return message;
+}
+
+static void runFor(uint32_t ms)
+{
+    uint32_t end = hal::millis() + ms;
+    while (hal::millis() < end) {
+        hal::native::advanceTo(hal::millis() + 1);
+        loop();
+    }
+}
+
+static void printDuties()
+{
+    printf("[native] t=%ums duty:", hal::millis());
+    for (uint8_t ch = 0; ch < 8; ch++) {
+        printf(" %u", hal::pwmGetDuty(ch));
+    }
+    printf("\n");
+}
+
+/**
+ * Check that the channels in mask output the duty for level
+ */
+static bool expectLevel(uint8_t mask, uint8_t level, const char *step)
+{
+    bool ok = true;
+    for (uint8_t ch = 0; ch < 8; ch++) {
+        if ((mask & (1 << ch)) && hal::pwmGetDuty(ch) != dimmingCurves::duty(ch, level << 8)) {
+            printf("[native] MISMATCH after %s: channel %u duty %u, expected %u\n", step, ch, hal::pwmGetDuty(ch),
+                   dimmingCurves::duty(ch, level << 8));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/**
+ * Set the fake DIP switch inputs for a node address
+ */
+static void setNodeSwitches(uint8_t address)
+{
+    for (uint8_t bit = 0; bit < 3; bit++) {
+        hal::native::inputLevels[DEVICE_SELECTION_PINS[bit]] = (address >> bit) & 1;
+    }
+}
+
+static int replay(int argc, char **argv)
+{
+    canReplay::Options options;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--pwm") == 0) {
+            options.pwmPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--tx") == 0) {
+            options.txPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--rx-queue") == 0) {
+            options.rxQueueLength = strtoul(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--rx-cost-us") == 0) {
+            options.rxCostUs = strtoul(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--start-ms") == 0) {
+            options.startMs = strtoul(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--node") == 0) {
+            setNodeSwitches(strtoul(argv[i + 1], nullptr, 10) % CAN_NODE_COUNT);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    FILE *log = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+    if (!log) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    bool ok = canReplay::run(log, options);
+    if (log != stdin) fclose(log);
+    return ok ? 0 : 1;
+}
+
+/**
+ * Parse "a,b,..." into count values; a single value fills all of them
+ */
+template <typename T>
+static bool parseList(const char *text, T *values, uint8_t count)
+{
+    uint8_t parsed = 0;
+    char *end;
+    for (const char *p = text; parsed < count; p = end + 1) {
+        values[parsed++] = (T)strtod(p, &end);
+        if (end == p) return false;
+        if (*end != ',') break;
+    }
+    if (parsed == 1) {
+        for (uint8_t i = 1; i < count; i++) values[i] = values[0];
+    }
+    return parsed == 1 || parsed == count;
+}
+
+static int current(int argc, char **argv)
+{
+    supplyCurrent::Options options;
+    if (argc < 3 || !parseList(argv[2], options.levels, 8)) {
+        fprintf(stderr, "--current needs 1 or 8 levels\n");
+        return 2;
+    }
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--amps") == 0) {
+            if (!parseList(argv[i + 1], options.amps, 8)) {
+                fprintf(stderr, "--amps needs 1 or 8 values\n");
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--waveform") == 0) {
+            options.waveformPath = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    setup();
+    return supplyCurrent::run(options) ? 0 : 1;
+}
+
+static int loopback(int argc, char **argv)
+{
+    isoTpLoopback::Options options;
+    if (argc < 3) {
+        fprintf(stderr, "--isotp needs a message size\n");
+        return 2;
+    }
+    options.size = strtoul(argv[2], nullptr, 0);
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--bs") == 0) {
+            options.blockSize = strtoul(argv[i + 1], nullptr, 0);
+        } else if (strcmp(argv[i], "--stmin") == 0) {
+            options.stMin = strtoul(argv[i + 1], nullptr, 0);
+        } else if (strcmp(argv[i], "--drop") == 0) {
+            options.dropFrame = strtoul(argv[i + 1], nullptr, 0);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    setup();
+    return isoTpLoopback::run(options) ? 0 : 1;
+}
+
+static int canUpdateTest(int argc, char **argv)
+{
+    canUpdateSender::Options options;
+    if (argc < 3) {
+        fprintf(stderr, "--can-update needs an image file\n");
+        return 2;
+    }
+    options.imagePath = argv[2];
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--interrupt-at") == 0 && i + 1 < argc) {
+            options.interruptAt = strtoul(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--restart") == 0) {
+            options.restartModule = true;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    setup();
+    return canUpdateSender::run(options) ? 0 : 1;
+}
+
+static int wifiUpdateTest(int argc, char **argv)
+{
+    otaStreamSender::Options options;
+    if (argc < 3) {
+        fprintf(stderr, "--wifi-update needs an image file\n");
+        return 2;
+    }
+    options.imagePath = argv[2];
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            options.rateKBps = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--drop-every") == 0 && i + 1 < argc) {
+            options.dropEvery = strtoul(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--raw") == 0) {
+            options.raw = true;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (options.rateKBps <= 0) {
+        fprintf(stderr, "--rate must be positive\n");
+        return 2;
+    }
+
+    setup();
+    return otaStreamSender::run(options) ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--current") == 0) {
+        return current(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--isotp") == 0) {
+        return loopback(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--can-update") == 0) {
+        return canUpdateTest(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--wifi-update") == 0) {
+        return wifiUpdateTest(argc, argv);
+    }
+    if (argc > 1) {
+        return replay(argc, argv);
+    }
+
+    hal::native::onCanSend = [](const twai_message_t &message) {
+        printf("[native] t=%ums TX 0x%03X:", hal::millis(), message.identifier);
+        for (uint8_t i = 0; i < message.data_length_code; i++) {
+            printf(" %02X", message.data[i]);
+        }
+        printf("\n");
+    };
+
+    setup();
+    runFor(100);
+    bool ok = true;
+
+    const uint8_t allOn[] = {8, 1};
+    hal::native::injectFrame(frame(24, 2, allOn));
+    runFor(50);
+    printDuties();
+    ok &= expectLevel(0xFF, 255, "all on");
+
+    const uint8_t dimChannel3[] = {2, 64, 0xF4, 0x01};  // 500 ms fade
+    hal::native::injectFrame(frame(21, 4, dimChannel3));
+    runFor(250);
+    printDuties();
+    runFor(300);
+    printDuties();
+    ok &= expectLevel(0x04, 64, "the channel 3 fade");
+    ok &= expectLevel(0xFB, 255, "the channel 3 fade");
+
+    const uint8_t interior[] = {0};
+    hal::native::injectFrame(frame(30, 1, interior));
+    runFor(2000);
+    printDuties();
+    if (!lightSequences::isPlaying()) {
+        printf("[native] MISMATCH: interior sequence not playing after 2 s\n");
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <vector>
+
+#define STREAM_CHUNK 1436            // Bytes per WebServer upload callback (one TCP segment)
+#define STREAM_RECONNECT_MS 2000     // Client pause before it asks for the offset again
+#define STREAM_TIMEOUT_MS 1800000
+
+/**
+ * Resumable WiFi image upload on the native build (the client side of otaStream.h)
+ *
+ * gzips an image (or sends it raw) and feeds it to the firmware's upload
+ * handlers the way the WebServer would, at a given link rate on the virtual
+ * clock. dropEvery loses the connection after that many bytes of each
+ * connection; the client then waits, asks for the resume offset and sends
+ * the rest from there. The same link is also worked out for the raw image
+ * over ArduinoOTA, which starts over after every drop. Flash time is not
+ * modelled. Any file works as an image; its first byte is set to the image
+ * magic the boot switch checks. Call after setup().
+ */
+namespace otaStreamSender
+{
+    struct Options
+    {
+        const char *imagePath = nullptr;
+        double rateKBps = 20.0;
+        uint32_t dropEvery = 0;
+        bool raw = false;
+    };
+
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> upload;
+    uint32_t connections = 0;
+    uint32_t sentBytes = 0;
+    double pendingUs = 0;
+
+    std::vector<uint8_t> gzip(const std::vector<uint8_t> &data)
+    {
+        z_stream stream = {};
+        deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9, Z_DEFAULT_STRATEGY);
+        std::vector<uint8_t> out(deflateBound(&stream, data.size()) + 32);
+        stream.next_in = (Bytef *)data.data();
+        stream.avail_in = data.size();
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return out;
+    }
+
+    /**
+     * Let virtual time pass, running the firmware once per millisecond
+     */
+    void wait(double us)
+    {
+        pendingUs += us;
+        while (pendingUs >= 1.0) {
+            uint32_t step = pendingUs < 1000 ? (uint32_t)pendingUs : 1000;
+            uint32_t beforeMs = hal::millis();
+            hal::native::nowUs += step;
+            pendingUs -= step;
+            if (hal::millis() != beforeMs) {
+                hal::native::completeFades();
+                hal::native::runTasks();
+                loop();
+            }
+        }
+    }
+
+    /**
+     * One POST from offset; false if the connection dropped or the upload was refused
+     */
+    bool post(const Options &options, uint32_t offset, bool &installed)
+    {
+        const hal::UploadHandlers &server = hal::native::uploadHandlers;
+        connections++;
+        if (!server.start(offset)) {
+            printf("upload:       POST from byte %u refused\n", offset);
+            return false;
+        }
+        uint32_t usPerByte = 1000.0 / options.rateKBps;
+        uint32_t sentHere = 0;
+        for (uint32_t at = offset; at < upload.size();) {
+            uint32_t chunk = std::min<uint32_t>(STREAM_CHUNK, upload.size() - at);
+            if (options.dropEvery && sentHere + chunk > options.dropEvery) {
+                wait((double)(options.dropEvery - sentHere) * usPerByte);
+                sentBytes += options.dropEvery - sentHere;
+                server.end(false);
+                return false;
+            }
+            wait((double)chunk * usPerByte);
+            sentBytes += chunk;
+            sentHere += chunk;
+            if (!server.data(upload.data() + at, chunk)) {
+                server.end(false);
+                return false;
+            }
+            at += chunk;
+        }
+        installed = server.end(true);
+        return true;
+    }
+
+    bool run(const Options &options)
+    {
+        FILE *file = fopen(options.imagePath, "rb");
+        if (!file) {
+            fprintf(stderr, "Cannot open %s\n", options.imagePath);
+            return false;
+        }
+        uint8_t chunk[4096];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            image.insert(image.end(), chunk, chunk + read);
+        }
+        fclose(file);
+        if (image.empty() || image.size() > HAL_APP_SLOT_SIZE) {
+            fprintf(stderr, "Image must be 1 to %u bytes\n", HAL_APP_SLOT_SIZE);
+            return false;
+        }
+        image[0] = HAL_IMAGE_MAGIC;
+        upload = options.raw ? image : gzip(image);
+
+        twai_message_t report = {};
+        hal::native::onCanSend = [&report](const twai_message_t &message) {
+            if (message.identifier == nodeAddress::id(OTA_RESULT_ID)) {
+                report = message;
+            }
+        };
+
+        // An OTA window as request() opens it, without the (instant) fake ArduinoOTA wait
+        otaService::windowStart = hal::millis();
+        otaService::setState(otaService::OTA_WINDOW_OPEN);
+        wait(10000);
+
+        bool installed = false;
+        bool refused = false;
+        uint32_t endMs = hal::millis() + STREAM_TIMEOUT_MS;
+        while (!installed && !refused && hal::millis() < endMs) {
+            uint32_t offset = hal::native::uploadHandlers.resumeOffset();
+            if (post(options, offset, installed)) {
+                refused = !installed;
+            } else if (otaStream::at.phase == otaStream::STREAM_FAILED && otaStream::verified.phase == otaStream::STREAM_IDLE) {
+                refused = true;
+            } else {
+                wait(STREAM_RECONNECT_MS * 1000.0);
+            }
+        }
+        double seconds = (hal::millis() - otaService::windowStart) / 1000.0;
+
+        // Restart into the new image, then report the result as the new firmware would
+        wait((OTA_STREAM_RESTART_MS + 10) * 1000.0);
+        otaService::sendLastResult();
+        wait(10000);
+
+        hal::FlashRegion &slot = hal::native::appSlots[1 - hal::native::runningSlot];
+        bool written = memcmp(slot.data.data(), image.data(), image.size()) == 0;
+        bool switched = hal::native::bootSlot != hal::native::runningSlot && hal::native::restartRequested;
+        double rawSeconds = image.size() / (options.rateKBps * 1000);
+
+        printf("image:        %zu bytes, upload %zu bytes (%s, %.1f%%)\n", image.size(), upload.size(),
+               options.raw ? "raw" : "gzip", 100.0 * upload.size() / image.size());
+        printf("link:         %.1f kB/s", options.rateKBps);
+        if (options.dropEvery) {
+            printf(", connection lost every %u bytes", options.dropEvery);
+        }
+        printf("\n");
+        printf("stream:       %u connections, %u resumes, %u bytes transferred, %.1f s to update\n", connections,
+               otaStream::resumes, sentBytes, seconds);
+        if (options.dropEvery && options.dropEvery < image.size()) {
+            printf("raw OTA:      never completes, each drop starts the %zu-byte image over\n", image.size());
+        } else {
+            printf("raw OTA:      %zu bytes transferred, %.1f s (window %u s)\n", image.size(), rawSeconds,
+                   OTA_TIMEOUT_MS / 1000);
+        }
+        printf("report:       0x%03X", report.identifier);
+        for (uint8_t i = 0; i < report.data_length_code; i++) {
+            printf(" %02X", report.data[i]);
+        }
+        printf("\n");
+        printf("result:       %s, slot %s, boot %s\n", installed ? "installed" : "NOT installed",
+               written ? "matches the image" : "DIFFERS", switched ? "switched and restarting" : "NOT switched");
+        return installed && written && switched;
+    }
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <math.h>
+#include <vector>
+
+#define SUPPLY_DEFAULT_AMPS 2.0  // Load current per channel while its MOSFET conducts
+
+/**
+ * Supply current model for the PWM phase offsets
+ *
+ * Sets the given brightness levels through outputState, lets the PWM task
+ * write them, and reads back each channel's duty and hpoint from the native
+ * LEDC fake, so the curves and phase offsets are the firmware's own. It then
+ * sums the load currents over one PWM period, counter tick by counter tick,
+ * once with every on-time starting at 0 (no stagger) and once with the
+ * configured hpoints, and reports peak, mean and RMS supply current.
+ *
+ * Loads are modelled as resistive: a channel draws its full current while on
+ * and nothing while off. Call after setup().
+ */
+namespace supplyCurrent
+{
+    struct Options
+    {
+        uint8_t levels[8] = {0};
+        double amps[8] = {SUPPLY_DEFAULT_AMPS, SUPPLY_DEFAULT_AMPS, SUPPLY_DEFAULT_AMPS, SUPPLY_DEFAULT_AMPS,
+                          SUPPLY_DEFAULT_AMPS, SUPPLY_DEFAULT_AMPS, SUPPLY_DEFAULT_AMPS, SUPPLY_DEFAULT_AMPS};
+        const char *waveformPath = nullptr;
+    };
+
+    struct Summary
+    {
+        double peak;
+        double mean;
+        double rms;
+    };
+
+    /**
+     * Current drawn at each counter tick of one period
+     */
+    std::vector<double> waveform(const uint32_t *duties, const uint32_t *hpoints, const double *amps, uint32_t ticks)
+    {
+        std::vector<double> current(ticks, 0.0);
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            for (uint32_t i = 0; i < duties[ch] && i < ticks; i++) {
+                current[(hpoints[ch] + i) % ticks] += amps[ch];
+            }
+        }
+        return current;
+    }
+
+    Summary summarize(const std::vector<double> &current)
+    {
+        Summary summary = {0, 0, 0};
+        for (double amps : current) {
+            summary.peak = amps > summary.peak ? amps : summary.peak;
+            summary.mean += amps;
+            summary.rms += amps * amps;
+        }
+        summary.mean /= current.size();
+        summary.rms = sqrt(summary.rms / current.size());
+        return summary;
+    }
+
+    /**
+     * Apply the levels, model both waveforms and print the comparison to stdout
+     * @return false if the waveform file cannot be opened
+     */
+    bool run(const Options &options)
+    {
+        lightSequences::releaseChannels(0xFF);
+        outputState::set(0xFF, options.levels, nullptr);
+        hal::native::runTasks();
+
+        uint32_t ticks = 1u << hal::native::pwmResolutionBits;
+        uint32_t duties[8];
+        uint32_t staggered[8];
+        uint32_t aligned[8] = {0};
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            duties[ch] = hal::pwmGetDuty(ch);
+            staggered[ch] = hal::native::pwm[ch].hpoint;
+        }
+
+        std::vector<double> alignedCurrent = waveform(duties, aligned, options.amps, ticks);
+        std::vector<double> staggeredCurrent = waveform(duties, staggered, options.amps, ticks);
+        Summary before = summarize(alignedCurrent);
+        Summary after = summarize(staggeredCurrent);
+
+        printf("channel:   ");
+        for (uint8_t ch = 0; ch < 8; ch++) printf(" %7u", ch);
+        printf("\nlevel:     ");
+        for (uint8_t ch = 0; ch < 8; ch++) printf(" %7u", options.levels[ch]);
+        printf("\nduty:      ");
+        for (uint8_t ch = 0; ch < 8; ch++) printf(" %7u", duties[ch]);
+        printf("\nhpoint:    ");
+        for (uint8_t ch = 0; ch < 8; ch++) printf(" %7u", staggered[ch]);
+        printf("\nload A:    ");
+        for (uint8_t ch = 0; ch < 8; ch++) printf(" %7.2f", options.amps[ch]);
+        printf("\n\n");
+        printf("aligned:    peak %6.2f A, mean %6.2f A, rms %6.2f A\n", before.peak, before.mean, before.rms);
+        printf("staggered:  peak %6.2f A, mean %6.2f A, rms %6.2f A\n", after.peak, after.mean, after.rms);
+        printf("peak cut:   %.1f%%\n", before.peak > 0 ? 100.0 * (before.peak - after.peak) / before.peak : 0.0);
+
+        if (options.waveformPath) {
+            FILE *out = fopen(options.waveformPath, "w");
+            if (!out) {
+                return false;
+            }
+            double tickUs = 1e6 / PWM_FREQUENCY_HZ / ticks;
+            fprintf(out, "tick,time_us,aligned_a,staggered_a\n");
+            for (uint32_t i = 0; i < ticks; i++) {
+                fprintf(out, "%u,%.3f,%.3f,%.3f\n", i, i * tickUs, alignedCurrent[i], staggeredCurrent[i]);
+            }
+            fclose(out);
+        }
+        return true;
+    }
+}
@@ -0,0 +1,410 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "canTx.h"
+
+#define ISOTP_MAX_PAYLOAD 4096       // Bytes per message, in each direction of a link
+#define ISOTP_BLOCK_SIZE 8           // Consecutive frames granted per flow control (0 = all at once)
+#define ISOTP_ST_MIN 0               // Minimum gap requested between consecutive frames (STmin encoding)
+#define ISOTP_TIMEOUT_MS 1000        // N_Bs / N_Cr: wait for the peer's next flow control or consecutive frame
+#define ISOTP_MAX_WAITS 8            // Flow control WAIT frames accepted in a row before giving up
+#define ISOTP_TX_QUEUE_LIMIT 4       // Consecutive frames kept queued in canTx's bulk class at once
+#define ISOTP_PADDING 0xCC           // Filler for the unused bytes of a frame
+
+/**
+ * ISO 15765-2 (ISO-TP) transport for messages longer than one CAN frame
+ *
+ * A link is a pair of bus IDs: the peer sends on an ID routed to receive(),
+ * and the link sends its frames, including flow control, on txId. Messages
+ * up to ISOTP_MAX_PAYLOAD bytes are segmented into a first frame and
+ * consecutive frames with a 4-bit sequence number; the receiver paces the
+ * sender with flow control frames (block size, STmin) and rejects messages
+ * that do not fit with an overflow. Payloads longer than 4095 bytes use the
+ * 32-bit first frame length escape. Classic CAN, normal addressing, frames
+ * padded to 8 bytes.
+ *
+ * Both directions copy into the link's own static buffers, so nothing is
+ * allocated. receive() runs on the CAN RX task and delivers complete
+ * messages from there; send() copies the message and returns, and loop(),
+ * on one task per link, paces the consecutive frames and times out a
+ * stalled peer. A lost or reordered consecutive frame aborts the message;
+ * the peer resends it.
+ *
+ * Frames go out through canTx by default: flow control and single frames
+ * (short replies that nothing would resend) in the ACK class, the frames of
+ * a segmented message in the BULK class. Host code can set Link::transmit
+ * to connect a link elsewhere.
+ */
+namespace isoTp
+{
+    enum FrameType : uint8_t
+    {
+        SINGLE_FRAME = 0x0,
+        FIRST_FRAME = 0x1,
+        CONSECUTIVE_FRAME = 0x2,
+        FLOW_CONTROL = 0x3,
+    };
+
+    enum FlowStatus : uint8_t
+    {
+        FLOW_CONTINUE = 0x0,
+        FLOW_WAIT = 0x1,
+        FLOW_OVERFLOW = 0x2,
+    };
+
+    enum TxState : uint8_t
+    {
+        TX_IDLE,
+        TX_WAIT_FLOW,    // First frame or a full block sent, waiting for flow control
+        TX_SENDING,
+    };
+
+    typedef void (*Receiver)(const uint8_t *data, uint16_t length);
+    typedef bool (*Transmit)(const twai_message_t &message, bool flowControl);
+
+    struct Stats
+    {
+        uint32_t received;
+        uint32_t sent;
+        uint32_t rxAborted;     // Bad sequence number, peer timeout or a new message mid-transfer
+        uint32_t rxOverflows;   // First frames longer than ISOTP_MAX_PAYLOAD
+        uint32_t txAborted;     // Overflow, too many waits or no flow control in time
+    };
+
+    /**
+     * Hand a frame to canTx; segmented messages are held back while the bulk class is busy
+     */
+    bool canTxTransmit(const twai_message_t &message, bool flowControl)
+    {
+        if (flowControl || message.data[0] >> 4 == SINGLE_FRAME) {
+            return canTx::send(message, canTx::TX_ACK);
+        }
+        if (canTx::depth(canTx::TX_BULK) >= ISOTP_TX_QUEUE_LIMIT) {
+            return false;
+        }
+        return canTx::send(message, canTx::TX_BULK);
+    }
+
+    struct Link
+    {
+        uint16_t txId;
+        Receiver onReceive;
+        Transmit transmit = canTxTransmit;
+        uint8_t blockSize = ISOTP_BLOCK_SIZE;
+        uint8_t stMin = ISOTP_ST_MIN;
+        hal::Lock mux = HAL_LOCK_INIT;
+
+        struct {
+            uint8_t buffer[ISOTP_MAX_PAYLOAD];
+            uint32_t length;
+            uint32_t received;
+            uint8_t nextSequence;
+            uint8_t blockLeft;
+            uint32_t lastFrameMs;
+            bool active;
+        } rx;
+
+        struct {
+            uint8_t buffer[ISOTP_MAX_PAYLOAD];
+            uint32_t length;
+            uint32_t sent;
+            uint8_t nextSequence;
+            uint8_t blockSize;       // From the peer's flow control, 0 = no limit
+            uint8_t blockLeft;
+            uint8_t waits;
+            uint32_t stMinUs;
+            uint32_t lastFrameUs;
+            uint32_t lastFlowMs;
+            TxState state;
+        } tx;
+
+        Stats stats;
+    };
+
+    /**
+     * Gap in us for an STmin byte; reserved values mean the maximum, 127 ms
+     */
+    uint32_t stMinToUs(uint8_t stMin)
+    {
+        if (stMin <= 0x7F) {
+            return stMin * 1000;
+        }
+        if (stMin >= 0xF1 && stMin <= 0xF9) {
+            return (stMin - 0xF0) * 100;
+        }
+        return 127000;
+    }
+
+    twai_message_t frame(const Link &link)
+    {
+        twai_message_t message;
+        message.identifier = link.txId;
+        message.extd = false;
+        message.rtr = false;
+        message.data_length_code = 8;
+        memset(message.data, ISOTP_PADDING, sizeof(message.data));
+        return message;
+    }
+
+    bool sendFlowControl(Link &link, FlowStatus status)
+    {
+        twai_message_t message = frame(link);
+        message.data[0] = (FLOW_CONTROL << 4) | status;
+        message.data[1] = link.blockSize;
+        message.data[2] = link.stMin;
+        return link.transmit(message, true);
+    }
+
+    // ------------------------------------------------------------------- receive
+
+    void receiveFlowControl(Link &link, const uint8_t *data, uint8_t length)
+    {
+        if (length < 3) {
+            return;
+        }
+        hal::lock(link.mux);
+        if (link.tx.state != TX_WAIT_FLOW) {
+            hal::unlock(link.mux);
+            return;
+        }
+        uint8_t status = data[0] & 0x0F;
+        if (status == FLOW_CONTINUE) {
+            link.tx.blockSize = data[1];
+            link.tx.blockLeft = data[1];
+            link.tx.stMinUs = stMinToUs(data[2]);
+            link.tx.waits = 0;
+            link.tx.lastFrameUs = hal::micros() - link.tx.stMinUs;  // First frame of the block may go at once
+            link.tx.state = TX_SENDING;
+        } else if (status == FLOW_WAIT && ++link.tx.waits <= ISOTP_MAX_WAITS) {
+            link.tx.lastFlowMs = hal::millis();
+        } else {
+            link.tx.state = TX_IDLE;
+            link.stats.txAborted++;
+        }
+        hal::unlock(link.mux);
+    }
+
+    /**
+     * Handle one frame from the peer
+     * Call from the CAN RX task (the dispatcher handler for the link's receive ID)
+     */
+    void receive(Link &link, const twai_message_t &message)
+    {
+        const uint8_t *data = message.data;
+        uint8_t length = message.data_length_code;
+        if (length < 1) {
+            return;
+        }
+
+        uint32_t deliver = 0;
+        hal::lock(link.mux);
+        switch (data[0] >> 4) {
+            case SINGLE_FRAME: {
+                uint8_t payload = data[0] & 0x0F;
+                if (payload == 0 || payload > 7 || payload >= length) {
+                    break;
+                }
+                if (link.rx.active) {
+                    link.rx.active = false;  // A new message replaces an unfinished one
+                    link.stats.rxAborted++;
+                }
+                memcpy(link.rx.buffer, data + 1, payload);
+                deliver = payload;
+                break;
+            }
+            case FIRST_FRAME: {
+                if (length < 8) {
+                    break;
+                }
+                uint32_t total = ((data[0] & 0x0F) << 8) | data[1];
+                uint8_t header = 2;
+                if (total == 0) {
+                    total = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | (data[4] << 8) | data[5];
+                    header = 6;
+                }
+                if (link.rx.active) {
+                    link.rx.active = false;
+                    link.stats.rxAborted++;
+                }
+                if (total <= 7) {
+                    break;
+                }
+                if (total > ISOTP_MAX_PAYLOAD) {
+                    link.stats.rxOverflows++;
+                    hal::unlock(link.mux);
+                    sendFlowControl(link, FLOW_OVERFLOW);
+                    return;
+                }
+                link.rx.length = total;
+                link.rx.received = 8 - header;
+                memcpy(link.rx.buffer, data + header, link.rx.received);
+                link.rx.nextSequence = 1;
+                link.rx.blockLeft = link.blockSize;
+                link.rx.lastFrameMs = hal::millis();
+                link.rx.active = true;
+                hal::unlock(link.mux);
+                sendFlowControl(link, FLOW_CONTINUE);
+                return;
+            }
+            case CONSECUTIVE_FRAME: {
+                if (!link.rx.active) {
+                    break;
+                }
+                if ((data[0] & 0x0F) != link.rx.nextSequence) {
+                    tracef("[ISO-TP] 0x%03X: sequence %d, expected %d - message dropped",
+                           message.identifier, data[0] & 0x0F, link.rx.nextSequence);
+                    link.rx.active = false;
+                    link.stats.rxAborted++;
+                    break;
+                }
+                uint32_t chunk = link.rx.length - link.rx.received;
+                chunk = chunk < 7 ? chunk : 7;
+                if (chunk > (uint32_t)(length - 1)) {
+                    link.rx.active = false;
+                    link.stats.rxAborted++;
+                    break;
+                }
+                memcpy(link.rx.buffer + link.rx.received, data + 1, chunk);
+                link.rx.received += chunk;
+                link.rx.nextSequence = (link.rx.nextSequence + 1) & 0x0F;
+                link.rx.lastFrameMs = hal::millis();
+                if (link.rx.received == link.rx.length) {
+                    link.rx.active = false;
+                    deliver = link.rx.length;
+                } else if (link.blockSize && --link.rx.blockLeft == 0) {
+                    link.rx.blockLeft = link.blockSize;
+                    hal::unlock(link.mux);
+                    sendFlowControl(link, FLOW_CONTINUE);
+                    return;
+                }
+                break;
+            }
+            case FLOW_CONTROL:
+                hal::unlock(link.mux);
+                receiveFlowControl(link, data, length);
+                return;
+        }
+        hal::unlock(link.mux);
+
+        // The buffer stays ours: only this task writes it, and not before the handler returns
+        if (deliver) {
+            link.stats.received++;
+            if (link.onReceive) {
+                link.onReceive(link.rx.buffer, deliver);
+            }
+        }
+    }
+
+    // ------------------------------------------------------------------ transmit
+
+    /**
+     * Start sending a message; the data is copied
+     * Safe from any task
+     * @return false if the link is still sending or the message is empty or too long
+     */
+    bool send(Link &link, const uint8_t *data, uint32_t length)
+    {
+        if (length == 0 || length > ISOTP_MAX_PAYLOAD) {
+            return false;
+        }
+        hal::lock(link.mux);
+        if (link.tx.state != TX_IDLE) {
+            hal::unlock(link.mux);
+            return false;
+        }
+
+        twai_message_t message = frame(link);
+        if (length <= 7) {
+            message.data[0] = (SINGLE_FRAME << 4) | length;
+            memcpy(message.data + 1, data, length);
+            hal::unlock(link.mux);
+            bool queued = link.transmit(message, false);
+            link.stats.sent += queued;
+            return queued;
+        }
+
+        uint8_t header = 2;
+        if (length <= 0xFFF) {
+            message.data[0] = (FIRST_FRAME << 4) | (length >> 8);
+            message.data[1] = length & 0xFF;
+        } else {
+            message.data[0] = FIRST_FRAME << 4;
+            message.data[1] = 0;
+            message.data[2] = length >> 24;
+            message.data[3] = (length >> 16) & 0xFF;
+            message.data[4] = (length >> 8) & 0xFF;
+            message.data[5] = length & 0xFF;
+            header = 6;
+        }
+        memcpy(link.tx.buffer, data, length);
+        memcpy(message.data + header, data, 8 - header);
+        link.tx.length = length;
+        link.tx.sent = 8 - header;
+        link.tx.nextSequence = 1;
+        link.tx.waits = 0;
+        link.tx.lastFlowMs = hal::millis();
+        link.tx.state = TX_WAIT_FLOW;
+        hal::unlock(link.mux);
+
+        if (!link.transmit(message, false)) {
+            hal::lock(link.mux);
+            link.tx.state = TX_IDLE;
+            hal::unlock(link.mux);
+            return false;
+        }
+        return true;
+    }
+
+    bool isSending(Link &link)
+    {
+        hal::lock(link.mux);
+        bool sending = link.tx.state != TX_IDLE;
+        hal::unlock(link.mux);
+        return sending;
+    }
+
+    /**
+     * Queue the consecutive frames that are due and time out a silent peer
+     * Call from loop()
+     */
+    void loop(Link &link)
+    {
+        uint32_t nowMs = hal::millis();
+        hal::lock(link.mux);
+        if (link.rx.active && nowMs - link.rx.lastFrameMs > ISOTP_TIMEOUT_MS) {
+            link.rx.active = false;
+            link.stats.rxAborted++;
+        }
+        if (link.tx.state == TX_WAIT_FLOW && nowMs - link.tx.lastFlowMs > ISOTP_TIMEOUT_MS) {
+            link.tx.state = TX_IDLE;
+            link.stats.txAborted++;
+        }
+
+        hal::unlock(link.mux);
+
+        // Only this task moves a link out of TX_SENDING, so the frames can be built and sent unlocked
+        while (link.tx.state == TX_SENDING && hal::micros() - link.tx.lastFrameUs >= link.tx.stMinUs) {
+            twai_message_t message = frame(link);
+            uint32_t chunk = link.tx.length - link.tx.sent;
+            chunk = chunk < 7 ? chunk : 7;
+            message.data[0] = (CONSECUTIVE_FRAME << 4) | link.tx.nextSequence;
+            memcpy(message.data + 1, link.tx.buffer + link.tx.sent, chunk);
+            if (!link.transmit(message, false)) {
+                break;  // canTx is busy; retried on the next pass
+            }
+
+            hal::lock(link.mux);
+            link.tx.sent += chunk;
+            link.tx.nextSequence = (link.tx.nextSequence + 1) & 0x0F;
+            link.tx.lastFrameUs = hal::micros();
+            if (link.tx.sent == link.tx.length) {
+                link.tx.state = TX_IDLE;
+                link.stats.sent++;
+            } else if (link.tx.blockSize && --link.tx.blockLeft == 0) {
+                link.tx.lastFlowMs = nowMs;
+                link.tx.state = TX_WAIT_FLOW;
+            }
+            hal::unlock(link.mux);
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include "hal/hal.h"
+#include "canTx.h"
+#include "nodeAddress.h"
+
+#define LATENCY_QUERY_ID 0x22       // CAN ID for latency queries (bus to module)
+#define LATENCY_REPORT_ID 0x1A      // CAN ID for latency reports (module to bus)
+#define LATENCY_MAX_SOURCES 8       // Message IDs tracked
+#define LATENCY_BUCKETS 16
+#define LATENCY_NO_SOURCE 0xFFFF
+
+/**
+ * Command latency histograms, from CAN RX to the PWM hardware write
+ *
+ * The RX path stamps each output change with hal::micros() and the message ID
+ * (outputState::Stamp). The PWM task records the elapsed time when it issues
+ * the first duty or fade write for that change, into a fixed-bucket histogram
+ * per message ID (one sample per changed channel). Percentiles are reported
+ * as the upper bound of the bucket they fall in; max is exact.
+ *
+ * Query on CAN ID 0x22: [messageId] (0xFF or empty = every tracked ID),
+ * optional byte 1 = 1 to clear the histograms after reporting.
+ * Each tracked ID is answered on CAN ID 0x1A with
+ * [messageId, p50 lo, hi, p99 lo, hi, max lo, hi, count] - times in units of
+ * 10 us, capped at 0xFFFF; count saturates at 255.
+ */
+namespace latencyStats
+{
+    // Upper bound of each bucket in us; the last bucket is open-ended
+    constexpr uint32_t bucketLimitUs[LATENCY_BUCKETS] = {
+        50, 100, 200, 500, 1000, 2000, 5000, 10000,
+        20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 0xFFFFFFFF,
+    };
+
+    struct Histogram
+    {
+        uint16_t sourceId;
+        uint32_t counts[LATENCY_BUCKETS];
+        uint32_t total;
+        uint32_t maxUs;
+    };
+
+    Histogram histograms[LATENCY_MAX_SOURCES];
+    uint8_t histogramCount = 0;
+    hal::Lock statsMux = HAL_LOCK_INIT;
+
+    uint8_t bucketOf(uint32_t us)
+    {
+        uint8_t bucket = 0;
+        while (bucket < LATENCY_BUCKETS - 1 && us >= bucketLimitUs[bucket]) {
+            bucket++;
+        }
+        return bucket;
+    }
+
+    /**
+     * Record one RX-to-output latency
+     * Runs on the PWM task; IDs beyond LATENCY_MAX_SOURCES are not tracked
+     */
+    void record(uint16_t sourceId, uint32_t us)
+    {
+        hal::lock(statsMux);
+        Histogram *histogram = nullptr;
+        for (uint8_t i = 0; i < histogramCount; i++) {
+            if (histograms[i].sourceId == sourceId) {
+                histogram = &histograms[i];
+                break;
+            }
+        }
+        if (!histogram && histogramCount < LATENCY_MAX_SOURCES) {
+            histogram = &histograms[histogramCount++];
+            *histogram = {};
+            histogram->sourceId = sourceId;
+        }
+        if (histogram) {
+            histogram->counts[bucketOf(us)]++;
+            histogram->total++;
+            if (us > histogram->maxUs) {
+                histogram->maxUs = us;
+            }
+        }
+        hal::unlock(statsMux);
+    }
+
+    /**
+     * Upper bound of the bucket holding the given percentile
+     */
+    uint32_t percentile(const Histogram &histogram, uint8_t percent)
+    {
+        if (histogram.total == 0) {
+            return 0;
+        }
+        uint32_t rank = ((uint64_t)histogram.total * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (uint8_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            seen += histogram.counts[bucket];
+            if (seen >= rank) {
+                // Never report more than the exact max
+                return bucketLimitUs[bucket] < histogram.maxUs ? bucketLimitUs[bucket] : histogram.maxUs;
+            }
+        }
+        return histogram.maxUs;
+    }
+
+    /**
+     * Copy the histograms so they can be reported without holding the lock
+     */
+    uint8_t snapshot(Histogram *out)
+    {
+        hal::lock(statsMux);
+        uint8_t count = histogramCount;
+        memcpy(out, histograms, count * sizeof(Histogram));
+        hal::unlock(statsMux);
+        return count;
+    }
+
+    void clear()
+    {
+        hal::lock(statsMux);
+        histogramCount = 0;
+        hal::unlock(statsMux);
+    }
+
+    uint16_t toReportUnits(uint32_t us)
+    {
+        uint32_t units = us / 10;
+        return units > 0xFFFF ? 0xFFFF : units;
+    }
+
+    void sendReport(const Histogram &histogram)
+    {
+        uint16_t p50 = toReportUnits(percentile(histogram, 50));
+        uint16_t p99 = toReportUnits(percentile(histogram, 99));
+        uint16_t max = toReportUnits(histogram.maxUs);
+
+        twai_message_t message;
+        message.identifier = nodeAddress::id(LATENCY_REPORT_ID);
+        message.extd = false;
+        message.rtr = false;
+        message.data_length_code = 8;
+        message.data[0] = histogram.sourceId;
+        message.data[1] = p50 & 0xFF;
+        message.data[2] = p50 >> 8;
+        message.data[3] = p99 & 0xFF;
+        message.data[4] = p99 >> 8;
+        message.data[5] = max & 0xFF;
+        message.data[6] = max >> 8;
+        message.data[7] = histogram.total > 255 ? 255 : histogram.total;
+        canTx::send(message, canTx::TX_ACK);
+    }
+
+    /**
+     * Handle latency query message (ID 0x22)
+     */
+    void handleQuery(const twai_message_t &message)
+    {
+        uint8_t sourceId = message.data_length_code >= 1 ? message.data[0] : 0xFF;
+        bool reset = message.data_length_code >= 2 && message.data[1] == 1;
+
+        Histogram copy[LATENCY_MAX_SOURCES];
+        uint8_t count = snapshot(copy);
+        for (uint8_t i = 0; i < count; i++) {
+            if (sourceId == 0xFF || copy[i].sourceId == sourceId) {
+                sendReport(copy[i]);
+            }
+        }
+        if (reset) {
+            clear();
+        }
+    }
+
+    /**
+     * Print one line per tracked message ID
+     */
+    void print()
+    {
+        Histogram copy[LATENCY_MAX_SOURCES];
+        uint8_t count = snapshot(copy);
+        for (uint8_t i = 0; i < count; i++) {
+            debugf("[LAT] ID 0x%02X - n: %u, p50: %u us, p99: %u us, max: %u us\n",
+                   copy[i].sourceId, copy[i].total, percentile(copy[i], 50),
+                   percentile(copy[i], 99), copy[i].maxUs);
+        }
+    }
+}
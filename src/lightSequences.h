@@ -1,273 +1,504 @@
 #pragma once
-#include <Arduino.h>
+#include "hal/hal.h"
 #include "globals.h"
+#include "outputState.h"
+
+#define SEQUENCE_TICK_MS 10
+#define SEQUENCE_TASK_STACK 3072
+#define SEQUENCE_TASK_PRIORITY 3
+#define SEQUENCE_MAX_STEPS_PER_TICK 64
 
 namespace lightSequences
 {
-    void startupLightShow()
+    // Channel bit masks - bit N selects OUTPUT0(N+1)
+    constexpr uint8_t CH1 = 0x01;
+    constexpr uint8_t CH2 = 0x02;
+    constexpr uint8_t CH3 = 0x04;
+    constexpr uint8_t CH4 = 0x08;
+    constexpr uint8_t CH5 = 0x10;
+    constexpr uint8_t CH6 = 0x20;
+    constexpr uint8_t CH7 = 0x40;
+    constexpr uint8_t CH8 = 0x80;
+    constexpr uint8_t CH_ODD = CH1 | CH3 | CH5 | CH7;
+    constexpr uint8_t CH_EVEN = CH2 | CH4 | CH6 | CH8;
+    constexpr uint8_t CH_ALL = 0xFF;
+
+    // Transition curve of a keyframe (top 4 bits of Keyframe::timing)
+    enum Curve : uint8_t
+    {
+        CURVE_STEP,        // Jump to level, then hold for the duration
+        CURVE_LINEAR,      // Ramp to level over the duration
+        CURVE_EASE_IN,     // Quadratic, slow start
+        CURVE_EASE_OUT,    // Quadratic, slow finish
+        CURVE_EASE_IN_OUT, // Smoothstep
+        CURVE_REPEAT = 0xF // Not a transition: jump back to frame `level`, duration field more times
+    };
+
+    /**
+     * Packed keyframe (4 bytes)
+     * Byte 0: channel mask, byte 1: target level (repeat: frame index),
+     * bytes 2-3: [15:12] curve, [11:0] duration in SEQUENCE_TICK_MS units (repeat: count)
+     */
+    struct Keyframe
+    {
+        uint8_t channelMask;
+        uint8_t level;
+        uint16_t timing;
+
+        constexpr Curve curve() const { return (Curve)(timing >> 12); }
+        constexpr uint16_t ticks() const { return timing & 0x0FFF; }
+        constexpr uint32_t durationMs() const { return (uint32_t)ticks() * SEQUENCE_TICK_MS; }
+    };
+
+    constexpr uint16_t KEYFRAME_MAX_TICKS = 0x0FFF;
+
+    // Not constexpr: reaching either while building a constexpr table fails the build
+    inline void invalidKeyframeDuration() {}
+    inline void invalidRepeatCount() {}
+
+    constexpr Keyframe keyframe(uint8_t mask, uint8_t level, uint32_t ms, Curve curve)
     {
-        // All lights off first
-        analogWrite(OUTPUT01_PIN, 0);
-        analogWrite(OUTPUT02_PIN, 0);
-        analogWrite(OUTPUT03_PIN, 0);
-        analogWrite(OUTPUT04_PIN, 0);
-        analogWrite(OUTPUT05_PIN, 0);
-        analogWrite(OUTPUT06_PIN, 0);
-        analogWrite(OUTPUT07_PIN, 0);
-        analogWrite(OUTPUT08_PIN, 0);
-        delay(500);
-
-        // ===== SECTION 1: Progressive Wave (5 seconds) =====
-        // Wave across all 8 lights from left to right
-        for (int wave = 0; wave < 3; wave++)
+        if (ms % SEQUENCE_TICK_MS != 0 || ms / SEQUENCE_TICK_MS > KEYFRAME_MAX_TICKS)
         {
-            for (int i = 0; i < 8; i++)
-            {
-                int pins[8] = {OUTPUT01_PIN, OUTPUT02_PIN, OUTPUT03_PIN, OUTPUT04_PIN,
-                               OUTPUT05_PIN, OUTPUT06_PIN, OUTPUT07_PIN, OUTPUT08_PIN};
+            invalidKeyframeDuration(); // Durations must be whole ticks of at most 40.95 s
+        }
+        return {mask, level, (uint16_t)(((uint16_t)curve << 12) | (ms / SEQUENCE_TICK_MS))};
+    }
+
+    // Jump channels to level and hold for holdMs
+    constexpr Keyframe set(uint8_t mask, uint8_t level, uint32_t holdMs = 0)
+    {
+        return keyframe(mask, level, holdMs, CURVE_STEP);
+    }
 
-                // Turn on current light
-                analogWrite(pins[i], 255);
-                delay(100);
+    // Transition channels from their current level to level over ms
+    constexpr Keyframe fade(uint8_t mask, uint8_t level, uint32_t ms, Curve curve = CURVE_LINEAR)
+    {
+        return keyframe(mask, level, ms, curve);
+    }
 
-                // Turn off current light
-                analogWrite(pins[i], 0);
-            }
+    // Hold all channels for ms
+    constexpr Keyframe wait(uint32_t ms)
+    {
+        return keyframe(0, 0, ms, CURVE_STEP);
+    }
+
+    // Play frames [frameIndex, this) `times` more times (repeats do not nest)
+    constexpr Keyframe repeat(uint8_t frameIndex, uint16_t times)
+    {
+        if (times > KEYFRAME_MAX_TICKS)
+        {
+            invalidRepeatCount(); // The count shares the 12-bit duration field
         }
-        delay(300);
+        return {0, frameIndex, (uint16_t)(((uint16_t)CURVE_REPEAT << 12) | times)};
+    }
 
-        // ===== SECTION 2: All Lights Pulse Together (4 seconds) =====
-        for (int pulse = 0; pulse < 4; pulse++)
+    struct Sequence
+    {
+        const Keyframe *frames;
+        uint8_t frameCount;
+        uint8_t channelMask; // Channels the sequence drives while it plays
+    };
+
+    /**
+     * Check a keyframe table
+     * Repeats must jump backwards, past the previous repeat (the player keeps a
+     * single repeat counter, so loops cannot nest), and the table must be
+     * indexable by a uint8_t
+     */
+    constexpr bool isValid(const Keyframe *frames, size_t count)
+    {
+        if (count == 0 || count > 255)
         {
-            // Fade in
-            for (int i = 0; i <= 255; i += 25)
+            return false;
+        }
+        size_t loopStart = 0; // First frame a repeat may jump back to
+        for (size_t i = 0; i < count; i++)
+        {
+            if (frames[i].curve() != CURVE_REPEAT)
+            {
+                continue;
+            }
+            if (frames[i].level < loopStart || frames[i].level >= i || frames[i].ticks() == 0)
             {
-                analogWrite(OUTPUT01_PIN, i);
-                analogWrite(OUTPUT02_PIN, i);
-                analogWrite(OUTPUT03_PIN, i);
-                analogWrite(OUTPUT04_PIN, i);
-                analogWrite(OUTPUT05_PIN, i);
-                analogWrite(OUTPUT06_PIN, i);
-                analogWrite(OUTPUT07_PIN, i);
-                analogWrite(OUTPUT08_PIN, i);
-                delay(30);
+                return false;
             }
-            // Fade out
-            for (int i = 255; i >= 0; i -= 25)
+            loopStart = i + 1;
+        }
+        return true;
+    }
+
+    template <size_t N>
+    constexpr bool isValid(const Keyframe (&frames)[N])
+    {
+        return isValid(frames, N);
+    }
+
+    // A repeat that jumps back over another repeat would loop forever
+    constexpr Keyframe nestedRepeatFrames[] = {
+        set(CH1, 255, 100),
+        set(CH1, 0, 100),
+        repeat(0, 2),
+        set(CH2, 255, 100),
+        repeat(0, 2),
+    };
+    static_assert(!isValid(nestedRepeatFrames), "isValid must reject nested repeats");
+
+    // Union of all channels a keyframe table touches
+    constexpr uint8_t channelsOf(const Keyframe *frames, size_t count)
+    {
+        uint8_t mask = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (frames[i].curve() != CURVE_REPEAT)
             {
-                analogWrite(OUTPUT01_PIN, i);
-                analogWrite(OUTPUT02_PIN, i);
-                analogWrite(OUTPUT03_PIN, i);
-                analogWrite(OUTPUT04_PIN, i);
-                analogWrite(OUTPUT05_PIN, i);
-                analogWrite(OUTPUT06_PIN, i);
-                analogWrite(OUTPUT07_PIN, i);
-                analogWrite(OUTPUT08_PIN, i);
-                delay(30);
+                mask |= frames[i].channelMask;
             }
         }
-        delay(300);
+        return mask;
+    }
+
+    constexpr Sequence compile(const Keyframe *frames, size_t count)
+    {
+        return {frames, (uint8_t)count, channelsOf(frames, count)};
+    }
+
+    template <size_t N>
+    constexpr Sequence compile(const Keyframe (&frames)[N])
+    {
+        return compile(frames, N);
+    }
+
+    // Startup show: wave, pulse, alternate, spiral, then flash all channels (~17.5 s)
+    constexpr Keyframe startupShowFrames[] = {
+        set(CH_ALL, 0, 500),
+        // 1: progressive wave, 3 passes
+        set(CH1, 255, 100), set(CH1, 0),
+        set(CH2, 255, 100), set(CH2, 0),
+        set(CH3, 255, 100), set(CH3, 0),
+        set(CH4, 255, 100), set(CH4, 0),
+        set(CH5, 255, 100), set(CH5, 0),
+        set(CH6, 255, 100), set(CH6, 0),
+        set(CH7, 255, 100), set(CH7, 0),
+        set(CH8, 255, 100), set(CH8, 0),
+        repeat(1, 2),
+        wait(300),
+        // 19: pulse all channels together, 4 times
+        fade(CH_ALL, 255, 330),
+        fade(CH_ALL, 0, 330),
+        repeat(19, 3),
+        wait(300),
+        // 23: alternate odd and even channels, 5 times
+        set(CH_ODD, 255, 200), set(CH_ODD, 0),
+        set(CH_EVEN, 255, 200), set(CH_EVEN, 0, 100),
+        repeat(23, 4),
+        wait(300),
+        // 29: spiral in and back out, 3 times
+        set(CH1, 255, 80), set(CH2, 255, 80), set(CH3, 255, 80), set(CH4, 255, 80),
+        set(CH5, 255, 80), set(CH6, 255, 80), set(CH7, 255, 80), set(CH8, 255, 280),
+        set(CH8, 0, 80), set(CH7, 0, 80), set(CH6, 0, 80), set(CH5, 0, 80),
+        set(CH4, 0, 80), set(CH3, 0, 80), set(CH2, 0, 80), set(CH1, 0, 280),
+        repeat(29, 2),
+        wait(300),
+        // 47: finale flash, 8 times
+        set(CH_ALL, 255, 200), set(CH_ALL, 0, 200),
+        repeat(47, 7),
+        set(CH_ALL, 0),
+    };
+    static_assert(isValid(startupShowFrames), "startupShowFrames is not a valid keyframe table");
+
+    // Interior: ramp outputs 5-8 up and down, then run a back-and-forth chase 31 times
+    constexpr Keyframe interiorSequence01Frames[] = {
+        set(CH5 | CH6 | CH7 | CH8, 0),
+        fade(CH5 | CH6 | CH7 | CH8, 255, 2550),
+        fade(CH5 | CH6 | CH7 | CH8, 0, 2550),
+        // 3: chase
+        set(CH5 | CH6 | CH7, 0), set(CH8, 255, 60),
+        set(CH8 | CH6 | CH5, 0), set(CH7, 255, 60),
+        set(CH8 | CH7 | CH5, 0), set(CH6, 255, 60),
+        set(CH8 | CH7 | CH6, 0), set(CH5, 255, 60),
+        set(CH8 | CH7 | CH5, 0), set(CH6, 255, 60),
+        set(CH8 | CH6 | CH5, 0), set(CH7, 255, 60),
+        set(CH7 | CH6 | CH5, 0), set(CH8, 255, 60),
+        repeat(3, 30),
+        set(CH5 | CH6 | CH7 | CH8, 0),
+    };
+    static_assert(isValid(interiorSequence01Frames), "interiorSequence01Frames is not a valid keyframe table");
+
+    // Exterior: ramp outputs 3-4 up and down, then alternate them 31 times
+    constexpr Keyframe exteriorSequence01Frames[] = {
+        set(CH3 | CH4, 0),
+        fade(CH3 | CH4, 255, 2550),
+        fade(CH3 | CH4, 0, 2550),
+        // 3: alternate
+        set(CH4, 0), set(CH3, 255, 250),
+        set(CH3, 0), set(CH4, 255, 250),
+        repeat(3, 30),
+        set(CH3 | CH4, 0),
+    };
+    static_assert(isValid(exteriorSequence01Frames), "exteriorSequence01Frames is not a valid keyframe table");
+
+    constexpr Sequence startupShow = compile(startupShowFrames);
+    constexpr Sequence interiorSequence01 = compile(interiorSequence01Frames);
+    constexpr Sequence exteriorSequence01 = compile(exteriorSequence01Frames);
+
+    // Playback state, shared between the sequence task and the CAN RX task
+    struct Player
+    {
+        bool active = false;
+        uint32_t generation = 0;    // Bumped by play(), so a tick can tell its copy went stale
+        const Sequence *sequence = nullptr;
+        uint8_t index = 0;
+        uint8_t ownedMask = 0; // Channels not yet overridden by a manual command
+        bool repeating = false;
+        uint16_t repeatLeft = 0;
+        unsigned long frameStart = 0;
+        bool frameStarted = false;  // Hardware fade already issued for the current frame
+        uint8_t levels[8] = {0};    // Level of each channel as driven by the sequence
+        uint8_t fadeFrom[8] = {0};  // Levels captured when the current frame began
+        uint32_t fadeMs[8] = {0};   // Hardware fade time for the last change of each channel
+    };
+
+    Player player;
+
+    hal::Lock playerMux = HAL_LOCK_INIT;
+    hal::Task *sequenceTask = nullptr;
 
-        // ===== SECTION 3: Alternating Pattern (5 seconds) =====
-        for (int alt = 0; alt < 5; alt++)
+    /**
+     * Apply a transition curve to a 0-65535 progress value
+     */
+    uint32_t ease(Curve curve, uint32_t t)
+    {
+        switch (curve)
+        {
+        case CURVE_EASE_IN:
+            return (t * t) >> 16;
+        case CURVE_EASE_OUT:
+        {
+            uint32_t inv = 65535 - t;
+            return 65535 - ((inv * inv) >> 16);
+        }
+        case CURVE_EASE_IN_OUT:
         {
-            // Odd lights on
-            analogWrite(OUTPUT01_PIN, 255);
-            analogWrite(OUTPUT03_PIN, 255);
-            analogWrite(OUTPUT05_PIN, 255);
-            analogWrite(OUTPUT07_PIN, 255);
-            delay(200);
-
-            // Even lights on
-            analogWrite(OUTPUT01_PIN, 0);
-            analogWrite(OUTPUT03_PIN, 0);
-            analogWrite(OUTPUT05_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 0);
-
-            analogWrite(OUTPUT02_PIN, 255);
-            analogWrite(OUTPUT04_PIN, 255);
-            analogWrite(OUTPUT06_PIN, 255);
-            analogWrite(OUTPUT08_PIN, 255);
-            delay(200);
-
-            // All off
-            analogWrite(OUTPUT02_PIN, 0);
-            analogWrite(OUTPUT04_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 0);
-            analogWrite(OUTPUT08_PIN, 0);
-            delay(100);
+            uint32_t t2 = (t * t) >> 16;
+            return (t2 * (3 * 65535 - 2 * t)) >> 16;
         }
-        delay(300);
+        default:
+            return t;
+        }
+    }
+
+    /**
+     * Prepare the frame at state.index for playback
+     */
+    void enterFrame(Player &state)
+    {
+        memcpy(state.fadeFrom, state.levels, sizeof(state.levels));
+        state.frameStarted = false;
+    }
 
-        // ===== SECTION 4: Spiral Pattern (6 seconds) =====
-        // Lights spiral inward from edges
-        for (int spiral = 0; spiral < 3; spiral++)
+    /**
+     * Advance a copy of the player to now, collecting changed channels into dirty
+     * Runs without playerMux; tick() commits the result
+     */
+    void advance(Player &state, unsigned long now, uint8_t &dirty)
+    {
+        for (int budget = 0; budget < SEQUENCE_MAX_STEPS_PER_TICK; budget++)
         {
-            int pins[8] = {OUTPUT01_PIN, OUTPUT02_PIN, OUTPUT03_PIN, OUTPUT04_PIN,
-                           OUTPUT05_PIN, OUTPUT06_PIN, OUTPUT07_PIN, OUTPUT08_PIN};
+            if (state.index >= state.sequence->frameCount)
+            {
+                state.active = false;
+                return;
+            }
+
+            const Keyframe &frame = state.sequence->frames[state.index];
+            Curve curve = frame.curve();
+
+            if (curve == CURVE_REPEAT)
+            {
+                if (!state.repeating)
+                {
+                    state.repeating = true;
+                    state.repeatLeft = frame.ticks();
+                }
+                if (state.repeatLeft > 0)
+                {
+                    state.repeatLeft--;
+                    state.index = frame.level;
+                }
+                else
+                {
+                    state.repeating = false;
+                    state.index++;
+                }
+                enterFrame(state);
+                continue;
+            }
 
-            // Forward spiral
-            for (int i = 0; i < 8; i++)
+            uint32_t duration = frame.durationMs();
+            uint32_t elapsed = now - state.frameStart;
+            bool done = elapsed >= duration;
+
+            // Linear fades run on the LEDC hardware: issue them once, at the start of the frame
+            bool hardwareFade = curve == CURVE_LINEAR && !done;
+            if (hardwareFade && state.frameStarted)
             {
-                analogWrite(pins[i], 255);
-                delay(80);
+                return;
             }
-            delay(200);
+            if (hardwareFade && (dirty & frame.channelMask))
+            {
+                // A step earlier in this tick moved these channels: publish it first and
+                // start the fade next tick, or the PWM task only ever sees the fade target
+                return;
+            }
+            state.frameStarted = true;
 
-            // Backward spiral with fade
-            for (int i = 7; i >= 0; i--)
+            for (int ch = 0; ch < 8; ch++)
             {
-                analogWrite(pins[i], 0);
-                delay(80);
+                if (!(frame.channelMask & (1 << ch)))
+                {
+                    continue;
+                }
+                uint8_t level = frame.level;
+                if (curve != CURVE_STEP && !hardwareFade && !done)
+                {
+                    int from = state.fadeFrom[ch];
+                    uint32_t progress = ease(curve, elapsed * 65535 / duration);
+                    level = from + (((int)frame.level - from) * (int32_t)progress) / 65535;
+                }
+                if (state.levels[ch] != level)
+                {
+                    state.levels[ch] = level;
+                    state.fadeMs[ch] = hardwareFade ? duration - elapsed : 0;
+                    dirty |= (1 << ch);
+                }
             }
-            delay(200);
-        }
-        delay(300);
 
-        // ===== SECTION 5: Finale - All Lights Rapid Flash (4 seconds) =====
-        for (int flash = 0; flash < 8; flash++)
-        {
-            // All on
-            analogWrite(OUTPUT01_PIN, 255);
-            analogWrite(OUTPUT02_PIN, 255);
-            analogWrite(OUTPUT03_PIN, 255);
-            analogWrite(OUTPUT04_PIN, 255);
-            analogWrite(OUTPUT05_PIN, 255);
-            analogWrite(OUTPUT06_PIN, 255);
-            analogWrite(OUTPUT07_PIN, 255);
-            analogWrite(OUTPUT08_PIN, 255);
-            delay(200);
-
-            // All off
-            analogWrite(OUTPUT01_PIN, 0);
-            analogWrite(OUTPUT02_PIN, 0);
-            analogWrite(OUTPUT03_PIN, 0);
-            analogWrite(OUTPUT04_PIN, 0);
-            analogWrite(OUTPUT05_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 0);
-            analogWrite(OUTPUT08_PIN, 0);
-            delay(200);
-        }
+            if (!done)
+            {
+                return; // Frame still in progress
+            }
 
-        // ===== Ensure all lights are off =====
-        analogWrite(OUTPUT01_PIN, 0);
-        analogWrite(OUTPUT02_PIN, 0);
-        analogWrite(OUTPUT03_PIN, 0);
-        analogWrite(OUTPUT04_PIN, 0);
-        analogWrite(OUTPUT05_PIN, 0);
-        analogWrite(OUTPUT06_PIN, 0);
-        analogWrite(OUTPUT07_PIN, 0);
-        analogWrite(OUTPUT08_PIN, 0);
+            // Frame finished - advance on the frame schedule, not the tick, so timing doesn't drift
+            state.frameStart += duration;
+            state.index++;
+            enterFrame(state);
+        }
     }
 
-    void startInteriorSequnce01()
+    /**
+     * Run one sequence tick and write any changed outputs
+     */
+    void tick()
     {
-        analogWrite(OUTPUT08_PIN, 0);
-        analogWrite(OUTPUT07_PIN, 0);
-        analogWrite(OUTPUT06_PIN, 0);
-        analogWrite(OUTPUT05_PIN, 0);
-        // Loop from 0 to 255 (increasing)
-        for (int i = 0; i <= 255; i++)
+        bool changed = false;
+
+        // Walk the keyframes on a copy so the RX task is never held off by it
+        hal::lock(playerMux);
+        Player state = player;
+        hal::unlock(playerMux);
+        if (!state.active)
         {
-            analogWrite(OUTPUT08_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT07_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT06_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT05_PIN, i); // Set the PWM value to i
-            delay(10);                    // Wait for 10 milliseconds before the next step
+            return;
         }
+        uint8_t dirty = 0;
+        advance(state, hal::millis(), dirty);
 
-        // Loop from 255 to 0 (decreasing)
-        for (int i = 255; i >= 0; i--)
+        // Commit and publish under playerMux so a releaseChannels() can never be
+        // overtaken by a level computed before it. A play() in the meantime wins;
+        // a releaseChannels() keeps the progress but not the released channels
+        hal::lock(playerMux);
+        if (player.generation == state.generation)
         {
-            analogWrite(OUTPUT08_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT07_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT06_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT05_PIN, i); // Set the PWM value to i
-            delay(10);                    // Wait for 10 milliseconds before the next step
+            state.ownedMask = player.ownedMask;
+            state.active = state.active && player.active;
+            dirty &= player.active ? state.ownedMask : 0;
+            player = state;
+            if (dirty)
+            {
+                changed = outputState::publish(dirty, player.levels, player.fadeMs);
+            }
         }
+        hal::unlock(playerMux);
 
-        for (int i = 0; i <= 30; i++)
+        if (changed)
         {
-            analogWrite(OUTPUT05_PIN, 0);
-            analogWrite(OUTPUT08_PIN, 255);
-            analogWrite(OUTPUT07_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 0);
-            delay(60);
-
-            analogWrite(OUTPUT08_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 255);
-            analogWrite(OUTPUT06_PIN, 0);
-            analogWrite(OUTPUT05_PIN, 0);
-            delay(60);
-
-            analogWrite(OUTPUT08_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 255);
-            analogWrite(OUTPUT05_PIN, 0);
-            delay(60);
-
-            analogWrite(OUTPUT08_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 0);
-            analogWrite(OUTPUT05_PIN, 255);
-            delay(60);
-
-            analogWrite(OUTPUT08_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 255);
-            analogWrite(OUTPUT05_PIN, 0);
-            delay(60);
-
-            analogWrite(OUTPUT08_PIN, 0);
-            analogWrite(OUTPUT07_PIN, 255);
-            analogWrite(OUTPUT06_PIN, 0);
-            analogWrite(OUTPUT05_PIN, 0);
-            delay(60);
-
-            analogWrite(OUTPUT08_PIN, 255);
-            analogWrite(OUTPUT07_PIN, 0);
-            analogWrite(OUTPUT06_PIN, 0);
-            analogWrite(OUTPUT05_PIN, 0);
-            delay(60);
+            outputState::notify();
         }
-        analogWrite(OUTPUT08_PIN, 0);
-        analogWrite(OUTPUT07_PIN, 0);
-        analogWrite(OUTPUT06_PIN, 0);
-        analogWrite(OUTPUT05_PIN, 0);
     }
 
-    void startExteriorSequnce01()
+    /**
+     * Start the sequence tick task
+     * Sequences only advance from this task, so starting one never blocks the caller
+     */
+    void begin()
     {
-        analogWrite(OUTPUT04_PIN, 0);
-        analogWrite(OUTPUT03_PIN, 0);
-        // Loop from 0 to 255 (increasing)
-        for (int i = 0; i <= 255; i++)
-        {
-            analogWrite(OUTPUT04_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT03_PIN, i); // Set the PWM value to i
-            delay(10);                    // Wait for 10 milliseconds before the next step
-        }
+        sequenceTask = hal::startTask("lightSeq", tick, SEQUENCE_TICK_MS, SEQUENCE_TASK_STACK,
+                                      SEQUENCE_TASK_PRIORITY, 1);
+        debugln("[LIGHTS] Sequence task started");
+    }
+
+    /**
+     * Start playing a sequence, replacing any sequence already running
+     * Returns immediately; playback is driven by the sequence task
+     */
+    void play(const Sequence &sequence)
+    {
+        hal::lock(playerMux);
+        player.generation++;
+        player.sequence = &sequence;
+        player.index = 0;
+        player.ownedMask = sequence.channelMask;
+        player.repeating = false;
+        player.repeatLeft = 0;
+        player.frameStart = hal::millis();
+        memcpy(player.levels, outputState::read().levels, sizeof(player.levels));
+        enterFrame(player);
+        player.active = true;
+        hal::unlock(playerMux);
+    }
 
-        // Loop from 255 to 0 (decreasing)
-        for (int i = 255; i >= 0; i--)
+    /**
+     * Hand channels back to manual control
+     * Called before a manual command writes a channel so the running sequence
+     * stops driving it; the sequence ends once it owns no channels
+     */
+    void releaseChannels(uint8_t mask)
+    {
+        hal::lock(playerMux);
+        player.ownedMask &= ~mask;
+        if (player.ownedMask == 0)
         {
-            analogWrite(OUTPUT04_PIN, i); // Set the PWM value to i
-            analogWrite(OUTPUT03_PIN, i); // Set the PWM value to i
-            delay(10);                    // Wait for 10 milliseconds before the next step
+            player.active = false;
         }
+        hal::unlock(playerMux);
+    }
 
-        for (int i = 0; i <= 30; i++)
-        {
-            analogWrite(OUTPUT04_PIN, 0);
-            analogWrite(OUTPUT03_PIN, 255);
-            delay(250);
+    /**
+     * Stop the running sequence, leaving outputs at their current levels
+     */
+    void stop()
+    {
+        releaseChannels(0xFF);
+    }
 
-            analogWrite(OUTPUT04_PIN, 255);
-            analogWrite(OUTPUT03_PIN, 0);
-            delay(250);
-        }
-        analogWrite(OUTPUT04_PIN, 0);
-        analogWrite(OUTPUT03_PIN, 0);
-    }    
-}
\ No newline at end of file
+    bool isPlaying()
+    {
+        return player.active;
+    }
+
+    void startupLightShow()
+    {
+        play(startupShow);
+    }
+
+    void startInteriorSequnce01()
+    {
+        play(interiorSequence01);
+    }
+
+    void startExteriorSequnce01()
+    {
+        play(exteriorSequence01);
+    }
+}
@@ -1,66 +1,80 @@
-#include <debug.h>
+#include "hal/hal.h"
 #include "globals.h"
 #include "canHelper.h"
-#include <OtaUpdate.h>
 #include "lightSequences.h"
 #include "wifiConfig.h"
+#include "otaService.h"
+#include "otaStream.h"
+#include "sequenceStore.h"
+#include "pwmOutput.h"
+#include "traceLog.h"
+#include "scenes.h"
+#include "channelGroups.h"
+#include "dimmingCurves.h"
+#include "outputJournal.h"
+#include "nodeAddress.h"
 
 // Global credential buffers - writable at runtime
 char runtimeSsid[33] = {0};
 char runtimePassword[64] = {0};
 
-// Create OTA update handler (3-minute timeout, 180000 ms)
-OtaUpdate otaUpdate(180000, runtimeSsid, runtimePassword);
+// Create OTA update handler (3-minute timeout, OTA_TIMEOUT_MS)
+OtaUpdate otaUpdate(OTA_TIMEOUT_MS, runtimeSsid, runtimePassword);
 
 void setup()
 {
-  Serial.begin(115200);
-
-#if DEBUG == 1
-  // Wait for serial monitor connection (up to 3 seconds)
-  // Ensures startup messages are visible when monitor connects after boot
-  unsigned long serialWait = millis();
-  while (!Serial.available() && (millis() - serialWait < 3000)) {
-    delay(10);
-  }
-#endif
+  hal::serialBegin(115200);
+
+  // Bring the outputs back first: only the curve selection (NVS) is needed before the journal
+  wifiConfig::init();
+  dimmingCurves::init();
+  pwmOutput::begin();
+  outputJournal::restore();
+
+  // Print deferred tracef() records from hot paths on a low-priority task
+  traceLog::begin();
 
   debugln("\n=== TrailCurrent Power Control Module ===");
   debugln("CAN-Controlled 8-Channel PWM Lighting");
 
-  // Initialize WiFi config storage and load stored credentials
-  wifiConfig::init();
-  wifiConfig::setRuntimeCredentialPtrs(runtimeSsid, runtimePassword);
+  // CAN IDs depend on the DIP switch address; read it before anything registers with the bus
+  nodeAddress::init();
 
   // Load credentials from NVS (provisioned via CAN bus message 0x01)
+  wifiConfig::setRuntimeCredentialPtrs(runtimeSsid, runtimePassword);
   if (wifiConfig::loadCredentials(runtimeSsid, runtimePassword)) {
     debugln("[WiFi] Loaded credentials from NVS");
   } else {
     debugln("[WiFi] No credentials in NVS - OTA disabled until provisioned via CAN");
   }
 
-  // Initialize output pins
-  pinMode(OUTPUT01_PIN, OUTPUT);
-  pinMode(OUTPUT02_PIN, OUTPUT);
-  pinMode(OUTPUT03_PIN, OUTPUT);
-  pinMode(OUTPUT04_PIN, OUTPUT);
-  pinMode(OUTPUT05_PIN, OUTPUT);
-  pinMode(OUTPUT06_PIN, OUTPUT);
-  pinMode(OUTPUT07_PIN, OUTPUT);
-  pinMode(OUTPUT08_PIN, OUTPUT);
+  // Cache the scene presets and group membership (same NVS namespace) so recall never reads flash
+  scenes::init();
+  channelGroups::init();
 
   // Run the startup light show
   debugln("[LIGHTS] Starting 30-second light show...");
   //lightSequences::startupLightShow();
   debugln("[LIGHTS] Light show complete!");
 
+  // Locate the custom sequence slots in the spiffs partition
+  sequenceStore::init();
+
+  // Start the non-blocking sequence player (CAN ID 30 only queues sequences onto it)
+  lightSequences::begin();
+
   // Initialize OTA (connects to WiFi)
   debugf("[OTA] Device hostname: %s\n", otaUpdate.getHostName().c_str());
+  otaService::begin();
+  otaStream::begin();  // Compressed, resumable uploads on port 8080 while a window is open
   debugln("[OTA] Ready to receive OTA trigger (CAN ID 0x0)");
 
   // Initialize CAN
   canHelper::setupCan();
 
+  // No wait for a serial monitor here: it held the CAN bus off for 3 s in debug builds.
+  // The boot times are repeated with every heartbeat instead.
+  canHelper::printBootTimes();
   debugln("=== Setup Complete ===\n");
 }
 
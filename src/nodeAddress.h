@@ -0,0 +1,62 @@
+#pragma once
+#include "hal/hal.h"
+#include "globals.h"
+
+#define CAN_NODE_ID_STRIDE 0x40     // CAN IDs per node; every per-node function ID is below this
+#define CAN_NODE_COUNT 8
+
+/**
+ * Node address from the DIP switch, and the CAN IDs derived from it
+ *
+ * Switches 1-3 (DEVICE_SELECTION01-03) give an address of 0-7, read once at
+ * boot; a switch turned on pulls its pin to 3.3 V. Each node owns a block of
+ * CAN_NODE_ID_STRIDE identifiers starting at address * CAN_NODE_ID_STRIDE,
+ * and every per-node message keeps its function ID as the offset in that
+ * block: node 0 uses the original IDs, node 2 receives brightness (21) on
+ * 0x95 and sends status (0x1B) on 0x9B. Bus-wide messages (OTA trigger 0x00,
+ * group commands) keep one ID for all nodes and are registered with
+ * canDispatch::onShared().
+ *
+ * GPIO 34 and 35 have no internal pull resistors, so switches 1 and 2 rely
+ * on pull-downs on the board; without them the address floats.
+ */
+namespace nodeAddress
+{
+    static_assert(CAN_NODE_COUNT * CAN_NODE_ID_STRIDE <= 0x800, "Node blocks must fit in 11-bit IDs");
+
+    uint8_t address = 0;
+
+    /**
+     * First CAN ID of this node's block
+     */
+    uint16_t base()
+    {
+        return address * CAN_NODE_ID_STRIDE;
+    }
+
+    /**
+     * Bus ID of a per-node function ID
+     */
+    uint16_t id(uint16_t functionId)
+    {
+        return base() + functionId;
+    }
+
+    /**
+     * Read the DIP switch
+     * Call once, before canHelper::setupCan(); a change takes effect at the next boot
+     */
+    uint8_t init()
+    {
+        address = 0;
+        for (uint8_t bit = 0; bit < 3; bit++) {
+            // GPIO 27 gets the internal pull-down; 34/35 cannot have one
+            bool pullDown = DEVICE_SELECTION_PINS[bit] < 34;
+            if (hal::readInput(DEVICE_SELECTION_PINS[bit], pullDown)) {
+                address |= 1 << bit;
+            }
+        }
+        debugf("[Node] Address %u - CAN IDs 0x%03X-0x%03X\n", address, base(), base() + CAN_NODE_ID_STRIDE - 1);
+        return address;
+    }
+}
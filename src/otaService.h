@@ -0,0 +1,208 @@
+#pragma once
+#include "hal/hal.h"
+#include "canTx.h"
+#include "nodeAddress.h"
+#include "wifiConfig.h"
+
+#define OTA_TIMEOUT_MS 180000      // OTA window once triggered
+#define OTA_STATUS_ID 0x1D         // CAN ID for OTA state reports (module to bus)
+#define OTA_STATUS_INTERVAL_MS 1000
+#define OTA_RESULT_ID 0x28         // CAN ID for the last update's result, sent once after the restart
+#define OTA_RESULT_KEY "otaresult" // NVS key, in the wifiConfig namespace
+#define OTA_TASK_STACK 8192
+#define OTA_TASK_PRIORITY 1
+
+// Forward declare otaUpdate and runtime credentials (defined in main.cpp)
+extern OtaUpdate otaUpdate;
+extern char runtimeSsid[33];
+
+/**
+ * OTA updates as a background service
+ *
+ * The CAN trigger only wakes the OTA task, which runs the WiFi connect and the
+ * blocking OtaUpdate::waitForOta() window on core 0. Lighting, CAN handling and
+ * status broadcasting on the other tasks keep running during the update.
+ *
+ * State is reported on CAN ID 0x1D as [state, progress %, seconds left lo, hi],
+ * on every state change and every OTA_STATUS_INTERVAL_MS while active.
+ *
+ * A successful update, over any path, leaves its time and transferred bytes in
+ * NVS; the new firmware reports them once on 0x28 after the restart.
+ */
+namespace otaService
+{
+    enum State : uint8_t
+    {
+        OTA_IDLE = 0,
+        OTA_WINDOW_OPEN = 1, // Trigger accepted, connecting to WiFi / waiting for an upload
+        OTA_RECEIVING = 2,   // Upload in progress
+        OTA_SUCCESS = 3,     // Image written, device restarting
+        OTA_FAILED = 4,      // Upload error or no WiFi credentials
+        OTA_CLOSED = 5,      // Window timed out, back to normal operation
+    };
+
+    volatile State state = OTA_IDLE;
+    volatile uint8_t progress = 0;
+    volatile unsigned long windowStart = 0;
+    volatile bool stateChanged = false;
+    volatile uint32_t receivedBytes = 0;  // ArduinoOTA progress total
+    hal::Task *otaTask = nullptr;
+
+    enum UpdatePath : uint8_t
+    {
+        PATH_ARDUINO_OTA = 0, // Raw image over espota
+        PATH_HTTP_STREAM = 1, // Compressed, resumable upload (otaStream.h)
+        PATH_CAN = 2,         // Compressed image over CAN (canUpdate.h)
+    };
+
+    // Persisted in NVS
+    struct UpdateResult
+    {
+        uint8_t path;
+        uint8_t resumes;
+        uint16_t seconds;  // From the trigger (or the first CAN message) to the verified image
+        uint32_t bytes;    // Bytes received, retransmissions included
+    };
+
+    void setState(State newState)
+    {
+        state = newState;
+        stateChanged = true;
+    }
+
+    bool isActive()
+    {
+        return state == OTA_WINDOW_OPEN || state == OTA_RECEIVING;
+    }
+
+    /**
+     * Keep how long an update took and what it transferred, for the report after the restart
+     */
+    void saveResult(UpdatePath path, uint32_t seconds, uint32_t bytes, uint8_t resumes)
+    {
+        UpdateResult result = {path, resumes, (uint16_t)(seconds > 0xFFFF ? 0xFFFF : seconds), bytes};
+        wifiConfig::preferences.putBytes(OTA_RESULT_KEY, &result, sizeof(result));
+        debugf("[OTA] Update took %us, %u bytes transferred, %u resumes\n", seconds, bytes, resumes);
+    }
+
+    /**
+     * Report and forget the update that led to this boot
+     * [path, resumes, seconds lo, hi, bytes transferred (4, LE)]
+     */
+    void sendLastResult()
+    {
+        UpdateResult result;
+        if (!wifiConfig::preferences.isKey(OTA_RESULT_KEY) ||
+            wifiConfig::preferences.getBytes(OTA_RESULT_KEY, &result, sizeof(result)) != sizeof(result)) {
+            return;
+        }
+        wifiConfig::preferences.remove(OTA_RESULT_KEY);
+        debugf("[OTA] Last update: path %u, %us, %u bytes transferred, %u resumes\n", result.path, result.seconds,
+               result.bytes, result.resumes);
+
+        twai_message_t message;
+        message.identifier = nodeAddress::id(OTA_RESULT_ID);
+        message.extd = false;
+        message.rtr = false;
+        message.data_length_code = 8;
+        message.data[0] = result.path;
+        message.data[1] = result.resumes;
+        message.data[2] = result.seconds & 0xFF;
+        message.data[3] = result.seconds >> 8;
+        for (int i = 0; i < 4; i++) {
+            message.data[4 + i] = result.bytes >> (i * 8);
+        }
+        canTx::send(message, canTx::TX_ACK);
+    }
+
+    void sendStatus()
+    {
+        uint32_t secondsLeft = 0;
+        if (isActive()) {
+            unsigned long elapsed = hal::millis() - windowStart;
+            secondsLeft = elapsed < OTA_TIMEOUT_MS ? (OTA_TIMEOUT_MS - elapsed) / 1000 : 0;
+        }
+
+        twai_message_t message;
+        message.identifier = nodeAddress::id(OTA_STATUS_ID);
+        message.extd = false;
+        message.rtr = false;
+        message.data_length_code = 4;
+        message.data[0] = state;
+        message.data[1] = progress;
+        message.data[2] = secondsLeft & 0xFF;
+        message.data[3] = secondsLeft >> 8;
+        canTx::send(message, canTx::TX_STATUS);
+    }
+
+    /**
+     * OTA task body, runs one update window per request()
+     */
+    void runWindow()
+    {
+        if (runtimeSsid[0] == '\0') {
+            debugln("[OTA] No WiFi credentials - provision via CAN ID 0x01 first");
+            setState(OTA_FAILED);
+            return;
+        }
+
+        // Best effort: only reported if OtaUpdate leaves these ArduinoOTA callbacks in place
+        ArduinoOTA.onStart([]() { setState(OTA_RECEIVING); });
+        ArduinoOTA.onProgress([](unsigned int done, unsigned int total) {
+            progress = total ? (uint64_t)done * 100 / total : 0;
+            receivedBytes = done;
+        });
+        ArduinoOTA.onEnd([]() {
+            saveResult(PATH_ARDUINO_OTA, (hal::millis() - windowStart) / 1000, receivedBytes, 0);
+            setState(OTA_SUCCESS);
+        });
+        ArduinoOTA.onError([](ota_error_t) { setState(OTA_FAILED); });
+
+        debugln("[OTA] Entering OTA mode");
+        otaUpdate.waitForOta();  // Blocks this task only, until OTA update or timeout
+        debugln("[OTA] OTA mode exited - resuming normal operation");
+
+        if (isActive()) {  // Timed out; a success or failure stays reported
+            setState(OTA_CLOSED);
+        }
+    }
+
+    /**
+     * Start the OTA task (idle until triggered)
+     */
+    void begin()
+    {
+        otaTask = hal::startTask("ota", runWindow, 0, OTA_TASK_STACK, OTA_TASK_PRIORITY, 0);
+    }
+
+    /**
+     * Ask the OTA task to open an update window
+     * Returns immediately; ignored while a window is already open
+     */
+    void request()
+    {
+        if (isActive() || !otaTask) {
+            return;
+        }
+        progress = 0;
+        receivedBytes = 0;
+        windowStart = hal::millis();
+        setState(OTA_WINDOW_OPEN);
+        hal::notify(otaTask);
+    }
+
+    /**
+     * Report OTA state changes and progress
+     * Call from loop()
+     */
+    void loop()
+    {
+        static unsigned long lastReport = 0;
+        unsigned long now = hal::millis();
+        if (stateChanged || (isActive() && now - lastReport >= OTA_STATUS_INTERVAL_MS)) {
+            stateChanged = false;
+            lastReport = now;
+            sendStatus();
+        }
+    }
+}
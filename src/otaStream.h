@@ -0,0 +1,425 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "crc32.h"
+#include "otaService.h"
+#include "canUpdate.h"
+
+#define OTA_STREAM_PORT 8080            // HTTP port of the upload endpoint
+#define OTA_STREAM_SECTOR_SIZE 0x1000   // Flash sector; the unit that is verified and resumed from
+#define OTA_STREAM_HEADER_MAX 256       // Longest gzip header accepted (file name included)
+#define OTA_STREAM_POLL_MS 2
+#define OTA_STREAM_RESTART_MS 500       // Restart delay after a good image, so the HTTP reply goes out
+#define OTA_STREAM_TASK_STACK 8192
+#define OTA_STREAM_TASK_PRIORITY 1
+
+/**
+ * Compressed, resumable image upload over WiFi
+ *
+ * Runs next to ArduinoOTA while an OTA window is open: the image is POSTed to
+ * http://<module>:8080/update?offset=N as a multipart file, gzip-compressed
+ * (gzip -9) or raw. A gzip image is inflated while it streams in and written
+ * sector by sector into the inactive app slot; each sector is read back and
+ * compared before it counts.
+ *
+ * After every verified sector the position (upload offset, inflater state,
+ * the partial next sector) is kept as a checkpoint. When the connection
+ * drops, GET /update returns that offset and a POST from there continues
+ * the image instead of starting over; this also works in a later window, as
+ * long as the module has not restarted.
+ *
+ * At the end the gzip CRC-32 and length are checked against the slot
+ * contents before the boot slot is switched. The time from the trigger and
+ * the bytes received, retransmissions included, go to otaService::saveResult.
+ */
+namespace otaStream
+{
+    enum Phase : uint8_t
+    {
+        STREAM_IDLE,
+        STREAM_HEADER,   // First bytes: gzip header, or the raw image magic
+        STREAM_BODY,     // Deflate data
+        STREAM_RAW,      // Uncompressed image
+        STREAM_TRAILER,  // gzip CRC-32 and length
+        STREAM_DONE,
+        STREAM_FAILED,
+    };
+
+    struct Position
+    {
+        Phase phase;
+        uint32_t input;    // Upload bytes consumed
+        uint32_t written;  // Image bytes in flash
+        uint16_t fill;     // Image bytes waiting in sector
+    };
+
+    hal::Task *streamTask = nullptr;
+    hal::FlashRegion *slot = nullptr;
+    hal::Inflater inflater;
+    uint8_t sector[OTA_STREAM_SECTOR_SIZE];
+    uint8_t header[OTA_STREAM_HEADER_MAX];
+    uint16_t headerLength = 0;
+    uint8_t trailer[8];
+    uint8_t trailerLength = 0;
+    Position at = {STREAM_IDLE, 0, 0, 0};
+
+    // Last verified sector
+    Position verified = {STREAM_IDLE, 0, 0, 0};
+    hal::InflateCheckpoint verifiedInflater;
+    uint8_t verifiedSector[OTA_STREAM_SECTOR_SIZE];
+    bool checkpointDue = false;
+
+    // Measurements
+    uint32_t receivedBytes = 0;
+    uint32_t connections = 0;
+    uint8_t resumes = 0;
+
+    bool restartPending = false;
+    uint32_t restartAtMs = 0;
+
+    void fail(const char *reason)
+    {
+        (void)reason;  // Only printed in debug builds
+        debugf("[OTA Stream] %s - upload stopped at byte %u\n", reason, at.input);
+        at.phase = STREAM_FAILED;
+    }
+
+    /**
+     * The whole image is bad: resuming it would only repeat the failure
+     */
+    void discard(const char *reason)
+    {
+        fail(reason);
+        verified = {STREAM_IDLE, 0, 0, 0};
+    }
+
+    /**
+     * Write the sector buffer to flash and compare it back
+     */
+    bool flushSector()
+    {
+        if (at.fill == 0) {
+            return true;
+        }
+        uint8_t check[256];
+        if (!hal::flashErase(slot, at.written, OTA_STREAM_SECTOR_SIZE) ||
+            !hal::flashWrite(slot, at.written, sector, at.fill)) {
+            return false;
+        }
+        for (uint16_t offset = 0; offset < at.fill; offset += sizeof(check)) {
+            uint16_t left = at.fill - offset;
+            uint16_t length = left < sizeof(check) ? left : sizeof(check);
+            if (!hal::flashRead(slot, at.written + offset, check, length) ||
+                memcmp(check, sector + offset, length) != 0) {
+                return false;
+            }
+        }
+        at.written += at.fill;
+        at.fill = 0;
+        checkpointDue = true;
+        return true;
+    }
+
+    bool appendImage(const uint8_t *data, size_t length)
+    {
+        while (length > 0) {
+            if (at.written + OTA_STREAM_SECTOR_SIZE > hal::flashSize(slot)) {
+                fail("Image larger than the app slot");
+                return false;
+            }
+            size_t take = OTA_STREAM_SECTOR_SIZE - at.fill;
+            take = take < length ? take : length;
+            memcpy(sector + at.fill, data, take);
+            at.fill += take;
+            data += take;
+            length -= take;
+            if (at.fill == OTA_STREAM_SECTOR_SIZE && !flushSector()) {
+                fail("Flash write failed");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Length of a complete gzip header (RFC 1952), 0 if more bytes are needed, -1 if invalid
+     */
+    int gzipHeaderLength(const uint8_t *data, size_t length)
+    {
+        if (length < 10) {
+            return 0;
+        }
+        if (data[0] != 0x1F || data[1] != 0x8B || data[2] != 8) {
+            return -1;
+        }
+        uint8_t flags = data[3];
+        size_t end = 10;
+        if (flags & 0x04) {  // FEXTRA
+            if (length < end + 2) {
+                return 0;
+            }
+            end += 2 + (data[end] | (data[end + 1] << 8));
+        }
+        for (uint8_t text = 0x08; text <= 0x10; text <<= 1) {  // FNAME, FCOMMENT
+            if (flags & text) {
+                while (end < length && data[end] != 0) {
+                    end++;
+                }
+                if (end >= length) {
+                    return 0;
+                }
+                end++;
+            }
+        }
+        if (flags & 0x02) {  // FHCRC
+            end += 2;
+        }
+        return end <= length ? end : 0;
+    }
+
+    size_t consumeHeader(const uint8_t *data, size_t length)
+    {
+        if (headerLength == 0 && data[0] == HAL_IMAGE_MAGIC) {
+            debugln("[OTA Stream] Uncompressed image");
+            at.phase = STREAM_RAW;
+            return 0;
+        }
+        size_t take = OTA_STREAM_HEADER_MAX - headerLength;
+        take = take < length ? take : length;
+        memcpy(header + headerLength, data, take);
+        int complete = gzipHeaderLength(header, headerLength + take);
+        if (complete < 0 || (complete == 0 && headerLength + take == OTA_STREAM_HEADER_MAX)) {
+            fail("Not a gzip or app image");
+            return 0;
+        }
+        if (complete == 0) {
+            headerLength += take;
+            return take;
+        }
+        size_t used = complete - headerLength;
+        headerLength = complete;
+        hal::inflaterBegin(inflater);
+        at.phase = STREAM_BODY;
+        return used;
+    }
+
+    size_t consumeBody(const uint8_t *data, size_t length)
+    {
+        const uint8_t *out;
+        size_t produced;
+        size_t used = length;
+        hal::InflateStatus status = hal::inflaterRun(inflater, data, used, out, produced);
+        if (status == hal::INFLATE_ERROR || (status == hal::INFLATE_MORE && used == 0 && produced == 0)) {
+            fail("Corrupt deflate data");
+            return 0;
+        }
+        if (!appendImage(out, produced)) {
+            return 0;
+        }
+        if (status == hal::INFLATE_DONE) {
+            at.phase = STREAM_TRAILER;
+        }
+        return used;
+    }
+
+    /**
+     * Compare the gzip CRC-32 and length with what is in the slot, then switch the boot slot
+     */
+    void install(uint32_t expectedCrc, uint32_t expectedLength)
+    {
+        if (!flushSector()) {
+            fail("Flash write failed");
+            return;
+        }
+        if (trailerLength == sizeof(trailer)) {
+            uint32_t crc = 0;
+            for (uint32_t offset = 0; offset < at.written; offset += OTA_STREAM_SECTOR_SIZE) {
+                uint32_t length = at.written - offset < OTA_STREAM_SECTOR_SIZE ? at.written - offset : OTA_STREAM_SECTOR_SIZE;
+                if (!hal::flashRead(slot, offset, sector, length)) {
+                    fail("Flash read failed");
+                    return;
+                }
+                crc = crc32::update(crc, sector, length);
+            }
+            if (crc != expectedCrc || at.written != expectedLength) {
+                discard("CRC-32 or length mismatch");
+                return;
+            }
+        }
+        if (!hal::flashSetBootSlot(slot)) {
+            discard("Image rejected by the boot loader");
+            return;
+        }
+
+        at.phase = STREAM_DONE;
+        uint32_t seconds = (hal::millis() - otaService::windowStart) / 1000;
+        debugf("[OTA Stream] %u-byte image from %u upload bytes verified - restarting into %s\n", at.written,
+               at.input + trailerLength, slot->label);
+        otaService::saveResult(otaService::PATH_HTTP_STREAM, seconds, receivedBytes, resumes);
+        otaService::setState(otaService::OTA_SUCCESS);
+        restartAtMs = hal::millis() + OTA_STREAM_RESTART_MS;
+        restartPending = true;
+    }
+
+    size_t consumeTrailer(const uint8_t *data, size_t length)
+    {
+        size_t take = sizeof(trailer) - trailerLength;
+        take = take < length ? take : length;
+        memcpy(trailer + trailerLength, data, take);
+        trailerLength += take;
+        if (trailerLength == sizeof(trailer)) {
+            uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+            uint32_t size = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint32_t)trailer[7] << 24);
+            install(crc, size);
+        }
+        return take;
+    }
+
+    void saveCheckpoint()
+    {
+        checkpointDue = false;
+        verified = at;
+        memcpy(verifiedSector, sector, at.fill);
+        if (at.phase == STREAM_BODY || at.phase == STREAM_TRAILER) {
+            hal::inflaterSave(inflater, verifiedInflater);
+        }
+    }
+
+    // ------------------------------------------------------------- handlers
+
+    uint32_t resumeOffset()
+    {
+        return verified.input;
+    }
+
+    /**
+     * An upload starts: offset 0 begins a new image, the checkpoint offset continues one
+     */
+    bool start(uint32_t offset)
+    {
+        if (canUpdate::active) {
+            debugln("[OTA Stream] Update over CAN in progress - upload refused");
+            return false;
+        }
+        connections++;
+        if (offset == 0) {
+            slot = hal::flashUpdateSlot();
+            at = {STREAM_HEADER, 0, 0, 0};
+            verified = at;
+            headerLength = 0;
+            trailerLength = 0;
+            receivedBytes = 0;
+            resumes = 0;
+            otaService::setState(otaService::OTA_RECEIVING);
+            debugf("[OTA Stream] Receiving an image into %s\n", slot->label);
+            return true;
+        }
+        bool resumable = verified.phase == STREAM_BODY || verified.phase == STREAM_RAW || verified.phase == STREAM_TRAILER;
+        if (!resumable || offset != verified.input) {
+            debugf("[OTA Stream] Upload from byte %u refused, continue from %u\n", offset, verified.input);
+            return false;
+        }
+        at = verified;
+        memcpy(sector, verifiedSector, at.fill);
+        if ((at.phase == STREAM_BODY || at.phase == STREAM_TRAILER) &&
+            !hal::inflaterRestore(inflater, verifiedInflater, slot, at.written, sector, at.fill)) {
+            fail("Cannot restore the inflater");
+            return false;
+        }
+        resumes += resumes < 0xFF;
+        otaService::setState(otaService::OTA_RECEIVING);
+        debugf("[OTA Stream] Resuming at upload byte %u, image byte %u\n", at.input, at.written + at.fill);
+        return true;
+    }
+
+    bool data(const uint8_t *bytes, size_t length)
+    {
+        receivedBytes += length;
+        while (length > 0 && at.phase != STREAM_DONE && at.phase != STREAM_FAILED) {
+            size_t used = 0;
+            switch (at.phase) {
+                case STREAM_HEADER:
+                    used = consumeHeader(bytes, length);
+                    break;
+                case STREAM_BODY:
+                    used = consumeBody(bytes, length);
+                    break;
+                case STREAM_RAW:
+                    used = appendImage(bytes, length) ? length : 0;
+                    break;
+                case STREAM_TRAILER:
+                    used = consumeTrailer(bytes, length);
+                    break;
+                default:
+                    break;
+            }
+            at.input += used;
+            bytes += used;
+            length -= used;
+            // Only between inflater calls: all output so far is in flash or the sector buffer
+            if (checkpointDue && at.phase != STREAM_FAILED) {
+                saveCheckpoint();
+            }
+        }
+        return at.phase != STREAM_FAILED;
+    }
+
+    /**
+     * The upload ended; a raw image is complete when its upload is
+     */
+    bool end(bool complete)
+    {
+        if (!complete) {
+            debugf("[OTA Stream] Connection lost at upload byte %u, can resume from %u\n", at.input, verified.input);
+            return false;
+        }
+        if (at.phase == STREAM_RAW) {
+            install(0, 0);
+        }
+        if (at.phase != STREAM_DONE) {
+            debugf("[OTA Stream] Upload ended at byte %u before the image did\n", at.input);
+        }
+        return at.phase == STREAM_DONE;
+    }
+
+    // ----------------------------------------------------------------- task
+
+    /**
+     * Upload task body: serve while an OTA window is open, restart into a verified image
+     */
+    void service()
+    {
+        if (restartPending) {
+            if ((int32_t)(hal::millis() - restartAtMs) >= 0) {
+                restartPending = false;
+                hal::restart();
+            } else {
+                hal::uploadServerPoll();
+            }
+            return;
+        }
+        if (otaService::isActive()) {
+            hal::uploadServerPoll();
+        } else {
+            hal::uploadServerEnd();
+        }
+    }
+
+    /**
+     * Register the upload endpoint and start the upload task
+     */
+    void begin()
+    {
+        hal::uploadServerBegin(OTA_STREAM_PORT, {resumeOffset, start, data, end});
+        streamTask = hal::startTask("otaStream", service, OTA_STREAM_POLL_MS, OTA_STREAM_TASK_STACK,
+                                    OTA_STREAM_TASK_PRIORITY, 0);
+    }
+
+    void print()
+    {
+        if (at.phase != STREAM_IDLE && at.phase != STREAM_DONE) {
+            debugf("[OTA Stream] %u upload bytes, %u image bytes, %u received in %u connections\n", at.input,
+                   at.written + at.fill, receivedBytes, connections);
+        }
+    }
+}
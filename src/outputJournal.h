@@ -0,0 +1,222 @@
+#pragma once
+#include "hal/hal.h"
+#include "crc32.h"
+#include "outputState.h"
+
+#define JOURNAL_PARTITION_LABEL "spiffs"
+#define JOURNAL_OFFSET 0x10000       // After the 16 sequence slots
+#define JOURNAL_SECTOR_SIZE 0x1000
+#define JOURNAL_SECTORS 4
+#define JOURNAL_SETTLE_MS 1000       // Write once the levels have been stable this long
+#define JOURNAL_MAX_DELAY_MS 5000    // ...or this long after the first unsaved change
+#define JOURNAL_ERASED 0xFFFFFFFF
+
+/**
+ * Flash journal of the output levels, restored at boot
+ *
+ * Each save appends a 16-byte record (sequence number, 8 levels, CRC-32) to
+ * a ring of JOURNAL_SECTORS flash sectors in the spiffs partition. A sector
+ * is only erased when the ring moves into it, once every 256 saves, and the
+ * erases rotate over all sectors. Saves are coalesced: a burst of commands
+ * or a fade produces one record once the levels settle, so the flash sees a
+ * few writes per scene change rather than one per CAN frame.
+ *
+ * restore() finds the newest record by reading the first record of each
+ * sector and binary-searching the newest sector for its end, so boot reads
+ * a handful of records instead of the whole ring. A record torn by a reset
+ * fails its CRC and the one before it is used.
+ */
+namespace outputJournal
+{
+    struct Record
+    {
+        uint32_t sequence;
+        uint8_t levels[8];
+        uint32_t crc;  // Over sequence and levels
+    };
+
+    static_assert(JOURNAL_SECTOR_SIZE % sizeof(Record) == 0, "Records must not straddle sectors");
+    constexpr uint32_t RECORDS_PER_SECTOR = JOURNAL_SECTOR_SIZE / sizeof(Record);
+
+    hal::FlashRegion *partition = nullptr;
+
+    // Loop task only after restore()
+    struct {
+        uint8_t sector = 0;
+        uint32_t index = 0;          // Next free record in sector
+        bool eraseFirst = true;      // sector holds data that is not ours yet
+        uint32_t sequence = 0;       // Of the last record written or restored
+        uint8_t savedLevels[8] = {0};
+        uint32_t seenGeneration = 0;
+        bool changePending = false;
+        uint32_t firstChangeMs = 0;
+        uint32_t lastChangeMs = 0;
+        uint32_t writes = 0;
+        uint32_t coalescedChanges = 0;  // Level changes that did not get a record of their own
+        uint32_t failedWrites = 0;
+    } journal;
+
+    bool restored = false;
+    uint32_t restoredUs = 0;  // hal::micros() when the levels were handed to the PWM task
+
+    uint32_t recordCrc(const Record &record)
+    {
+        return crc32::compute((const uint8_t *)&record, offsetof(Record, crc));
+    }
+
+    uint32_t recordOffset(uint8_t sector, uint32_t index)
+    {
+        return JOURNAL_OFFSET + sector * JOURNAL_SECTOR_SIZE + index * sizeof(Record);
+    }
+
+    bool readRecord(uint8_t sector, uint32_t index, Record &record)
+    {
+        return hal::flashRead(partition, recordOffset(sector, index), &record, sizeof(record));
+    }
+
+    bool isValid(const Record &record)
+    {
+        return record.sequence != JOURNAL_ERASED && record.crc == recordCrc(record);
+    }
+
+    bool isErased(const Record &record)
+    {
+        const uint8_t *bytes = (const uint8_t *)&record;
+        for (size_t i = 0; i < sizeof(record); i++) {
+            if (bytes[i] != 0xFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Find the newest record and restore its levels to the outputs
+     * Call right after pwmOutput::begin(), before anything else touches outputState
+     * @return false if there was nothing to restore
+     */
+    bool restore()
+    {
+        partition = hal::flashFind(JOURNAL_PARTITION_LABEL);
+        if (!partition || hal::flashSize(partition) < JOURNAL_OFFSET + JOURNAL_SECTORS * JOURNAL_SECTOR_SIZE) {
+            partition = nullptr;
+            return false;
+        }
+
+        // The sector whose first record is newest holds the end of the ring
+        int newest = -1;
+        Record record;
+        for (uint8_t sector = 0; sector < JOURNAL_SECTORS; sector++) {
+            if (readRecord(sector, 0, record) && isValid(record) &&
+                (newest < 0 || (int32_t)(record.sequence - journal.sequence) > 0)) {
+                newest = sector;
+                journal.sequence = record.sequence;
+            }
+        }
+        if (newest < 0) {
+            return false;
+        }
+
+        // Records are appended in order, so the written ones form a prefix of the sector
+        uint32_t low = 1;
+        uint32_t high = RECORDS_PER_SECTOR;
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (readRecord(newest, middle, record) && isErased(record)) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        journal.sector = newest;
+        journal.index = low;
+        journal.eraseFirst = false;
+
+        // Skip back over a record torn by a reset during its write
+        for (uint32_t index = low; index-- > 0;) {
+            if (readRecord(newest, index, record) && isValid(record)) {
+                journal.sequence = record.sequence;
+                memcpy(journal.savedLevels, record.levels, sizeof(journal.savedLevels));
+                outputState::set(0xFF, record.levels, nullptr);
+                journal.seenGeneration = outputState::generation();
+                restored = true;
+                restoredUs = hal::micros();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Append a record for the current levels
+     */
+    bool append(const uint8_t *levels)
+    {
+        if (journal.index >= RECORDS_PER_SECTOR) {
+            journal.sector = (journal.sector + 1) % JOURNAL_SECTORS;
+            journal.index = 0;
+            journal.eraseFirst = true;
+        }
+        if (journal.eraseFirst) {
+            if (!hal::flashErase(partition, recordOffset(journal.sector, 0), JOURNAL_SECTOR_SIZE)) {
+                return false;
+            }
+            journal.eraseFirst = false;
+        }
+
+        Record record;
+        record.sequence = journal.sequence + 1;
+        memcpy(record.levels, levels, sizeof(record.levels));
+        record.crc = recordCrc(record);
+        // A failed write still uses up the slot; the next record goes after it
+        bool ok = hal::flashWrite(partition, recordOffset(journal.sector, journal.index++), &record, sizeof(record));
+        if (ok) {
+            journal.sequence = record.sequence;
+        }
+        return ok;
+    }
+
+    /**
+     * Save the levels once they have settled
+     * Call from loop()
+     */
+    void loop()
+    {
+        if (!partition) {
+            return;
+        }
+        uint32_t now = hal::millis();
+        uint32_t generation = outputState::generation();
+        if (generation != journal.seenGeneration) {
+            journal.seenGeneration = generation;
+            bool differs = memcmp(outputState::read().levels, journal.savedLevels, 8) != 0;
+            if (differs && journal.changePending) {
+                journal.coalescedChanges++;
+            } else if (differs) {
+                journal.firstChangeMs = now;
+            }
+            journal.changePending = differs;
+            journal.lastChangeMs = now;
+        }
+
+        if (!journal.changePending || (now - journal.lastChangeMs < JOURNAL_SETTLE_MS &&
+                                       now - journal.firstChangeMs < JOURNAL_MAX_DELAY_MS)) {
+            return;
+        }
+        uint8_t levels[8];
+        memcpy(levels, outputState::read().levels, sizeof(levels));
+        if (append(levels)) {
+            memcpy(journal.savedLevels, levels, sizeof(levels));
+            journal.writes++;
+        } else {
+            journal.failedWrites++;
+        }
+        journal.changePending = false;
+    }
+
+    void print()
+    {
+        debugf("[Journal] Records written: %u (sequence %u), coalesced changes: %u, failed: %u\n",
+               journal.writes, journal.sequence, journal.coalescedChanges, journal.failedWrites);
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "hal/hal.h"
+#include "latencyStats.h"
+
+/**
+ * Requested level of all 8 outputs, shared between the CAN RX task, the
+ * sequence task and loop()
+ *
+ * Writers publish whole multi-channel updates under a spinlock, bumping a
+ * sequence counter before and after (seqlock). Readers copy without locking
+ * and retry if the counter moved, so a status frame can never carry a
+ * half-applied "all on". The PWM task is the only code that turns published
+ * levels into hardware writes; publishing just wakes it.
+ */
+namespace outputState
+{
+    // Origin of a change, for RX-to-output latency (latencyStats.h)
+    struct Stamp
+    {
+        uint32_t rxUs;      // hal::micros() when the frame reached the RX callback
+        uint16_t sourceId;  // CAN message ID, LATENCY_NO_SOURCE if not from a frame
+    };
+
+    struct Snapshot
+    {
+        uint8_t levels[8];
+        uint32_t fadeMs[8];   // Transition time requested with the last change of each channel
+        Stamp stamps[8];      // Origin of the last change of each channel
+        uint32_t generation;  // Increments once per published update
+    };
+
+    Snapshot current = {};
+    volatile uint32_t sequenceCounter = 0; // Odd while a write is in progress
+    hal::Lock writerMux = HAL_LOCK_INIT;
+    hal::Task *ownerTask = nullptr;
+
+    /**
+     * Register the task that applies published levels to the hardware
+     */
+    void setOwner(hal::Task *task)
+    {
+        ownerTask = task;
+    }
+
+    /**
+     * Copy a consistent view of all channels
+     */
+    Snapshot read()
+    {
+        Snapshot snapshot;
+        uint32_t before, after;
+        do {
+            before = __atomic_load_n(&sequenceCounter, __ATOMIC_ACQUIRE);
+            memcpy(&snapshot, (const void *)&current, sizeof(snapshot));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            after = __atomic_load_n(&sequenceCounter, __ATOMIC_RELAXED);
+        } while ((before & 1) || before != after);
+        return snapshot;
+    }
+
+    /**
+     * Generation of the last completed update, without copying the levels
+     */
+    uint32_t generation()
+    {
+        return __atomic_load_n(&sequenceCounter, __ATOMIC_ACQUIRE) >> 1;
+    }
+
+    uint8_t level(uint8_t channel)
+    {
+        return read().levels[channel];
+    }
+
+    /**
+     * Publish new levels for the masked channels as one update
+     * Safe to call with other spinlocks held; the owner is woken by notify()
+     * @return true if any channel changed
+     */
+    bool publish(uint8_t mask, const uint8_t *levels, const uint32_t *fadeMs, const Stamp *stamp = nullptr)
+    {
+        bool changed = false;
+        hal::lock(writerMux);
+        __atomic_store_n(&sequenceCounter, sequenceCounter + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        for (int ch = 0; ch < 8; ch++) {
+            if (mask & (1 << ch)) {
+                changed |= current.levels[ch] != levels[ch];
+                current.levels[ch] = levels[ch];
+                current.fadeMs[ch] = fadeMs ? fadeMs[ch] : 0;
+                current.stamps[ch] = stamp ? *stamp : Stamp{0, LATENCY_NO_SOURCE};
+            }
+        }
+        current.generation++;
+        __atomic_store_n(&sequenceCounter, sequenceCounter + 1, __ATOMIC_RELEASE);
+        hal::unlock(writerMux);
+        return changed;
+    }
+
+    /**
+     * Wake the owner task to apply the latest published levels
+     */
+    void notify()
+    {
+        hal::notify(ownerTask);
+    }
+
+    void set(uint8_t mask, const uint8_t *levels, const uint32_t *fadeMs, const Stamp *stamp = nullptr)
+    {
+        publish(mask, levels, fadeMs, stamp);
+        notify();
+    }
+
+    void setChannel(uint8_t channel, uint8_t value, uint32_t fadeMs = 0, const Stamp *stamp = nullptr)
+    {
+        uint8_t levels[8];
+        uint32_t fades[8];
+        levels[channel] = value;
+        fades[channel] = fadeMs;
+        set(1 << channel, levels, fades, stamp);
+    }
+
+    void setAll(uint8_t value, uint32_t fadeMs = 0, const Stamp *stamp = nullptr)
+    {
+        uint8_t levels[8];
+        uint32_t fades[8];
+        for (int ch = 0; ch < 8; ch++) {
+            levels[ch] = value;
+            fades[ch] = fadeMs;
+        }
+        set(0xFF, levels, fades, stamp);
+    }
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include "hal/hal.h"
+#include "globals.h"
+#include "outputState.h"
+#include "dimmingCurves.h"
+
+#define PWM_FREQUENCY_HZ 1000
+#define PWM_FADE_SEGMENT_MS 100
+#define PWM_PHASE_STAGGER 1         // 0: every channel starts its on-time at the start of the period
+#define PWM_TASK_STACK 2048
+#define PWM_TASK_PRIORITY 4
+
+/**
+ * PWM outputs on the LEDC peripheral with hardware fades
+ *
+ * Channel N drives OUTPUT_PINS[N] on LEDC channel N at 13-bit resolution,
+ * with levels mapped through the channel's dimmingCurves table. Other code
+ * never calls this module directly: it publishes levels to outputState, and the PWM task,
+ * the single owner of the peripheral, picks them up and starts hardware
+ * fades, so no caller ever blocks on the LEDC driver.
+ *
+ * The LEDC driver makes any new duty wait until a running fade finishes, so
+ * long fades are issued as PWM_FADE_SEGMENT_MS hardware segments chained from
+ * the fade-end interrupt. A new target therefore takes effect within one
+ * segment, and the CPU only runs once per segment per fading channel.
+ * Segment ends are spaced evenly in level and mapped through the curve, so a
+ * fade follows the curve piecewise instead of running linearly in duty.
+ * Where the curve is flat over a segment the duty is held on a task timer
+ * instead of a hardware fade that would not move it.
+ *
+ * All channels share one LEDC timer, so by default their on-times would all
+ * start together and the load currents would peak at once. Each channel's
+ * on-time instead starts at its own hpoint, an eighth of the period after the
+ * previous channel's, so with all 8 channels at 50% only four conduct at a
+ * time (the odd and even groups used by the sequences are spread the same
+ * way). Duties are unchanged; on-times past the end of the period wrap to
+ * its start.
+ */
+namespace pwmOutput
+{
+    // Owned by the PWM task; the fade-end interrupt only clears fading
+    struct Channel
+    {
+        uint8_t target = 0;
+        uint16_t position = 0; // Level of the last hardware write, 8.8 fixed point
+        uint32_t duty = 0;     // Duty of the last hardware write
+        uint32_t fadeMs = 0;   // Time left to reach target
+        bool pending = false;  // Target not yet handed to the hardware
+        bool holding = false;  // Waiting out a segment that does not move the duty
+        uint32_t holdUntilMs = 0;
+        outputState::Stamp stamp = {0, LATENCY_NO_SOURCE};  // Origin of target, until its first write
+        volatile bool fading = false;
+    };
+
+    /**
+     * Counter value where a channel's on-time starts
+     */
+    constexpr uint32_t phaseOffset(uint8_t ch)
+    {
+        return PWM_PHASE_STAGGER ? ch * ((PWM_MAX_DUTY + 1) / 8) : 0;
+    }
+
+    Channel channels[8];
+    uint32_t appliedGeneration = 0;
+    uint8_t refreshMask = 0;  // Channels to rewrite after a curve change (atomic)
+    hal::Task *pwmTask = nullptr;
+
+    static void IRAM_ATTR onFadeEnd(uint8_t ch)
+    {
+        channels[ch].fading = false;
+        hal::notifyFromIsr(pwmTask);
+    }
+
+    /**
+     * Hand the next piece of a pending target to the hardware
+     * Runs only on the PWM task
+     */
+    void applyChannel(uint8_t ch, uint32_t now)
+    {
+        Channel &c = channels[ch];
+        if (!c.pending || c.fading) {
+            return;
+        }
+        if (c.holding) {
+            if ((int32_t)(now - c.holdUntilMs) < 0) {
+                return;
+            }
+            c.holding = false;
+        }
+
+        uint16_t targetPosition = c.target << 8;
+        int32_t delta = (int32_t)targetPosition - (int32_t)c.position;
+        uint16_t segmentPosition = targetPosition;
+        uint32_t segmentDuty = dimmingCurves::duty(ch, targetPosition);
+        uint32_t segmentMs = delta == 0 ? 0 : c.fadeMs;
+        if (segmentMs > PWM_FADE_SEGMENT_MS) {
+            segmentMs = PWM_FADE_SEGMENT_MS;
+            segmentPosition = c.position + (int64_t)delta * segmentMs / c.fadeMs;
+            segmentDuty = dimmingCurves::duty(ch, segmentPosition);
+        }
+
+        c.fadeMs = segmentPosition == targetPosition ? 0 : c.fadeMs - segmentMs;
+        c.pending = c.fadeMs > 0;
+        c.position = segmentPosition;
+
+        if (segmentMs > 0 && segmentDuty == c.duty) {
+            // Nothing for the hardware to do; service() wakes the task when the segment is over
+            c.holding = c.pending;
+            c.holdUntilMs = now + segmentMs;
+            return;
+        }
+        if (segmentMs > 0) {
+            c.fading = true;
+            hal::pwmFade(ch, segmentDuty, segmentMs);
+        } else {
+            hal::pwmSetDuty(ch, segmentDuty);
+        }
+        c.duty = segmentDuty;
+
+        // First write for a target that came in over CAN: the output starts changing now
+        if (c.stamp.sourceId != LATENCY_NO_SOURCE) {
+            latencyStats::record(c.stamp.sourceId, hal::micros() - c.stamp.rxUs);
+            c.stamp.sourceId = LATENCY_NO_SOURCE;
+        }
+    }
+
+    /**
+     * Pick up levels published to outputState since the last pass
+     * A new target replaces whatever is left of the channel's current fade
+     */
+    void syncTargets()
+    {
+        outputState::Snapshot snapshot = outputState::read();
+        if (snapshot.generation == appliedGeneration) {
+            return;
+        }
+        appliedGeneration = snapshot.generation;
+
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            Channel &c = channels[ch];
+            if (snapshot.levels[ch] != c.target) {
+                c.target = snapshot.levels[ch];
+                c.fadeMs = snapshot.fadeMs[ch];
+                c.stamp = snapshot.stamps[ch];
+                c.pending = true;
+                c.holding = false;
+            }
+        }
+    }
+
+    /**
+     * Rewrite channels at their current level, e.g. after their curve changed
+     * Safe from any task
+     */
+    void refresh(uint8_t mask)
+    {
+        __atomic_fetch_or(&refreshMask, mask, __ATOMIC_RELAXED);
+        hal::notify(pwmTask);
+    }
+
+    /**
+     * PWM task body, runs once per notification
+     */
+    void service()
+    {
+        syncTargets();
+        uint8_t refresh = __atomic_exchange_n(&refreshMask, 0, __ATOMIC_RELAXED);
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            // A channel already on its way somewhere picks the new curve up with its next segment
+            if ((refresh & (1 << ch)) && !channels[ch].pending) {
+                channels[ch].pending = true;
+                channels[ch].fadeMs = 0;
+            }
+        }
+        uint32_t now = hal::millis();
+        uint32_t wakeMs = 0;
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            Channel &c = channels[ch];
+            applyChannel(ch, now);
+            if (c.holding) {
+                uint32_t left = c.holdUntilMs - now;
+                wakeMs = wakeMs == 0 || left < wakeMs ? left : wakeMs;
+            }
+        }
+        if (wakeMs > 0) {
+            hal::notifyAfter(pwmTask, wakeMs);
+        }
+    }
+
+    /**
+     * Configure PWM channels 0-7 on the output pins and start the PWM task
+     */
+    void begin()
+    {
+        pwmTask = hal::startTask("pwmOut", service, 0, PWM_TASK_STACK, PWM_TASK_PRIORITY, 1);
+        outputState::setOwner(pwmTask);
+        uint32_t hpoints[8];
+        for (uint8_t ch = 0; ch < 8; ch++) {
+            hpoints[ch] = phaseOffset(ch);
+        }
+        hal::pwmBegin(OUTPUT_PINS, 8, PWM_FREQUENCY_HZ, PWM_RESOLUTION_BITS, hpoints, onFadeEnd);
+        debugln("[PWM] LEDC outputs initialized");
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "outputState.h"
+#include "lightSequences.h"
+#include "wifiConfig.h"
+
+#define SCENE_ID 0x25               // CAN ID for scene save/recall (bus to module)
+#define SCENE_COUNT 16
+#define SCENE_KEY_FORMAT "scene%u"  // NVS key per slot, in the wifiConfig namespace
+
+/**
+ * Scene presets: 8 levels plus a fade time per slot
+ *
+ * Scenes live in NVS through wifiConfig's Preferences instance and are read
+ * into a RAM cache once at boot. Recall only reads the cache, so it costs the
+ * same as a bulk brightness frame; saves update the cache at once and are
+ * written to NVS from loop(), away from the RX task.
+ *
+ * CAN ID 0x25:
+ *   [0x01, slot]                 Recall slot (empty slots are ignored)
+ *   [0x02, slot, fadeLo, fadeHi] Save the current output levels to slot, recalled with the given fade (ms)
+ *   [0x03, slot]                 Delete slot
+ */
+namespace scenes
+{
+    struct Scene
+    {
+        uint8_t levels[8];
+        uint16_t fadeMs;
+    };
+
+    Scene cache[SCENE_COUNT];
+    bool present[SCENE_COUNT] = {false};
+    volatile uint16_t dirtySlots = 0;  // Slots changed in the cache, not yet written to NVS
+    hal::Lock cacheMux = HAL_LOCK_INIT;
+
+    void keyFor(uint8_t slot, char *key)
+    {
+        snprintf(key, 12, SCENE_KEY_FORMAT, slot);
+    }
+
+    /**
+     * Load all stored scenes into the cache
+     * Call after wifiConfig::init()
+     */
+    void init()
+    {
+        uint8_t loaded = 0;
+        for (uint8_t slot = 0; slot < SCENE_COUNT; slot++) {
+            char key[12];
+            keyFor(slot, key);
+            present[slot] = wifiConfig::preferences.isKey(key) &&
+                            wifiConfig::preferences.getBytes(key, &cache[slot], sizeof(Scene)) == sizeof(Scene);
+            loaded += present[slot];
+        }
+        debugf("[Scenes] %d stored scenes loaded\n", loaded);
+    }
+
+    /**
+     * Apply a cached scene
+     * @return false if the slot is empty
+     */
+    bool recall(uint8_t slot, const outputState::Stamp *stamp = nullptr)
+    {
+        if (slot >= SCENE_COUNT) {
+            return false;
+        }
+        uint32_t fades[8];
+        Scene scene;
+        hal::lock(cacheMux);
+        bool found = present[slot];
+        scene = cache[slot];
+        hal::unlock(cacheMux);
+        if (!found) {
+            return false;
+        }
+
+        for (int ch = 0; ch < 8; ch++) {
+            fades[ch] = scene.fadeMs;
+        }
+        lightSequences::releaseChannels(0xFF);
+        outputState::set(0xFF, scene.levels, fades, stamp);
+        return true;
+    }
+
+    /**
+     * Store the current output levels in a slot
+     */
+    bool save(uint8_t slot, uint16_t fadeMs)
+    {
+        if (slot >= SCENE_COUNT) {
+            return false;
+        }
+        Scene scene;
+        memcpy(scene.levels, outputState::read().levels, sizeof(scene.levels));
+        scene.fadeMs = fadeMs;
+
+        hal::lock(cacheMux);
+        cache[slot] = scene;
+        present[slot] = true;
+        dirtySlots |= 1 << slot;
+        hal::unlock(cacheMux);
+        return true;
+    }
+
+    bool remove(uint8_t slot)
+    {
+        if (slot >= SCENE_COUNT) {
+            return false;
+        }
+        hal::lock(cacheMux);
+        present[slot] = false;
+        dirtySlots |= 1 << slot;
+        hal::unlock(cacheMux);
+        return true;
+    }
+
+    /**
+     * Handle scene message (ID 0x25)
+     */
+    void handleCanMessage(const uint8_t *data, uint8_t length, const outputState::Stamp *stamp)
+    {
+        uint8_t slot = data[1];
+        switch (data[0]) {
+            case 0x01:  // Recall
+                if (!recall(slot, stamp)) {
+                    tracef("[Scenes] Slot %d is empty", slot);
+                }
+                break;
+            case 0x02:  // Save
+                save(slot, length >= 4 ? (data[2] | (data[3] << 8)) : 0);
+                break;
+            case 0x03:  // Delete
+                remove(slot);
+                break;
+            default:
+                tracef("[Scenes] Unknown message type: 0x%02X", data[0]);
+        }
+    }
+
+    /**
+     * Write changed slots to NVS
+     * Call from loop()
+     */
+    void loop()
+    {
+        if (!dirtySlots) {
+            return;
+        }
+        for (uint8_t slot = 0; slot < SCENE_COUNT; slot++) {
+            hal::lock(cacheMux);
+            bool dirty = dirtySlots & (1 << slot);
+            bool keep = present[slot];
+            Scene scene = cache[slot];
+            dirtySlots &= ~(1 << slot);
+            hal::unlock(cacheMux);
+            if (!dirty) {
+                continue;
+            }
+
+            char key[12];
+            keyFor(slot, key);
+            if (keep) {
+                if (wifiConfig::preferences.putBytes(key, &scene, sizeof(Scene)) == sizeof(Scene)) {
+                    debugf("[Scenes] Slot %d saved\n", slot);
+                } else {
+                    debugf("[Scenes] Slot %d write FAILED\n", slot);
+                }
+            } else {
+                wifiConfig::preferences.remove(key);
+                debugf("[Scenes] Slot %d deleted\n", slot);
+            }
+        }
+    }
+}
@@ -0,0 +1,338 @@
+#pragma once
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "crc32.h"
+#include "canTx.h"
+#include "nodeAddress.h"
+#include "lightSequences.h"
+
+#define SEQUENCE_UPLOAD_ID 31      // CAN ID for sequence upload messages (bus to module)
+#define SEQUENCE_UPLOAD_ACK_ID 0x1C // CAN ID for upload acknowledgements (module to bus)
+#define SEQUENCE_PARTITION_LABEL "spiffs"
+#define SEQUENCE_SLOT_COUNT 16
+#define SEQUENCE_SLOT_SIZE 0x1000   // One flash sector per slot
+#define SEQUENCE_SLOT_MAGIC 0x51534354 // "TCSQ"
+#define SEQUENCE_MAX_BYTES (255 * sizeof(lightSequences::Keyframe))
+#define SEQUENCE_CHUNK_BYTES 6
+#define SEQUENCE_UPLOAD_WINDOW 8
+#define SEQUENCE_UPLOAD_TIMEOUT_MS 5000
+#define SEQUENCE_NO_PLAY_REQUEST 0xFF
+
+/**
+ * Custom keyframe sequences uploaded over CAN and stored in the spiffs partition
+ *
+ * Upload protocol (CAN ID 31), modeled on the wifiConfig multi-message scheme:
+ *   0x01 Start: [0x01, slot, lenLo, lenHi, crc0, crc1, crc2, crc3] (CRC-32 of the blob, little-endian)
+ *   0x02 Chunk: [0x02, chunkIndex, up to 6 blob bytes]
+ *   0x03 End:   [0x03] - verify CRC, validate keyframes and commit to flash
+ *   0x04 Abort: [0x04] - answered UPLOAD_BUSY once an End is being committed
+ *
+ * Every message is answered on CAN ID 0x1C with [type, status, slot, nextChunk].
+ * Chunks are acknowledged once per SEQUENCE_UPLOAD_WINDOW in-order chunks; an
+ * out-of-order or duplicate chunk is answered immediately with the next chunk
+ * expected, so the sender can resume from there (go-back-N).
+ *
+ * The blob is a table of packed lightSequences::Keyframe (4 bytes each, timing
+ * little-endian). Stored slots play through CAN ID 30 with byte 0 = 0x10 + slot.
+ */
+namespace sequenceStore
+{
+    enum UploadStatus : uint8_t
+    {
+        UPLOAD_OK = 0x00,
+        UPLOAD_BAD_SLOT = 0x01,
+        UPLOAD_BAD_LENGTH = 0x02,
+        UPLOAD_NOT_STARTED = 0x03,
+        UPLOAD_MISSING_CHUNKS = 0x04,
+        UPLOAD_CRC_MISMATCH = 0x05,
+        UPLOAD_INVALID_SEQUENCE = 0x06,
+        UPLOAD_FLASH_ERROR = 0x07,
+        UPLOAD_TIMEOUT = 0x08,
+        UPLOAD_BUSY = 0x09,
+    };
+
+    struct SlotHeader
+    {
+        uint32_t magic;
+        uint16_t length;
+        uint16_t reserved;
+        uint32_t crc;
+    };
+
+    hal::FlashRegion *partition = nullptr;
+
+    // State machine for receiving a multi-message upload
+    struct
+    {
+        bool receiving = false;
+        volatile bool commitPending = false; // End received, flash write deferred to loop()
+        uint8_t slot = 0;
+        uint16_t length = 0;
+        uint32_t crc = 0;
+        uint8_t chunks = 0;
+        uint8_t nextChunk = 0;
+        uint8_t sinceAck = 0;
+        bool resyncSent = false;
+        unsigned long lastMessageTime = 0;
+    } upload;
+
+    uint8_t uploadBuffer[SEQUENCE_MAX_BYTES];
+
+    // RAM copies of stored sequences: a slot loads into the buffer not being played,
+    // so a sequence tick still walking the old one never sees it change
+    lightSequences::Keyframe loadedFrames[2][255];
+    lightSequences::Sequence loadedSequences[2] = {{loadedFrames[0], 0, 0}, {loadedFrames[1], 0, 0}};
+    uint8_t playingBuffer = 0;
+
+    volatile uint8_t playRequest = SEQUENCE_NO_PLAY_REQUEST; // Slot to play, deferred to loop()
+
+    /**
+     * Find the spiffs partition used for sequence slots
+     */
+    void init()
+    {
+        partition = hal::flashFind(SEQUENCE_PARTITION_LABEL);
+        if (partition && hal::flashSize(partition) >= SEQUENCE_SLOT_COUNT * SEQUENCE_SLOT_SIZE) {
+            debugf("[SeqStore] Using partition '%s'\n", SEQUENCE_PARTITION_LABEL);
+        } else {
+            partition = nullptr;
+            debugln("[SeqStore] ERROR: No usable spiffs partition - uploads disabled");
+        }
+    }
+
+    void sendAck(uint8_t type, UploadStatus status)
+    {
+        twai_message_t message;
+        message.identifier = nodeAddress::id(SEQUENCE_UPLOAD_ACK_ID);
+        message.extd = false;
+        message.rtr = false;
+        message.data_length_code = 4;
+        message.data[0] = type;
+        message.data[1] = status;
+        message.data[2] = upload.slot;
+        message.data[3] = upload.nextChunk;
+        canTx::send(message, canTx::TX_ACK);
+    }
+
+    /**
+     * Handle upload start message (0x01)
+     */
+    void handleStartMessage(const uint8_t *data, uint8_t length) {
+        if (upload.commitPending) {
+            sendAck(0x01, UPLOAD_BUSY);
+            return;
+        }
+
+        upload.receiving = false;
+        upload.slot = data[1];
+        upload.nextChunk = 0;
+
+        if (length < 8) {
+            sendAck(0x01, UPLOAD_BAD_LENGTH);
+            return;
+        }
+        if (!partition || upload.slot >= SEQUENCE_SLOT_COUNT) {
+            sendAck(0x01, UPLOAD_BAD_SLOT);
+            return;
+        }
+
+        upload.length = data[2] | (data[3] << 8);
+        upload.crc = (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+        if (upload.length == 0 || upload.length > SEQUENCE_MAX_BYTES ||
+            upload.length % sizeof(lightSequences::Keyframe) != 0) {
+            tracef("[SeqStore] ERROR: Invalid blob length %d", upload.length);
+            sendAck(0x01, UPLOAD_BAD_LENGTH);
+            return;
+        }
+
+        upload.chunks = (upload.length + SEQUENCE_CHUNK_BYTES - 1) / SEQUENCE_CHUNK_BYTES;
+        upload.sinceAck = 0;
+        upload.resyncSent = false;
+        upload.receiving = true;
+        upload.lastMessageTime = hal::millis();
+
+        tracef("[SeqStore] Upload to slot %d: %d bytes in %d chunks", upload.slot, upload.length, upload.chunks);
+        sendAck(0x01, UPLOAD_OK);
+    }
+
+    /**
+     * Handle upload chunk message (0x02)
+     */
+    void handleChunk(const uint8_t *data, uint8_t length) {
+        if (!upload.receiving || upload.commitPending) {
+            sendAck(0x02, UPLOAD_NOT_STARTED);
+            return;
+        }
+
+        uint8_t chunkIndex = data[1];
+        upload.lastMessageTime = hal::millis();
+
+        if (chunkIndex != upload.nextChunk) {
+            // Lost or repeated chunk - tell the sender where to resume, once per gap
+            if (!upload.resyncSent) {
+                upload.resyncSent = true;
+                sendAck(0x02, UPLOAD_OK);
+            }
+            return;
+        }
+
+        uint16_t offset = chunkIndex * SEQUENCE_CHUNK_BYTES;
+        for (int i = 0; i < SEQUENCE_CHUNK_BYTES && i + 2 < length && (offset + i) < upload.length; i++) {
+            uploadBuffer[offset + i] = data[2 + i];
+        }
+
+        upload.nextChunk++;
+        upload.resyncSent = false;
+        if (++upload.sinceAck >= SEQUENCE_UPLOAD_WINDOW || upload.nextChunk == upload.chunks) {
+            upload.sinceAck = 0;
+            sendAck(0x02, UPLOAD_OK);
+        }
+    }
+
+    /**
+     * Handle upload end message (0x03)
+     * Verifies the blob; the flash commit runs from loop() so the RX task never waits on an erase
+     */
+    void handleEndMessage() {
+        if (!upload.receiving || upload.commitPending) {
+            sendAck(0x03, UPLOAD_NOT_STARTED);
+            return;
+        }
+
+        if (upload.nextChunk != upload.chunks) {
+            tracef("[SeqStore] ERROR: Missing chunks (%d/%d)", upload.nextChunk, upload.chunks);
+            sendAck(0x03, UPLOAD_MISSING_CHUNKS);
+            return;
+        }
+
+        uint32_t crc = crc32::compute(uploadBuffer, upload.length);
+        if (crc != upload.crc) {
+            tracef("[SeqStore] ERROR: CRC mismatch (expected: 0x%08X, got: 0x%08X)", upload.crc, crc);
+            upload.receiving = false;
+            sendAck(0x03, UPLOAD_CRC_MISMATCH);
+            return;
+        }
+
+        if (!lightSequences::isValid((const lightSequences::Keyframe *)uploadBuffer,
+                                     upload.length / sizeof(lightSequences::Keyframe))) {
+            tracef("[SeqStore] ERROR: Blob is not a valid keyframe table");
+            upload.receiving = false;
+            sendAck(0x03, UPLOAD_INVALID_SEQUENCE);
+            return;
+        }
+
+        upload.commitPending = true;
+    }
+
+    /**
+     * Handle incoming sequence upload CAN message
+     * Routes to appropriate handler based on message type
+     */
+    void handleCanMessage(const uint8_t *data, uint8_t length) {
+        if (length < 1) return;
+
+        switch (data[0]) {
+            case 0x01:  // Start
+                handleStartMessage(data, length);
+                break;
+            case 0x02:  // Chunk
+                if (length >= 3) handleChunk(data, length);
+                break;
+            case 0x03:  // End/Commit
+                handleEndMessage();
+                break;
+            case 0x04:  // Abort
+                if (upload.commitPending) {
+                    sendAck(0x04, UPLOAD_BUSY);  // Too late, the blob is being written
+                    break;
+                }
+                upload.receiving = false;
+                sendAck(0x04, UPLOAD_OK);
+                break;
+            default:
+                tracef("[SeqStore] Unknown message type: 0x%02X", data[0]);
+        }
+    }
+
+    /**
+     * Write a verified blob into its slot
+     */
+    bool writeSlot(uint8_t slot, const uint8_t *blob, uint16_t length, uint32_t crc) {
+        SlotHeader header = {SEQUENCE_SLOT_MAGIC, length, 0, crc};
+        size_t offset = slot * SEQUENCE_SLOT_SIZE;
+
+        return hal::flashErase(partition, offset, SEQUENCE_SLOT_SIZE) &&
+               hal::flashWrite(partition, offset + sizeof(header), blob, length) &&
+               hal::flashWrite(partition, offset, &header, sizeof(header));
+    }
+
+    /**
+     * Load a stored slot and start playing it
+     * The slot is fully verified before it replaces the running sequence
+     * @return false if the slot is empty or fails verification
+     */
+    bool play(uint8_t slot) {
+        if (!partition || slot >= SEQUENCE_SLOT_COUNT) {
+            return false;
+        }
+
+        SlotHeader header;
+        size_t offset = slot * SEQUENCE_SLOT_SIZE;
+        if (!hal::flashRead(partition, offset, &header, sizeof(header)) ||
+            header.magic != SEQUENCE_SLOT_MAGIC || header.length == 0 || header.length > SEQUENCE_MAX_BYTES ||
+            header.length % sizeof(lightSequences::Keyframe) != 0) {
+            debugf("[SeqStore] Slot %d is empty\n", slot);
+            return false;
+        }
+
+        uint8_t buffer = 1 - playingBuffer;
+        lightSequences::Keyframe *frames = loadedFrames[buffer];
+        if (!hal::flashRead(partition, offset + sizeof(header), frames, header.length) ||
+            crc32::compute((const uint8_t *)frames, header.length) != header.crc) {
+            debugf("[SeqStore] Slot %d failed CRC check\n", slot);
+            return false;
+        }
+
+        size_t count = header.length / sizeof(lightSequences::Keyframe);
+        if (!lightSequences::isValid(frames, count)) {
+            debugf("[SeqStore] Slot %d is not a valid keyframe table\n", slot);
+            return false;
+        }
+
+        loadedSequences[buffer] = lightSequences::compile(frames, count);
+        playingBuffer = buffer;
+        lightSequences::play(loadedSequences[buffer]);
+        return true;
+    }
+
+    /**
+     * Queue a stored slot for playback from loop(), so the RX task never waits on flash
+     * SEQUENCE_NO_PLAY_REQUEST withdraws a request not yet started
+     */
+    void requestPlay(uint8_t slot) {
+        __atomic_store_n(&playRequest, slot, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * Start a requested slot, commit a finished upload and expire stalled ones
+     * Call from loop()
+     */
+    void loop() {
+        uint8_t slot = __atomic_exchange_n(&playRequest, SEQUENCE_NO_PLAY_REQUEST, __ATOMIC_ACQUIRE);
+        if (slot != SEQUENCE_NO_PLAY_REQUEST) {
+            play(slot);
+        }
+
+        if (upload.commitPending) {
+            bool ok = writeSlot(upload.slot, uploadBuffer, upload.length, upload.crc);
+            debugf("[SeqStore] Slot %d %s\n", upload.slot, ok ? "saved" : "write FAILED");
+            upload.receiving = false;
+            upload.commitPending = false;
+            sendAck(0x03, ok ? UPLOAD_OK : UPLOAD_FLASH_ERROR);
+        } else if (upload.receiving && (hal::millis() - upload.lastMessageTime > SEQUENCE_UPLOAD_TIMEOUT_MS)) {
+            debugln("[SeqStore] Timeout - resetting state");
+            upload.receiving = false;
+            sendAck(0x02, UPLOAD_TIMEOUT);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "hal/hal.h"
+
+namespace sha256
+{
+    typedef hal::Sha256 Context;
+
+    /**
+     * SHA-256 (FIPS 180-4), incremental: init(), update() per piece, final()
+     */
+    void init(Context &ctx)
+    {
+        hal::sha256Begin(ctx);
+    }
+
+    void update(Context &ctx, const uint8_t *data, size_t length)
+    {
+        hal::sha256Update(ctx, data, length);
+    }
+
+    /**
+     * Write the 32-byte digest
+     */
+    void final(Context &ctx, uint8_t *digest)
+    {
+        hal::sha256Finish(ctx, digest);
+    }
+
+    void compute(const uint8_t *data, size_t length, uint8_t *digest)
+    {
+        Context ctx;
+        init(ctx);
+        update(ctx, data, length);
+        final(ctx, digest);
+    }
+}
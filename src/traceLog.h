@@ -0,0 +1,169 @@
+#pragma once
+#include <type_traits>
+#include "hal/hal.h"
+
+#ifndef TRACE_DEFERRED
+#define TRACE_DEFERRED 1           // 0: tracef() prints synchronously like debugf
+#endif
+#define TRACE_RING_SIZE 64          // Records; must be a power of two
+#define TRACE_MAX_ARGS 4
+#define TRACE_DRAIN_MS 20
+#define TRACE_TASK_STACK 3072
+#define TRACE_TASK_PRIORITY 1
+#define TRACE_LINE_LENGTH 160
+
+/**
+ * Deferred binary logging for hot paths (CAN RX/TX callbacks, handlers)
+ *
+ * tracef(format, args...) stores a 24-byte record - timestamp, the address of
+ * the format literal as its ID, and up to four integer arguments - in a RAM
+ * ring. A low-priority task formats and prints the records, so logging from
+ * a callback costs a few stores instead of milliseconds of UART time.
+ *
+ * The ring is a bounded multi-producer queue with a sequence number per cell
+ * (no locks), safe from any task or interrupt. When it is full new records
+ * are dropped and counted. Arguments must be integers or enums (no %s), and
+ * lines get a newline appended.
+ *
+ * Compiled out with DEBUG=0; with TRACE_DEFERRED=0 it prints immediately.
+ */
+namespace traceLog
+{
+    struct Record
+    {
+        uint32_t timestampUs;
+        const char *format;
+        uint8_t argCount;
+        uint32_t args[TRACE_MAX_ARGS];
+    };
+
+    struct Cell
+    {
+        uint32_t sequenceOffset;  // Cell sequence minus cell index, so zero-initialized cells are ready
+        Record record;
+    };
+
+    static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "TRACE_RING_SIZE must be a power of two");
+
+    Cell ring[TRACE_RING_SIZE];
+    uint32_t writePosition = 0;
+    uint32_t readPosition = 0;        // Drain side only
+    volatile uint32_t droppedRecords = 0;
+    uint32_t reportedDrops = 0;
+    hal::Task *drainTask = nullptr;
+
+    uint32_t loadSequence(uint32_t index)
+    {
+        return __atomic_load_n(&ring[index].sequenceOffset, __ATOMIC_ACQUIRE) + index;
+    }
+
+    void storeSequence(uint32_t index, uint32_t sequence)
+    {
+        __atomic_store_n(&ring[index].sequenceOffset, sequence - index, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * Append a record
+     * @return false if the ring was full (the record is counted as dropped)
+     */
+    bool IRAM_ATTR write(const char *format, uint8_t argCount, const uint32_t *args)
+    {
+        uint32_t position = __atomic_load_n(&writePosition, __ATOMIC_RELAXED);
+        uint32_t index;
+        for (;;) {
+            index = position & (TRACE_RING_SIZE - 1);
+            int32_t difference = (int32_t)(loadSequence(index) - position);
+            if (difference == 0) {
+                if (__atomic_compare_exchange_n(&writePosition, &position, position + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                __atomic_fetch_add(&droppedRecords, 1, __ATOMIC_RELAXED);
+                return false;
+            } else {
+                position = __atomic_load_n(&writePosition, __ATOMIC_RELAXED);
+            }
+        }
+
+        Record &record = ring[index].record;
+        record.timestampUs = hal::micros();
+        record.format = format;
+        record.argCount = argCount;
+        for (uint8_t i = 0; i < argCount; i++) {
+            record.args[i] = args[i];
+        }
+        storeSequence(index, position + 1);
+        return true;
+    }
+
+    /**
+     * Take the oldest complete record
+     * Single consumer: the drain task, or dump() with the task not running
+     */
+    bool read(Record &record)
+    {
+        uint32_t index = readPosition & (TRACE_RING_SIZE - 1);
+        if (loadSequence(index) != readPosition + 1) {
+            return false;
+        }
+        record = ring[index].record;
+        storeSequence(index, readPosition + TRACE_RING_SIZE);
+        readPosition++;
+        return true;
+    }
+
+    void print(const Record &record)
+    {
+        char line[TRACE_LINE_LENGTH];
+        int prefix = snprintf(line, sizeof(line), "%lu.%03lu ", (unsigned long)(record.timestampUs / 1000000),
+                              (unsigned long)(record.timestampUs / 1000 % 1000));
+        const uint32_t *a = record.args;
+        snprintf(line + prefix, sizeof(line) - prefix, record.format, a[0], a[1], a[2], a[3]);
+        debugln(line);
+    }
+
+    /**
+     * Print every record in the ring
+     * Runs on the drain task; call directly to flush before a restart
+     */
+    void dump()
+    {
+        Record record;
+        while (read(record)) {
+            print(record);
+        }
+        uint32_t dropped = droppedRecords;
+        if (dropped != reportedDrops) {
+            debugf("[TRACE] %u records dropped (ring full)\n", dropped - reportedDrops);
+            reportedDrops = dropped;
+        }
+    }
+
+    /**
+     * Start the drain task
+     * Records written before this are kept and printed on the first pass
+     */
+    void begin()
+    {
+        drainTask = hal::startTask("trace", dump, TRACE_DRAIN_MS, TRACE_TASK_STACK, TRACE_TASK_PRIORITY, 0);
+    }
+
+    template <typename... Args>
+    inline void writeArgs(const char *format, Args... args)
+    {
+        static_assert(sizeof...(Args) <= TRACE_MAX_ARGS, "tracef() takes at most TRACE_MAX_ARGS arguments");
+        static_assert(((std::is_integral<Args>::value || std::is_enum<Args>::value) && ...),
+                      "tracef() arguments must be integers");
+        uint32_t packed[TRACE_MAX_ARGS + 1] = {(uint32_t)args...};
+        write(format, sizeof...(Args), packed);
+    }
+}
+
+#if DEBUG == 1 && TRACE_DEFERRED
+#define tracef(...) traceLog::writeArgs(__VA_ARGS__)
+#elif DEBUG == 1
+#define tracef(format, ...) debugf(format "\n", ##__VA_ARGS__)
+#else
+#define tracef(...)
+#endif
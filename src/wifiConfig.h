@@ -1,35 +1,48 @@
 #pragma once
-#include <Preferences.h>
-#include <Arduino.h>
-#include <debug.h>
+#include "hal/hal.h"
+#include "traceLog.h"
+#include "isoTp.h"
+#include "nodeAddress.h"
 
 #define WIFI_CONFIG_NAMESPACE "wifi_config"
 #define WIFI_SSID_KEY "ssid"
 #define WIFI_PASSWORD_KEY "password"
-#define WIFI_CONFIG_TIMEOUT_MS 5000
-
+#define WIFI_CONFIG_ID 0x01              // ISO-TP provisioning requests (bus to module)
+#define WIFI_CONFIG_RESPONSE_ID 0x20     // ISO-TP flow control and replies (module to bus)
+
+/**
+ * WiFi credentials in NVS, provisioned over CAN
+ *
+ * Provisioning runs on an ISO-TP link (isoTp.h): the head unit sends one
+ * message on the node's WIFI_CONFIG_ID, the module answers flow control and
+ * the result on WIFI_CONFIG_RESPONSE_ID. Lost frames are caught by the
+ * transport, so a transfer either arrives whole or is reported as failed.
+ * The NVS write and the reply are deferred to loop(), off the RX task.
+ */
 namespace wifiConfig {
-    Preferences preferences;
+    enum ProvisionStatus : uint8_t {
+        PROVISION_SAVED = 0x00,
+        PROVISION_MALFORMED = 0x01,
+        PROVISION_SAVE_FAILED = 0x02,
+        PROVISION_BUSY = 0x03,
+    };
+
+    const uint8_t PROVISION_SET_CREDENTIALS = 0x01;
+
+    hal::Nvs preferences;
+    isoTp::Link link;
+
+    // Credentials from the RX task, waiting for loop() to store them
+    struct {
+        volatile bool pending = false;
+        char ssid[33];
+        char password[64];
+    } received;
 
     // Callback pointers for runtime credentials (set by main.cpp)
     char* runtimeSsidPtr = nullptr;
     char* runtimePasswordPtr = nullptr;
 
-    // State machine for receiving multi-message config
-    struct {
-        bool receiving = false;
-        uint8_t ssidLen = 0;
-        uint8_t passwordLen = 0;
-        uint8_t ssidChunks = 0;
-        uint8_t passwordChunks = 0;
-        uint8_t receivedSsidChunks = 0;
-        uint8_t receivedPasswordChunks = 0;
-        char ssidBuffer[33] = {0};      // 32 + null terminator
-        char passwordBuffer[64] = {0};  // 63 + null terminator
-        uint8_t expectedChecksum = 0;
-        unsigned long lastMessageTime = 0;
-    } state;
-
     /**
      * Set pointers to runtime credential buffers
      * Allows wifiConfig to update live credentials when new ones are received
@@ -61,18 +74,15 @@ namespace wifiConfig {
             return false;
         }
 
-        String ssidStr = preferences.getString(WIFI_SSID_KEY, "");
-        String passwordStr = preferences.getString(WIFI_PASSWORD_KEY, "");
-
-        if (ssidStr.length() == 0) {
+        if (preferences.getString(WIFI_SSID_KEY, ssid, 33) <= 1) {
+            ssid[0] = '\0';
             debugln("[WiFi Config] Empty SSID in NVS");
             return false;
         }
 
-        strncpy(ssid, ssidStr.c_str(), 32);
-        ssid[32] = '\0';
-        strncpy(password, passwordStr.c_str(), 63);
-        password[63] = '\0';
+        if (preferences.getString(WIFI_PASSWORD_KEY, password, 64) == 0) {
+            password[0] = '\0';
+        }
 
         debugf("[WiFi Config] Loaded SSID: %s\n", ssid);
         return true;
@@ -81,14 +91,18 @@ namespace wifiConfig {
     /**
      * Save WiFi credentials to NVS and update runtime buffers
      * @param ssid SSID to store
-     * @param password Password to store
-     * @return true if successful
+     * @param password Password to store (may be empty)
+     * @return true if successful, false if NVS stored fewer bytes than given
      */
     bool saveCredentials(const char* ssid, const char* password) {
         debugf("[WiFi Config] Saving SSID: %s\n", ssid);
 
-        preferences.putString(WIFI_SSID_KEY, ssid);
-        preferences.putString(WIFI_PASSWORD_KEY, password);
+        // putString() returns the bytes written, so an empty password legitimately writes 0
+        if (preferences.putString(WIFI_SSID_KEY, ssid) != strlen(ssid) ||
+            preferences.putString(WIFI_PASSWORD_KEY, password) != strlen(password)) {
+            debugln("[WiFi Config] ERROR: Failed to write credentials to NVS");
+            return false;
+        }
 
         debugln("[WiFi Config] Credentials saved to NVS");
 
@@ -105,173 +119,72 @@ namespace wifiConfig {
     }
 
     /**
-     * Handle WiFi config start message (0x01)
+     * Handle a provisioning message (complete ISO-TP payload)
+     * [0x01, SSID length, SSID, password] - the password is the rest of the message
+     * Answered with [0x01, status]
      */
-    void handleStartMessage(const uint8_t* data) {
-        debugln("[WiFi Config] Start message received");
-
-        // Reset state
-        memset(&state, 0, sizeof(state));
-        state.receiving = true;
-        state.ssidLen = data[1];
-        state.passwordLen = data[2];
-        state.ssidChunks = data[3];
-        state.passwordChunks = data[4];
-        state.lastMessageTime = millis();
+    void handleMessage(const uint8_t* data, uint16_t length) {
+        uint8_t reply[2] = {data[0], PROVISION_MALFORMED};
 
-        debugf("[WiFi Config] Expecting SSID: %d bytes in %d chunks\n",
-               state.ssidLen, state.ssidChunks);
-        debugf("[WiFi Config] Expecting Password: %d bytes in %d chunks\n",
-               state.passwordLen, state.passwordChunks);
-    }
-
-    /**
-     * Handle SSID chunk message (0x02)
-     */
-    void handleSsidChunk(const uint8_t* data) {
-        if (!state.receiving) {
-            debugln("[WiFi Config] ERROR: SSID chunk without start message");
-            return;
-        }
-
-        uint8_t chunkIndex = data[1];
-        uint8_t offset = chunkIndex * 6;
-
-        // Validate chunk index
-        if (chunkIndex >= state.ssidChunks) {
-            debugf("[WiFi Config] ERROR: Invalid SSID chunk index: %d (expected 0-%d)\n",
-                   chunkIndex, state.ssidChunks - 1);
+        if (data[0] != PROVISION_SET_CREDENTIALS) {
+            tracef("[WiFi Config] Unknown message type: 0x%02X", data[0]);
+            isoTp::send(link, reply, sizeof(reply));
             return;
         }
 
-        debugf("[WiFi Config] SSID chunk %d/%d\n", chunkIndex + 1, state.ssidChunks);
-
-        // Copy up to 6 bytes (8-byte CAN frame minus 2-byte header)
-        for (int i = 0; i < 6 && (offset + i) < state.ssidLen; i++) {
-            state.ssidBuffer[offset + i] = data[2 + i];
-        }
-
-        state.receivedSsidChunks++;
-        state.lastMessageTime = millis();
-    }
-
-    /**
-     * Handle password chunk message (0x03)
-     */
-    void handlePasswordChunk(const uint8_t* data) {
-        if (!state.receiving) {
-            debugln("[WiFi Config] ERROR: Password chunk without start message");
+        uint8_t ssidLen = length >= 2 ? data[1] : 0;
+        int passwordLen = length - 2 - ssidLen;
+        if (ssidLen == 0 || ssidLen > 32 || passwordLen < 0 || passwordLen > 63) {
+            tracef("[WiFi Config] ERROR: Bad lengths (message: %d, SSID: %d)", length, ssidLen);
+            isoTp::send(link, reply, sizeof(reply));
             return;
         }
 
-        uint8_t chunkIndex = data[1];
-        uint8_t offset = chunkIndex * 6;
-
-        // Validate chunk index
-        if (chunkIndex >= state.passwordChunks) {
-            debugf("[WiFi Config] ERROR: Invalid password chunk index: %d (expected 0-%d)\n",
-                   chunkIndex, state.passwordChunks - 1);
+        if (received.pending) {
+            tracef("[WiFi Config] ERROR: Previous credentials not stored yet");
+            reply[1] = PROVISION_BUSY;
+            isoTp::send(link, reply, sizeof(reply));
             return;
         }
 
-        debugf("[WiFi Config] Password chunk %d/%d\n", chunkIndex + 1, state.passwordChunks);
+        memcpy(received.ssid, data + 2, ssidLen);
+        received.ssid[ssidLen] = '\0';
+        memcpy(received.password, data + 2 + ssidLen, passwordLen);
+        received.password[passwordLen] = '\0';
 
-        // Copy up to 6 bytes (8-byte CAN frame minus 2-byte header)
-        for (int i = 0; i < 6 && (offset + i) < state.passwordLen; i++) {
-            state.passwordBuffer[offset + i] = data[2 + i];
-        }
-
-        state.receivedPasswordChunks++;
-        state.lastMessageTime = millis();
+        tracef("[WiFi Config] Credentials received (SSID: %d bytes, password: %d bytes)", ssidLen, passwordLen);
+        received.pending = true;  // Stored and answered from loop()
     }
 
     /**
-     * Handle WiFi config end message (0x04)
-     * Validates checksum and commits to NVS
+     * Set the link's IDs from the node address
+     * Call after nodeAddress::init(), before the CAN driver starts
      */
-    void handleEndMessage(const uint8_t* data) {
-        if (!state.receiving) {
-            debugln("[WiFi Config] ERROR: End message without start message");
-            return;
-        }
-
-        uint8_t receivedChecksum = data[1];
-
-        // Verify all chunks received
-        if (state.receivedSsidChunks != state.ssidChunks ||
-            state.receivedPasswordChunks != state.passwordChunks) {
-            debugf("[WiFi Config] ERROR: Missing chunks (SSID: %d/%d, Password: %d/%d)\n",
-                   state.receivedSsidChunks, state.ssidChunks,
-                   state.receivedPasswordChunks, state.passwordChunks);
-            state.receiving = false;
-            return;
-        }
-
-        // Calculate checksum
-        uint8_t checksum = 0;
-        for (int i = 0; i < state.ssidLen; i++) {
-            checksum ^= state.ssidBuffer[i];
-        }
-        for (int i = 0; i < state.passwordLen; i++) {
-            checksum ^= state.passwordBuffer[i];
-        }
-
-        if (checksum != receivedChecksum) {
-            debugf("[WiFi Config] ERROR: Checksum mismatch (expected: 0x%02X, got: 0x%02X)\n",
-                   receivedChecksum, checksum);
-            state.receiving = false;
-            return;
-        }
-
-        // Null-terminate strings
-        state.ssidBuffer[state.ssidLen] = '\0';
-        state.passwordBuffer[state.passwordLen] = '\0';
-
-        // Save to NVS
-        if (saveCredentials(state.ssidBuffer, state.passwordBuffer)) {
-            debugln("[WiFi Config] ✓ Successfully saved and verified credentials");
-        } else {
-            debugln("[WiFi Config] ERROR: Failed to save credentials");
-        }
-
-        state.receiving = false;
+    void beginTransport() {
+        link.txId = nodeAddress::id(WIFI_CONFIG_RESPONSE_ID);
+        link.onReceive = handleMessage;
     }
 
     /**
-     * Handle incoming WiFi config CAN message
-     * Routes to appropriate handler based on message type
+     * Handle an ISO-TP frame on this node's WIFI_CONFIG_ID
      */
-    void handleCanMessage(const uint8_t* data, uint8_t length) {
-        if (length < 1) return;
-
-        uint8_t messageType = data[0];
-
-        switch (messageType) {
-            case 0x01:  // Start
-                handleStartMessage(data);
-                break;
-            case 0x02:  // SSID chunk
-                handleSsidChunk(data);
-                break;
-            case 0x03:  // Password chunk
-                handlePasswordChunk(data);
-                break;
-            case 0x04:  // End/Commit
-                handleEndMessage(data);
-                break;
-            default:
-                debugf("[WiFi Config] Unknown message type: 0x%02X\n", messageType);
-        }
+    void handleCanMessage(const twai_message_t& message) {
+        isoTp::receive(link, message);
     }
 
     /**
-     * Check for timeout on incomplete sequences
-     * Resets state machine if no messages received for WIFI_CONFIG_TIMEOUT_MS
+     * Store received credentials, pace outgoing frames and time out a stalled transfer
+     * Call from loop()
      */
-    void checkTimeout() {
-        if (state.receiving && (millis() - state.lastMessageTime > WIFI_CONFIG_TIMEOUT_MS)) {
-            debugln("[WiFi Config] Timeout - resetting state");
-            memset(&state, 0, sizeof(state));
-        }
+    void loop() {
+        if (received.pending) {
+            uint8_t reply[2] = {PROVISION_SET_CREDENTIALS, PROVISION_SAVE_FAILED};
+            if (saveCredentials(received.ssid, received.password)) {
+                reply[1] = PROVISION_SAVED;
+            }
+            received.pending = false;
+            isoTp::send(link, reply, sizeof(reply));
+        }
+        isoTp::loop(link);
     }
 }
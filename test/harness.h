@@ -0,0 +1,61 @@
+// Shared helpers for the Unity suites under test/ (pio test -e native)
+//
+// Each suite is its own program: it includes the whole firmware through this
+// header, runs setup() once on the fake HAL and drives it with frames on the
+// virtual clock, like src/host/nativeMain.cpp does.
+#pragma once
+#include <unity.h>
+#include <vector>
+#include "../src/main.cpp"
+
+static std::vector<twai_message_t> sentFrames;  // Every frame the module sent since the last clearSent()
+
+static twai_message_t frame(uint32_t id, std::initializer_list<uint8_t> data)
+{
+    twai_message_t message = {};
+    message.identifier = id;
+    for (uint8_t byte : data) {
+        message.data[message.data_length_code++] = byte;
+    }
+    return message;
+}
+
+/**
+ * Deliver a frame to the RX callback, as the TWAI driver task would
+ * Skips the acceptance filter, which was set up for the boot node address
+ */
+static void rx(const twai_message_t &message)
+{
+    canHelper::handle_rx_message(message);
+    hal::native::runTasks();
+}
+
+/**
+ * Advance the virtual clock, running loop() every millisecond
+ */
+static void runFor(uint32_t ms)
+{
+    uint32_t end = hal::millis() + ms;
+    while (hal::millis() < end) {
+        hal::native::advanceTo(hal::millis() + 1);
+        loop();
+    }
+}
+
+static void clearSent()
+{
+    sentFrames.clear();
+}
+
+/**
+ * Boot the firmware, capture what it sends and stop the startup show
+ * Call once from main() before UNITY_BEGIN()
+ */
+static void bootFirmware()
+{
+    hal::native::onCanSend = [](const twai_message_t &message) { sentFrames.push_back(message); };
+    setup();
+    lightSequences::stop();
+    runFor(100);
+    clearSent();
+}
@@ -0,0 +1,92 @@
+// CAN receive dispatch: minimum DLC, unhandled IDs, per-node and shared routing
+#include "../harness.h"
+
+void setUp()
+{
+    nodeAddress::address = 0;
+    canDispatch::unhandledFrames = 0;
+    canDispatch::shortFrames = 0;
+    rx(frame(CAN_BULK_BRIGHTNESS_ID, {0, 0, 0, 0, 0, 0, 0, 0}));
+    runFor(10);
+}
+
+void tearDown()
+{
+    nodeAddress::address = 0;
+}
+
+static void test_frame_at_minimum_dlc_is_dispatched()
+{
+    rx(frame(21, {2, 100}));
+    TEST_ASSERT_EQUAL_UINT8(100, outputState::level(2));
+    TEST_ASSERT_EQUAL_UINT32(0, canDispatch::shortFrames);
+}
+
+static void test_frame_below_minimum_dlc_is_counted_short()
+{
+    rx(frame(21, {2}));
+    rx(frame(CAN_BULK_BRIGHTNESS_ID, {9, 9, 9, 9, 9, 9, 9}));
+    TEST_ASSERT_EQUAL_UINT32(2, canDispatch::shortFrames);
+    TEST_ASSERT_EQUAL_UINT32(0, canDispatch::unhandledFrames);
+    for (uint8_t ch = 0; ch < 8; ch++) {
+        TEST_ASSERT_EQUAL_UINT8(0, outputState::level(ch));
+    }
+}
+
+static void test_unregistered_ids_are_counted_unhandled()
+{
+    rx(frame(0x10, {2, 100}));   // Free function ID in the node's block
+    rx(frame(0x7FF, {2, 100}));  // Past the last node's block
+    twai_message_t remote = frame(21, {});
+    remote.rtr = 1;
+    remote.data_length_code = 2;
+    rx(remote);
+    TEST_ASSERT_EQUAL_UINT32(3, canDispatch::unhandledFrames);
+    TEST_ASSERT_EQUAL_UINT32(0, canDispatch::shortFrames);
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(2));
+}
+
+static void test_per_node_ids_follow_the_address()
+{
+    nodeAddress::address = 2;
+    TEST_ASSERT_EQUAL_UINT32(CAN_DISPATCH_TABLE_SIZE, canDispatch::functionIdOf(21));
+    TEST_ASSERT_EQUAL_UINT32(21, canDispatch::functionIdOf(2 * CAN_NODE_ID_STRIDE + 21));
+
+    rx(frame(21, {3, 50}));                            // Node 0's brightness ID
+    TEST_ASSERT_EQUAL_UINT32(1, canDispatch::unhandledFrames);
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(3));
+
+    rx(frame(2 * CAN_NODE_ID_STRIDE + 21, {3, 50}));   // Node 2's
+    TEST_ASSERT_EQUAL_UINT8(50, outputState::level(3));
+    TEST_ASSERT_EQUAL_UINT32(1, canDispatch::unhandledFrames);
+}
+
+static void test_shared_ids_are_the_same_on_every_node()
+{
+    nodeAddress::address = 2;
+    TEST_ASSERT_EQUAL_UINT32(GROUP_COMMAND_ID, canDispatch::functionIdOf(GROUP_COMMAND_ID));
+    TEST_ASSERT_EQUAL_UINT32(CAN_DISPATCH_TABLE_SIZE,
+                             canDispatch::functionIdOf(2 * CAN_NODE_ID_STRIDE + GROUP_COMMAND_ID));
+
+    rx(frame(GROUP_CONFIG_ID, {4, 2, 0x21}));          // Group 4 on node 2: channels 0 and 5
+    rx(frame(GROUP_CONFIG_ID, {4, 1, 0xFF}));          // Node 1's members are not ours
+    rx(frame(GROUP_COMMAND_ID, {4, 0x01, 80}));
+    TEST_ASSERT_EQUAL_UINT8(80, outputState::level(0));
+    TEST_ASSERT_EQUAL_UINT8(80, outputState::level(5));
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(1));
+    TEST_ASSERT_EQUAL_UINT32(0, canDispatch::unhandledFrames);
+
+    rx(frame(GROUP_CONFIG_ID, {4, 2, 0}));
+}
+
+int main()
+{
+    bootFirmware();
+    UNITY_BEGIN();
+    RUN_TEST(test_frame_at_minimum_dlc_is_dispatched);
+    RUN_TEST(test_frame_below_minimum_dlc_is_counted_short);
+    RUN_TEST(test_unregistered_ids_are_counted_unhandled);
+    RUN_TEST(test_per_node_ids_follow_the_address);
+    RUN_TEST(test_shared_ids_are_the_same_on_every_node);
+    return UNITY_END();
+}
@@ -0,0 +1,134 @@
+// WiFi provisioning over ISO-TP: replies for malformed, busy, saved and unsaved credentials
+#include "../harness.h"
+
+/**
+ * Send a provisioning message that fits one ISO-TP single frame
+ */
+static void provision(std::initializer_list<uint8_t> payload)
+{
+    twai_message_t message = frame(WIFI_CONFIG_ID, {(uint8_t)payload.size()});
+    for (uint8_t byte : payload) {
+        message.data[message.data_length_code++] = byte;
+    }
+    rx(message);
+}
+
+/**
+ * Status bytes of the provisioning replies sent since the last clearSent()
+ */
+static std::vector<uint8_t> replies()
+{
+    std::vector<uint8_t> statuses;
+    for (const twai_message_t &message : sentFrames) {
+        // Single frame [length 2, message type, status]
+        if (message.identifier == WIFI_CONFIG_RESPONSE_ID && message.data[0] == 0x02) {
+            statuses.push_back(message.data[2]);
+        }
+    }
+    return statuses;
+}
+
+void setUp()
+{
+    runFor(10);
+    clearSent();
+}
+
+void tearDown()
+{
+    hal::Nvs::writesFail = false;
+}
+
+static void test_ssid_longer_than_the_message_is_malformed()
+{
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 5, 'a', 'b'});
+    runFor(10);
+    TEST_ASSERT_EQUAL(1, replies().size());
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_MALFORMED, replies()[0]);
+    TEST_ASSERT_FALSE(wifiConfig::received.pending);
+}
+
+static void test_empty_ssid_is_malformed()
+{
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 0, 'p', 'w'});
+    runFor(10);
+    TEST_ASSERT_EQUAL(1, replies().size());
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_MALFORMED, replies()[0]);
+}
+
+static void test_unknown_message_type_is_malformed()
+{
+    provision({0x07, 2, 'a', 'b'});
+    runFor(10);
+    TEST_ASSERT_EQUAL(1, sentFrames.size());
+    TEST_ASSERT_EQUAL_HEX8(0x07, sentFrames[0].data[1]);
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_MALFORMED, sentFrames[0].data[2]);
+}
+
+static void test_credentials_are_saved_and_acknowledged()
+{
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 3, 'c', 'a', 'r', 'p', 'w'});
+    TEST_ASSERT_TRUE(wifiConfig::received.pending);
+    TEST_ASSERT_EQUAL(0, replies().size());  // Not before loop() has stored them
+
+    runFor(10);
+    TEST_ASSERT_EQUAL(1, replies().size());
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_SAVED, replies()[0]);
+    char ssid[33];
+    char password[64];
+    TEST_ASSERT_TRUE(wifiConfig::loadCredentials(ssid, password));
+    TEST_ASSERT_EQUAL_STRING("car", ssid);
+    TEST_ASSERT_EQUAL_STRING("pw", password);
+}
+
+static void test_second_message_before_the_save_is_busy()
+{
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 3, 'o', 'n', 'e', '1'});
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 3, 't', 'w', 'o', '2'});
+    runFor(10);
+    std::vector<uint8_t> statuses = replies();
+    TEST_ASSERT_EQUAL(2, statuses.size());
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_BUSY, statuses[0]);
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_SAVED, statuses[1]);
+    char ssid[33];
+    char password[64];
+    TEST_ASSERT_TRUE(wifiConfig::loadCredentials(ssid, password));
+    TEST_ASSERT_EQUAL_STRING("one", ssid);  // The busy message changed nothing
+}
+
+static void test_empty_password_is_saved()
+{
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 4, 'o', 'p', 'e', 'n'});
+    runFor(10);
+    TEST_ASSERT_EQUAL(1, replies().size());
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_SAVED, replies()[0]);
+    char ssid[33];
+    char password[64];
+    TEST_ASSERT_TRUE(wifiConfig::loadCredentials(ssid, password));
+    TEST_ASSERT_EQUAL_STRING("open", ssid);
+    TEST_ASSERT_EQUAL_STRING("", password);
+}
+
+static void test_short_nvs_write_is_reported()
+{
+    hal::Nvs::writesFail = true;
+    provision({wifiConfig::PROVISION_SET_CREDENTIALS, 4, 'f', 'u', 'l', 'l', 'x'});
+    runFor(10);
+    TEST_ASSERT_EQUAL(1, replies().size());
+    TEST_ASSERT_EQUAL_HEX8(wifiConfig::PROVISION_SAVE_FAILED, replies()[0]);
+    TEST_ASSERT_FALSE(strcmp(runtimeSsid, "full") == 0);  // Runtime credentials left alone
+}
+
+int main()
+{
+    bootFirmware();
+    UNITY_BEGIN();
+    RUN_TEST(test_ssid_longer_than_the_message_is_malformed);
+    RUN_TEST(test_empty_ssid_is_malformed);
+    RUN_TEST(test_unknown_message_type_is_malformed);
+    RUN_TEST(test_credentials_are_saved_and_acknowledged);
+    RUN_TEST(test_second_message_before_the_save_is_busy);
+    RUN_TEST(test_empty_password_is_saved);
+    RUN_TEST(test_short_nvs_write_is_reported);
+    return UNITY_END();
+}
@@ -0,0 +1,164 @@
+// Keyframe tables: isValid(), playback and manual commands overriding a sequence
+#include "../harness.h"
+
+using namespace lightSequences;
+
+constexpr Keyframe stepsFrames[] = {
+    set(CH1, 200, 100),
+    fade(CH1, 0, 200, CURVE_EASE_IN_OUT),
+    set(CH2, 50),
+};
+constexpr Sequence steps = compile(stepsFrames);
+
+constexpr Keyframe linearFrames[] = {
+    set(CH3, 255),
+    fade(CH3, 55, 500),
+};
+constexpr Sequence linear = compile(linearFrames);
+
+constexpr Keyframe blinkFrames[] = {
+    set(CH1, 100, 20),
+    set(CH1, 0, 20),
+    repeat(0, 2),
+};
+constexpr Sequence blink = compile(blinkFrames);
+
+constexpr Keyframe holdFrames[] = {
+    set(CH1 | CH2, 100),
+    wait(1000),
+    set(CH1 | CH2, 10),
+};
+constexpr Sequence hold = compile(holdFrames);
+
+void setUp()
+{
+    rx(frame(CAN_BULK_BRIGHTNESS_ID, {0, 0, 0, 0, 0, 0, 0, 0}));
+    runFor(10);
+}
+
+void tearDown()
+{
+    stop();
+}
+
+static void test_valid_tables_pass()
+{
+    TEST_ASSERT_TRUE(isValid(startupShowFrames));
+    TEST_ASSERT_TRUE(isValid(interiorSequence01Frames));
+    TEST_ASSERT_TRUE(isValid(exteriorSequence01Frames));
+    TEST_ASSERT_TRUE(isValid(blinkFrames));
+
+    const Keyframe twoLoops[] = {set(CH1, 1, 10), repeat(0, 1), set(CH1, 2, 10), repeat(2, 3)};
+    TEST_ASSERT_TRUE(isValid(twoLoops));
+}
+
+static void test_invalid_tables_fail()
+{
+    TEST_ASSERT_FALSE(isValid(stepsFrames, 0));
+
+    const Keyframe forward[] = {repeat(1, 1), set(CH1, 1, 10)};
+    TEST_ASSERT_FALSE(isValid(forward));
+
+    const Keyframe toItself[] = {set(CH1, 1, 10), repeat(1, 1)};
+    TEST_ASSERT_FALSE(isValid(toItself));
+
+    const Keyframe zeroCount[] = {set(CH1, 1, 10), repeat(0, 0)};
+    TEST_ASSERT_FALSE(isValid(zeroCount));
+
+    TEST_ASSERT_FALSE(isValid(nestedRepeatFrames));
+
+    static Keyframe tooLong[256];
+    TEST_ASSERT_FALSE(isValid(tooLong));
+}
+
+static void test_sequence_steps_through_its_frames()
+{
+    play(steps);
+    runFor(50);
+    TEST_ASSERT_TRUE(isPlaying());
+    TEST_ASSERT_EQUAL_UINT8(200, outputState::level(0));
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(1));
+
+    runFor(150);  // Halfway through the fade, computed per tick
+    uint8_t fading = outputState::level(0);
+    TEST_ASSERT_TRUE(fading > 50 && fading < 150);
+
+    runFor(150);
+    TEST_ASSERT_FALSE(isPlaying());
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(0));
+    TEST_ASSERT_EQUAL_UINT8(50, outputState::level(1));
+}
+
+static void test_linear_fade_is_handed_to_the_hardware()
+{
+    play(linear);
+    runFor(100);
+    outputState::Snapshot outputs = outputState::read();
+    TEST_ASSERT_EQUAL_UINT8(55, outputs.levels[2]);  // The target, published once
+    TEST_ASSERT_TRUE(outputs.fadeMs[2] > 400 && outputs.fadeMs[2] <= 500);
+    TEST_ASSERT_TRUE(isPlaying());
+    runFor(500);
+    TEST_ASSERT_FALSE(isPlaying());
+    TEST_ASSERT_EQUAL_UINT32(dimmingCurves::duty(2, 55 << 8), hal::pwmGetDuty(2));
+}
+
+static void test_repeat_plays_the_loop_again()
+{
+    play(blink);
+    runFor(90);  // Third of three 40 ms rounds
+    TEST_ASSERT_TRUE(isPlaying());
+    TEST_ASSERT_EQUAL_UINT8(100, outputState::level(0));
+    runFor(40);
+    TEST_ASSERT_FALSE(isPlaying());
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(0));
+}
+
+static void test_manual_command_takes_a_channel_from_the_sequence()
+{
+    play(hold);
+    runFor(50);
+    TEST_ASSERT_EQUAL_UINT8(100, outputState::level(0));
+
+    rx(frame(21, {0, 255}));
+    runFor(1100);
+    TEST_ASSERT_EQUAL_UINT8(255, outputState::level(0));  // Released: the last frame skips it
+    TEST_ASSERT_EQUAL_UINT8(10, outputState::level(1));   // Still owned by the sequence
+    TEST_ASSERT_FALSE(isPlaying());
+}
+
+static void test_overriding_every_channel_stops_the_sequence()
+{
+    play(hold);
+    runFor(50);
+    rx(frame(24, {9, 1}));  // All on
+    TEST_ASSERT_FALSE(isPlaying());
+    runFor(1100);
+    TEST_ASSERT_EQUAL_UINT8(255, outputState::level(0));
+    TEST_ASSERT_EQUAL_UINT8(255, outputState::level(1));
+}
+
+static void test_playing_again_replaces_the_running_sequence()
+{
+    play(hold);
+    runFor(50);
+    play(steps);
+    runFor(400);
+    TEST_ASSERT_FALSE(isPlaying());
+    TEST_ASSERT_EQUAL_UINT8(0, outputState::level(0));
+    TEST_ASSERT_EQUAL_UINT8(50, outputState::level(1));  // Not hold's final 10
+}
+
+int main()
+{
+    bootFirmware();
+    UNITY_BEGIN();
+    RUN_TEST(test_valid_tables_pass);
+    RUN_TEST(test_invalid_tables_fail);
+    RUN_TEST(test_sequence_steps_through_its_frames);
+    RUN_TEST(test_linear_fade_is_handed_to_the_hardware);
+    RUN_TEST(test_repeat_plays_the_loop_again);
+    RUN_TEST(test_manual_command_takes_a_channel_from_the_sequence);
+    RUN_TEST(test_overriding_every_channel_stops_the_sequence);
+    RUN_TEST(test_playing_again_replaces_the_running_sequence);
+    return UNITY_END();
+}